@@ -0,0 +1,422 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+// Microbenchmarks of the gap and file index hot paths, run against aged,
+// simulated volumes of increasing size (or stored layouts).
+
+#include "bench.hpp"
+
+#include "aging.hpp"
+#include "journal.hpp"
+#include "zen.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+
+#include <psapi.h>
+
+#include <boost/program_options.hpp>
+
+namespace
+{
+
+// C++ heap accounting.
+// Allocations done by zenwinx itself (winx_malloc, i.e. region and block
+// map list entries) go to the NT heap and are not counted here.
+struct Heap {
+  uint64_t allocations;
+  uint64_t live;
+  uint64_t peak;
+};
+Heap heap = { 0, 0, 0 };
+
+const size_t heapHeader = 16;
+
+} // namespace
+
+void *operator new(size_t n)
+{
+  auto p = (char *)malloc(n + heapHeader);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  *(size_t *)p = n;
+  heap.allocations++;
+  heap.live += n;
+  heap.peak = max(heap.peak, heap.live);
+  return p + heapHeader;
+}
+
+void operator delete(void *p) throw()
+{
+  if (!p) {
+    return;
+  }
+  auto b = (char *)p - heapHeader;
+  heap.live -= *(size_t *)b;
+  free(b);
+}
+
+void *operator new[](size_t n)
+{
+  return operator new(n);
+}
+
+void operator delete[](void *p) throw()
+{
+  operator delete(p);
+}
+
+namespace
+{
+
+volatile uintptr_t sink;
+
+template<typename Fn>
+void measure(const wchar_t *name, uint64_t ops, Fn fn)
+{
+  ops = max(ops, 1ULL);
+  auto allocs = heap.allocations;
+  Timer t;
+  fn();
+  auto ns = t.ns();
+  allocs = heap.allocations - allocs;
+  std::wcout << L"  " << std::setw(34) << std::left << name << std::right <<
+             std::setw(10) << ops << std::fixed << std::setprecision(1) <<
+             std::setw(14) << ns / ops << L" ns/op" <<
+             std::setprecision(2) << std::setw(10) << (double)allocs / ops <<
+             L" allocs/op" << std::endl;
+}
+
+void run(zen::SimBackend &sim, uint64_t ops, unsigned seed)
+{
+  using namespace zen;
+
+  heap.peak = heap.live;
+  std::mt19937 rng(seed);
+
+  std::wcout << sim.table().size() << L" files, " << sim.clusters() <<
+             L" clusters, " << sim.usedClusters() << L" in use" << std::endl;
+
+  {
+    const auto &bitmap = sim.bitmap();
+    const auto reps = max(1ULL, 100000000ULL / max(sim.clusters(), 1ULL));
+    measure(L"winx_bitmap_to_regions", reps, [&]() {
+      for (auto i = 0ULL; i != reps; ++i) {
+        auto r = winx_bitmap_to_regions(bitmap.data(), 0, sim.clusters(),
+                                        nullptr, nullptr);
+        sink += (uintptr_t)r;
+        winx_release_free_volume_regions(r);
+      }
+    });
+  }
+
+  std::unique_ptr<GapEnumeration> ge;
+  std::unique_ptr<FileEnumeration> fe;
+  measure(L"GapEnumeration::scan", 1, [&]() {
+    ge.reset(new GapEnumeration(sim));
+  });
+  measure(L"FileEnumeration::scan", 1, [&]() {
+    fe.reset(new FileEnumeration(sim));
+  });
+  std::wcout << L"  " << ge->count() << L" gaps, " << fe->count() <<
+             L" processable files" << std::endl;
+
+  FileEnumeration::files_t files;
+  for (auto i = fe->begin(), e = fe->end(); i != e; ++i) {
+    files.push_back(i->second);
+  }
+  std::vector<winx_volume_region> gaps;
+  for (auto i = ge->begin(), e = ge->end(); i != e; ++i) {
+    gaps.push_back(*i->second);
+  }
+  if (files.empty() || gaps.empty()) {
+    std::wcout << L"  Nothing to benchmark" << std::endl;
+    return;
+  }
+  std::uniform_int_distribution<size_t> pickFile(0, files.size() - 1);
+  std::uniform_int_distribution<size_t> pickGap(0, gaps.size() - 1);
+
+  {
+    std::vector<uint64_t> sizes;
+    for (auto i = 0ULL; i != ops; ++i) {
+      sizes.push_back(files[pickFile(rng)]->disp.clusters);
+    }
+    measure(L"GapEnumeration::best", ops, [&]() {
+      for (auto i = sizes.begin(), e = sizes.end(); i != e; ++i) {
+        sink += (uintptr_t)ge->best(*i);
+      }
+    });
+  }
+
+  {
+    // Pop a prefix of distinct gaps, then push it back in reverse order,
+    // which restores the enumeration.
+    std::vector<winx_volume_region> sample(gaps);
+    std::shuffle(sample.begin(), sample.end(), rng);
+    sample.resize((size_t)min((uint64_t)sample.size(), ops));
+    std::vector<winx_blockmap> blocks(sample.size());
+    std::vector<winx_file_info> fakes(sample.size());
+    ExtentTable extents;
+    for (size_t i = 0; i != sample.size(); ++i) {
+      std::uniform_int_distribution<uint64_t> len(1, sample[i].length);
+      auto &b = blocks[i];
+      b.next = b.prev = &b;
+      b.vcn = 0;
+      b.lcn = sample[i].lcn;
+      b.length = len(rng);
+      memset(&fakes[i], 0, sizeof(winx_file_info));
+      fakes[i].disp.blockmap = &b;
+      fakes[i].disp.clusters = b.length;
+      extents.add(&fakes[i]);
+    }
+    measure(L"GapEnumeration::pop", blocks.size(), [&]() {
+      for (auto i = blocks.begin(), e = blocks.end(); i != e; ++i) {
+        ge->pop(i->lcn, i->length);
+      }
+    });
+    measure(L"GapEnumeration::push", fakes.size(), [&]() {
+      for (auto i = fakes.rbegin(), e = fakes.rend(); i != e; ++i) {
+        ge->push(extents, &*i);
+      }
+    });
+  }
+
+  {
+    // Questions the resident bitmap answers without going to the volume.
+    std::uniform_int_distribution<uint64_t> lcn(0, sim.clusters() - 1);
+    std::vector<uint64_t> lcns;
+    for (auto i = 0ULL; i != ops; ++i) {
+      lcns.push_back(lcn(rng));
+    }
+    measure(L"GapEnumeration::freeClusters", ops, [&]() {
+      for (auto i = lcns.begin(), e = lcns.end(); i != e; ++i) {
+        sink += ge->freeClusters(*i, *i + 65536);
+      }
+    });
+    measure(L"GapEnumeration::nextFree", ops, [&]() {
+      for (auto i = lcns.begin(), e = lcns.end(); i != e; ++i) {
+        sink += ge->nextFree(*i);
+      }
+    });
+    measure(L"GapEnumeration::rebuild", 1, [&]() {
+      ge->rebuild();
+    });
+  }
+
+  {
+    auto n = min(ops, 10000ULL);
+    std::vector<winx_volume_region> sample;
+    for (auto i = 0ULL; i != n; ++i) {
+      sample.push_back(gaps[pickGap(rng)]);
+    }
+    measure(L"FileEnumeration::findBest", n, [&]() {
+      for (auto i = sample.begin(), e = sample.end(); i != e; ++i) {
+        sink += fe->findBest(i->lcn, i->length, true).size();
+      }
+    });
+  }
+
+  {
+    measure(L"FileEnumeration::findAt (index)", 1, [&]() {
+      sink += (uintptr_t)fe->findAt(0);
+    });
+    std::vector<uint64_t> lcns;
+    for (auto i = 0ULL; i != ops; ++i) {
+      lcns.push_back(fe->lcn(files[pickFile(rng)]));
+    }
+    measure(L"FileEnumeration::findAt", ops, [&]() {
+      for (auto i = lcns.begin(), e = lcns.end(); i != e; ++i) {
+        sink += (uintptr_t)fe->findAt(*i);
+      }
+    });
+  }
+
+  {
+    FileEnumeration::files_t sample(files);
+    std::shuffle(sample.begin(), sample.end(), rng);
+    sample.resize((size_t)min((uint64_t)sample.size(), ops));
+    measure(L"FileEnumeration::pop", sample.size(), [&]() {
+      for (auto i = sample.begin(), e = sample.end(); i != e; ++i) {
+        fe->pop(*i);
+      }
+    });
+    measure(L"FileEnumeration::push", sample.size(), [&]() {
+      for (auto i = sample.begin(), e = sample.end(); i != e; ++i) {
+        fe->push(*i);
+      }
+    });
+  }
+
+  measure(L"FileEnumeration::lcn", files.size(), [&]() {
+    for (auto i = files.begin(), e = files.end(); i != e; ++i) {
+      sink += (uintptr_t)fe->lcn(*i);
+    }
+  });
+
+  fe.reset();
+  ge.reset();
+
+  PROCESS_MEMORY_COUNTERS pmc;
+  memset(&pmc, 0, sizeof(pmc));
+  ::GetProcessMemoryInfo(::GetCurrentProcess(), &pmc, sizeof(pmc));
+  std::wcout << L"  Peak C++ heap: " << mb(heap.peak) <<
+             L", peak process private bytes: " << mb(pmc.PeakPagefileUsage) <<
+             std::endl;
+}
+
+// Parses a raw $UsnJrnl:$J dump, like a scan cache gets refreshed from.
+void journal(const std::wstring &file)
+{
+  Timer t;
+  auto j = zen::Journal::load(file);
+  auto ns = t.ns();
+  uint64_t created = 0, deleted = 0, changed = 0;
+  const auto &changes = j->changes();
+  for (auto i = changes.begin(), e = changes.end(); i != e; ++i) {
+    if (i->second.deleted()) {
+      deleted++;
+    }
+    else if (i->second.created()) {
+      created++;
+    }
+    else if (i->second.reasons & zen::Journal::clusterChanges) {
+      changed++;
+    }
+  }
+  std::wcout << file << L": " << j->records() << L" records of " <<
+             changes.size() << L" files, " << created << L" created, " <<
+             deleted << L" deleted, " << changed << L" changed clusters" <<
+             std::endl;
+  std::wcout << L"  Parsed in " << std::fixed << std::setprecision(1) <<
+             ns / 1e6 << L" ms, " << ns / max(j->records(), 1ULL) <<
+             L" ns/record" << std::endl;
+}
+
+} // namespace
+
+std::wstring mb(uint64_t bytes)
+{
+  std::wstringstream ss;
+  ss << std::fixed << std::setprecision(1) << bytes / 1048576.0 << L" MB";
+  return ss.str();
+}
+
+int main(int argc, char **argv)
+{
+  namespace po = boost::program_options;
+
+  std::vector<uint64_t> sizes;
+  std::vector<std::string> layouts;
+  std::string plannerOptions;
+  std::vector<std::string> images;
+  std::vector<std::string> journals;
+  uint64_t ops;
+  unsigned seed;
+
+  po::options_description desc("Allowed options");
+  desc.add_options()
+  ("help,h",
+   "Produce this help message")
+  ("files,f",
+   po::value<std::vector<uint64_t> >(&sizes)->multitoken(),
+   "Sizes of the aged layouts to benchmark (default: 10000 100000 1000000)")
+  ("layout,l",
+   po::value<std::vector<std::string> >(&layouts)->multitoken(),
+   "Benchmark stored layouts instead")
+  ("planner,p",
+   "Run the whole planner on the stored layouts instead")
+  ("planner-options",
+   po::value<std::string>(&plannerOptions),
+   "Options for the planner, e.g. \"-a -w\"")
+  ("io,i",
+   po::value<std::vector<std::string> >(&images)->multitoken(),
+   "Measure read throughput and raw scan time on NTFS images instead")
+  ("journal,j",
+   po::value<std::vector<std::string> >(&journals)->multitoken(),
+   "Parse raw change journal ($UsnJrnl:$J) dumps instead")
+  ("check,c",
+   "Check the engine against layouts built for known corner cases instead")
+  ("ops,o",
+   po::value<uint64_t>(&ops)->default_value(100000),
+   "Operations per benchmark")
+  ("seed,s",
+   po::value<unsigned>(&seed)->default_value(1),
+   "Random seed")
+  ;
+
+  try {
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+    if (vm.count("help")) {
+      std::stringstream ss;
+      ss << desc;
+      std::wcout << L"Usage: bench [options]" << std::endl << std::endl <<
+                 ss.str().c_str() << std::endl;
+      return 1;
+    }
+
+    zen::winx zw;
+
+    if (!images.empty()) {
+      for (auto i = images.begin(), e = images.end(); i != e; ++i) {
+        io(util::to_wstring(*i));
+      }
+      return 0;
+    }
+
+    if (vm.count("check")) {
+      check();
+      return 0;
+    }
+
+    if (!journals.empty()) {
+      for (auto i = journals.begin(), e = journals.end(); i != e; ++i) {
+        journal(util::to_wstring(*i));
+      }
+      return 0;
+    }
+
+    if (vm.count("planner")) {
+      if (layouts.empty()) {
+        throw std::exception("The planner benchmark needs --layout");
+      }
+      for (auto i = layouts.begin(), e = layouts.end(); i != e; ++i) {
+        planner(util::to_wstring(*i), util::to_wstring(plannerOptions));
+      }
+      return 0;
+    }
+
+    for (auto i = layouts.begin(), e = layouts.end(); i != e; ++i) {
+      auto file = util::to_wstring(*i);
+      std::wcout << file << L": ";
+      auto sim = zen::SimBackend::load(file);
+      run(*sim, ops, seed);
+      std::wcout << std::endl;
+    }
+    if (layouts.empty() && sizes.empty()) {
+      sizes.push_back(10000);
+      sizes.push_back(100000);
+      sizes.push_back(1000000);
+    }
+    for (auto i = sizes.begin(), e = sizes.end(); i != e; ++i) {
+      zen::AgingOptions opts;
+      opts.files = *i;
+      opts.seed = seed;
+      std::wcout << L"Aged layout: ";
+      auto sim = zen::age(opts);
+      run(*sim, ops, seed);
+      std::wcout << std::endl;
+    }
+  }
+  catch (const std::exception &ex) {
+    std::wcerr << L"Failed: " << util::to_wstring(ex.what()) << std::endl;
+    return 2;
+  }
+  return 0;
+}
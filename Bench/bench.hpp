@@ -0,0 +1,41 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#pragma once
+
+#include "util.hpp"
+
+#include <cstdint>
+#include <string>
+
+class Timer
+{
+private:
+  LARGE_INTEGER start_;
+
+public:
+  Timer() {
+    ::QueryPerformanceCounter(&start_);
+  }
+  double ns() const {
+    LARGE_INTEGER li, freq;
+    ::QueryPerformanceCounter(&li);
+    ::QueryPerformanceFrequency(&freq);
+    return (li.QuadPart - start_.QuadPart) * 1e9 / freq.QuadPart;
+  }
+};
+
+std::wstring mb(uint64_t bytes);
+
+// Runs the whole Operation against a stored layout and reports speed and
+// fill quality. |options| are regular stopgap options, e.g. L"-a -w".
+void planner(const std::wstring &layout, const std::wstring &options);
+
+// Reads an NTFS image through zenwinx read queues of different depths,
+// buffered and unbuffered, and times a raw MFT scan of it.
+void io(const std::wstring &image);
+
+// Runs the whole Operation against small layouts built for cases the engine
+// got wrong before. Throws on the first one it still gets wrong.
+void check();
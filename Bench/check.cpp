@@ -0,0 +1,187 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+// Runs against small layouts built for cases the engine got wrong before.
+
+#include "bench.hpp"
+
+#include "op.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+namespace
+{
+
+// Files of |clusters| each, back to back, but for those in |holes|.
+std::unique_ptr<zen::SimBackend> packed(uint64_t files, uint64_t clusters,
+                                        const std::vector<uint64_t> &holes)
+{
+  std::unique_ptr<zen::SimBackend> rv(new zen::SimBackend(files * clusters));
+  for (auto i = 0ULL; i != files; ++i) {
+    if (std::find(holes.begin(), holes.end(), i) != holes.end()) {
+      continue;
+    }
+    std::wstringstream ss;
+    ss << L"\\??\\S:\\file" << i;
+    rv->add(ss.str(),
+            zen::SimBackend::extents_t(1, zen::SimBackend::Extent(
+                                         0, i * clusters, clusters)));
+  }
+  return rv;
+}
+
+std::wstring tempFile(const wchar_t *name)
+{
+  wchar_t dir[MAX_PATH + 1];
+  if (!::GetTempPathW(MAX_PATH + 1, dir)) {
+    throw std::exception("Failed to get the temp directory");
+  }
+  return std::wstring(dir) + name;
+}
+
+// Takes the target area of the first move away right before the move, like
+// another process allocating clusters meanwhile.
+class Thief : public zen::Backend
+{
+private:
+  zen::SimBackend &sim_;
+  bool stolen_;
+
+public:
+  explicit Thief(zen::SimBackend &sim) : sim_(sim), stolen_(false) {
+    info = sim.info;
+  }
+
+  bool stolen() const {
+    return stolen_;
+  }
+
+  virtual winx_volume_region *gaps() override {
+    return sim_.gaps();
+  }
+  virtual winx_volume_region *gaps(uint64_t lcn, uint64_t count) override {
+    return sim_.gaps(lcn, count);
+  }
+  virtual winx_file_info *files(ftw_filter_callback filter,
+                                ftw_progress_callback cb, ftw_terminator t,
+                                void *userdata) override {
+    return sim_.files(filter, cb, t, userdata);
+  }
+  virtual int dump(winx_file_info *f) override {
+    return sim_.dump(f);
+  }
+  virtual NTSTATUS move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                        uint64_t lcn) override {
+    if (!stolen_) {
+      stolen_ = true;
+      sim_.allocate(lcn, count);
+    }
+    return sim_.move(f, vcn, count, lcn);
+  }
+};
+
+// A run whose first move fails, because the gap vanished, replays alike.
+void replayFailedMove()
+{
+  const auto file = tempFile(L"stopgap-check.trace");
+  std::vector<uint64_t> holes;
+  holes.push_back(2);
+  holes.push_back(5);
+  auto sim = packed(128, 8, holes);
+  auto thief = new Thief(*sim);
+  {
+    // Set up like Operation::init does for --trace.
+    Operation op;
+    std::wstring args[] = { L"stopgap", L"S" };
+    wchar_t *argv[] = { &args[0][0], &args[1][0] };
+    op.opts.parse(2, argv);
+    zen::TraceBackend::Options to;
+    to.maxSize = op.opts.maxSize;
+    to.aggressive = op.opts.aggressive;
+    to.gaps = op.opts.gaps;
+    to.defrag = op.opts.defrag;
+    to.widen = op.opts.widen;
+    op.tracer = new zen::TraceBackend(std::unique_ptr<zen::Backend>(thief),
+                                      file, to);
+    op.vol.init(std::unique_ptr<zen::Backend>(op.tracer));
+    op.opts.maxSize = op.opts.maxSize * 1024 / op.vol.info.bytes_per_cluster;
+    op.ge.reset(new zen::GapEnumeration(op.vol.backend()));
+    op.fe.reset(new zen::FileEnumeration(op.vol.backend()));
+    op.run();
+    if (!thief->stolen() || !op.moved) {
+      throw std::exception("The recorded run did not go as planned");
+    }
+  }
+
+  Operation op;
+  std::wstring args[] = { L"stopgap", L"--replay", file };
+  wchar_t *argv[] = { &args[0][0], &args[1][0], &args[2][0] };
+  op.init(3, argv);
+  op.run();
+  ::DeleteFileW(file.c_str());
+  if (op.tracer->matched() != op.tracer->recorded()) {
+    throw std::exception("The replay missed recorded events");
+  }
+}
+
+// Popping more than the gap the index has at an lcn, because clusters got
+// freed behind the enumeration's back, reads the range from the volume again
+// instead of giving up.
+void popBeyondGap()
+{
+  std::vector<uint64_t> holes;
+  holes.push_back(2);
+  holes.push_back(5);
+  auto sim = packed(16, 8, holes);
+  zen::GapEnumeration ge(*sim);
+  auto g = ge.find(16);
+  if (!g || g->length != 8) {
+    throw std::exception("The layout did not come out as planned");
+  }
+
+  // The file behind the gap goes away unnoticed, then the gap gets popped
+  // along with the clusters the file left.
+  sim->release(24, 8);
+  ge.pop(16, 16);
+
+  zen::GapEnumeration fresh(*sim);
+  if (ge.count() != fresh.count()) {
+    throw std::exception("The gaps do not match the volume");
+  }
+  for (auto i = ge.begin(), j = fresh.begin(), e = ge.end(); i != e;
+       ++i, ++j) {
+    if (i->first != j->first || i->second->length != j->second->length) {
+      throw std::exception("The gaps do not match the volume");
+    }
+  }
+  for (uint64_t lcn = 0; lcn != sim->clusters(); ++lcn) {
+    if ((ge.freeClusters(lcn, lcn + 1) != 0) == sim->used(lcn)) {
+      throw std::exception("The bitmap does not match the volume");
+    }
+  }
+}
+
+struct Check {
+  const wchar_t *name;
+  void (*fn)();
+};
+
+const Check checks[] = {
+  { L"replay of a failed move", replayFailedMove },
+  { L"pop beyond an outdated gap", popBeyondGap },
+};
+
+} // namespace
+
+void check()
+{
+  for (auto i = std::begin(checks), e = std::end(checks); i != e; ++i) {
+    i->fn();
+    std::wcout << std::endl << i->name << L": " << util::green << L"ok" <<
+               util::clear << std::endl;
+  }
+}
@@ -0,0 +1,110 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#include "bench.hpp"
+
+#include "backend.hpp"
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+
+const ULONG chunkSize = 1 << 20;
+
+std::wstring nativePath(const std::wstring &path)
+{
+  auto len = ::GetFullPathNameW(path.c_str(), 0, nullptr, nullptr);
+  std::vector<wchar_t> full(len + 1);
+  if (!len ||
+      !::GetFullPathNameW(path.c_str(), len + 1, full.data(), nullptr)) {
+    throw std::exception("Invalid image path");
+  }
+  return std::wstring(L"\\??\\") + full.data();
+}
+
+// Reads the first |size| bytes of |path| in chunkSize chunks and returns
+// the throughput in MB/s.
+double readAll(const std::wstring &path, uint64_t size, int depth, int flags)
+{
+  auto q = winx_readq_open(path.c_str(), depth, chunkSize, flags);
+  if (!q) {
+    throw std::exception("Failed to open the image");
+  }
+  for (uint64_t offset = 0; offset < size; offset += chunkSize) {
+    if (winx_readq_add(q, offset, (ULONG)min((uint64_t)chunkSize,
+                       size - offset), offset) < 0) {
+      winx_readq_close(q);
+      throw std::exception("Failed to queue a read");
+    }
+  }
+
+  Timer t;
+  uint64_t bytes = 0;
+  char *data;
+  ULONG length;
+  int rv;
+  while ((rv = winx_readq_next(q, &data, nullptr, &length, nullptr)) > 0) {
+    bytes += length;
+  }
+  auto ns = t.ns();
+  winx_readq_close(q);
+  if (rv < 0) {
+    throw std::exception("Failed to read the image");
+  }
+  return bytes / 1048576.0 / (ns / 1e9);
+}
+
+} // namespace
+
+void io(const std::wstring &image)
+{
+  WIN32_FILE_ATTRIBUTE_DATA fad;
+  if (!::GetFileAttributesExW(image.c_str(), GetFileExInfoStandard, &fad)) {
+    throw std::exception("Failed to open the image");
+  }
+  ULARGE_INTEGER size;
+  size.LowPart = fad.nFileSizeLow;
+  size.HighPart = fad.nFileSizeHigh;
+  // Unbuffered reads need whole sectors; 4K covers any sector size.
+  const auto aligned = size.QuadPart & ~4095ULL;
+  const auto path = nativePath(image);
+
+  std::wcout << std::endl << image << L" (" << mb(size.QuadPart) << L")" <<
+             std::endl << std::fixed << std::setprecision(1);
+
+  // Unbuffered first, so that the cache does not flatter the cold numbers.
+  const int depths[] = { 1, 4, 16, 32 };
+  for (auto i = 0; i != sizeof(depths) / sizeof(*depths); ++i) {
+    std::wcout << L"  Unbuffered, depth " << std::setw(2) << depths[i] <<
+               L":  " << std::setw(8) <<
+               readAll(path, aligned, depths[i], WINX_READQ_UNBUFFERED) <<
+               L" MB/s" << std::endl;
+  }
+  for (auto i = 0; i != sizeof(depths) / sizeof(*depths); ++i) {
+    std::wcout << L"  Buffered, depth " << std::setw(2) << depths[i] <<
+               L":    " << std::setw(8) <<
+               readAll(path, size.QuadPart, depths[i], 0) << L" MB/s" <<
+               std::endl;
+  }
+  std::wcout << L"  Synchronous:          " << std::setw(8) <<
+             readAll(path, size.QuadPart, 1, WINX_READQ_SYNC) << L" MB/s" <<
+             std::endl;
+
+  auto raw = path;
+  Timer t;
+  auto files = winx_scan_image(&raw[0], 'I',
+                               WINX_FTW_SKIP_RESIDENT_STREAMS |
+                               WINX_FTW_DUMP_FILES,
+                               nullptr, nullptr, nullptr, nullptr);
+  auto ns = t.ns();
+  if (!files) {
+    throw std::exception("Failed to scan the image");
+  }
+  winx_scan_disk_release(files);
+  std::wcout << L"  Raw MFT scan:         " << std::setw(8) << ns / 1e6 <<
+             L" ms" << std::endl;
+}
@@ -0,0 +1,79 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#include "bench.hpp"
+
+#include "op.hpp"
+
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+namespace
+{
+
+double cpuSeconds()
+{
+  FILETIME creation, exit, kernel, user;
+  if (!::GetProcessTimes(::GetCurrentProcess(), &creation, &exit, &kernel,
+                         &user)) {
+    return 0;
+  }
+  ULARGE_INTEGER k, u;
+  k.LowPart = kernel.dwLowDateTime;
+  k.HighPart = kernel.dwHighDateTime;
+  u.LowPart = user.dwLowDateTime;
+  u.HighPart = user.dwHighDateTime;
+  return (k.QuadPart + u.QuadPart) / 1e7;
+}
+
+} // namespace
+
+void planner(const std::wstring &layout, const std::wstring &options)
+{
+  std::vector<std::wstring> args;
+  args.push_back(L"stopgap");
+  args.push_back(L"--layout");
+  args.push_back(layout);
+  std::wistringstream ss(options);
+  std::wstring arg;
+  while (ss >> arg) {
+    args.push_back(arg);
+  }
+  std::vector<wchar_t *> argv;
+  for (auto i = args.begin(), e = args.end(); i != e; ++i) {
+    argv.push_back(&(*i)[0]);
+  }
+
+  Operation op;
+  op.init((int)argv.size(), argv.data());
+  auto &sim = dynamic_cast<zen::SimBackend &>(op.vol.backend());
+
+  auto cpu = cpuSeconds();
+  Timer t;
+  op.run();
+  auto wall = t.ns() / 1e9;
+  cpu = cpuSeconds() - cpu;
+
+  // Score what is left, from a fresh look at the volume.
+  uint64_t small = 0, largest = 0;
+  zen::GapEnumeration ge(sim);
+  for (auto i = ge.begin(), e = ge.end(); i != e; ++i) {
+    if (i->second->length <= op.opts.maxSize) {
+      small += i->second->length;
+    }
+    largest = max(largest, i->second->length);
+  }
+
+  const auto bpc = sim.info.bytes_per_cluster;
+  std::wcout << std::endl << layout << L" " << options << std::endl <<
+             std::fixed << std::setprecision(3) <<
+             L"  Wall time:            " << wall << L" s" << std::endl <<
+             L"  CPU time:             " << cpu << L" s" << std::endl <<
+             L"  Moves:                " << sim.moves() << std::endl <<
+             L"  Clusters moved:       " << sim.movedClusters() << std::endl <<
+             L"  Final gaps:           " << ge.count() << std::endl <<
+             L"  Small gaps remaining: " << mb(small * bpc) << std::endl <<
+             L"  Largest free extent:  " << mb(largest * bpc) << std::endl;
+}
@@ -0,0 +1,265 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#include "aging.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+namespace
+{
+
+using zen::SimBackend;
+
+inline unsigned lowest(uint64_t v)
+{
+#ifdef _MSC_VER
+  unsigned long rv;
+  _BitScanForward64(&rv, v);
+  return rv;
+#else
+  return __builtin_ctzll(v);
+#endif
+}
+
+// Next-fit cluster allocator, working on whole words of the bitmap where
+// possible, as aging runs allocate billions of clusters.
+class Allocator
+{
+private:
+  std::vector<uint64_t> words_; // Set == in use.
+  const uint64_t clusters_;
+  uint64_t used_;
+  uint64_t hint_;
+
+public:
+  explicit Allocator(uint64_t clusters)
+    : words_((size_t)((clusters + 63) / 64), 0), clusters_(clusters), used_(0),
+      hint_(0) {
+    if (clusters_ % 64) {
+      // Bits behind the end of the volume are never free.
+      words_.back() = ~0ULL << (clusters_ % 64);
+    }
+  }
+
+  uint64_t free() const {
+    return clusters_ - used_;
+  }
+
+  // First cluster in [lcn, end) with a bit different from |skip|, or |end|.
+  uint64_t next(uint64_t lcn, uint64_t end, uint64_t skip) const {
+    end = min(end, clusters_);
+    if (lcn >= end) {
+      return end;
+    }
+    auto idx = (size_t)(lcn / 64);
+    const auto last = (size_t)((end - 1) / 64);
+    auto w = (words_[idx] ^ skip) & (~0ULL << (lcn % 64));
+    while (!w) {
+      if (++idx > last) {
+        return end;
+      }
+      w = words_[idx] ^ skip;
+    }
+    return min(idx * 64ULL + lowest(w), end);
+  }
+
+  bool used(uint64_t lcn) const {
+    return ((words_[(size_t)(lcn / 64)] >> (lcn % 64)) & 1) != 0;
+  }
+
+  void mark(uint64_t lcn, uint64_t length, bool inUse) {
+    for (auto c = lcn, e = lcn + length; c != e; ++c) {
+      auto &w = words_[(size_t)(c / 64)];
+      const auto m = 1ULL << (c % 64);
+      if (inUse && !(w & m)) {
+        w |= m;
+        used_++;
+      }
+      else if (!inUse && (w & m)) {
+        w &= ~m;
+        used_--;
+      }
+    }
+  }
+
+  uint64_t nextFree(uint64_t lcn) const {
+    return next(lcn, clusters_, ~0ULL);
+  }
+
+  // Free clusters at |lcn|, but no more than |length|.
+  uint64_t freeRun(uint64_t lcn, uint64_t length) const {
+    return next(lcn, lcn + length, 0) - lcn;
+  }
+
+  // Allocates |length| clusters for |vcn| onwards, continuing |extents|
+  // in place where the clusters behind the last extent are still free.
+  bool allocate(SimBackend::extents_t &extents, uint64_t vcn, uint64_t length) {
+    if (free() < length) {
+      return false;
+    }
+    if (!extents.empty()) {
+      auto &last = extents.back();
+      const auto end = last.lcn + last.length;
+      const auto n = freeRun(end, length);
+      if (n) {
+        mark(end, n, true);
+        last.length += n;
+        vcn += n;
+        length -= n;
+      }
+    }
+    while (length) {
+      auto lcn = nextFree(hint_);
+      if (lcn >= clusters_) {
+        lcn = nextFree(0);
+      }
+      const auto n = freeRun(lcn, length);
+      mark(lcn, n, true);
+      extents.push_back(SimBackend::Extent(vcn, lcn, n));
+      hint_ = lcn + n;
+      vcn += n;
+      length -= n;
+    }
+    return true;
+  }
+
+  // Releases everything from |vcn| onwards.
+  void truncate(SimBackend::extents_t &extents, uint64_t vcn) {
+    while (!extents.empty()) {
+      auto &last = extents.back();
+      if (last.vcn >= vcn) {
+        mark(last.lcn, last.length, false);
+        extents.pop_back();
+        continue;
+      }
+      if (last.vcn + last.length > vcn) {
+        const auto keep = vcn - last.vcn;
+        mark(last.lcn + keep, last.length - keep, false);
+        last.length = keep;
+      }
+      break;
+    }
+  }
+};
+
+struct Live {
+  uint64_t id;
+  uint64_t clusters;
+  SimBackend::extents_t extents;
+};
+
+std::wstring make_path(uint64_t id)
+{
+  std::wstringstream ss;
+  ss << L"\\??\\S:\\d" << id / 1000 << L"\\f" << id << L".bin";
+  return ss.str();
+}
+
+} // namespace
+
+namespace zen
+{
+
+std::unique_ptr<SimBackend> age(const AgingOptions &opts)
+{
+  const auto mean = max(opts.meanClusters, 1ULL);
+  const auto mft = max(16ULL, opts.files * 1024 / opts.bytesPerCluster);
+  auto clusters = opts.clusters;
+  if (!clusters) {
+    clusters = (uint64_t)(opts.files * mean / max(opts.fill, 0.01)) + mft;
+  }
+  const auto maxClusters = max(clusters / 64, 1ULL);
+
+  std::mt19937 rng(opts.seed);
+  // Heavy tailed sizes with the requested mean: lots of small files, some
+  // large ones.
+  const double sigma = 1.5;
+  std::lognormal_distribution<double> size(
+    std::log((double)mean) - sigma * sigma / 2, sigma);
+  auto draw = [&]() -> uint64_t {
+    return min(max((uint64_t)size(rng), 1ULL), maxClusters);
+  };
+  const double weights[] = {
+    (double)opts.create, (double)opts.append, (double)opts.truncate,
+    (double)opts.remove
+  };
+  std::discrete_distribution<int> op(weights, weights + 4);
+  enum { Create, Append, Truncate, Remove };
+
+  Allocator alloc(clusters);
+
+  // Real volumes have the MFT somewhere near, but not at, the start.
+  const auto mftLcn = clusters / 16;
+  alloc.mark(mftLcn, min(mft, clusters - mftLcn), true);
+
+  std::vector<Live> live;
+  live.reserve((size_t)opts.files);
+  uint64_t id = 0;
+  const auto ops = (uint64_t)(opts.files * opts.churn);
+  for (uint64_t i = 0; i < ops || live.size() < opts.files; ++i) {
+    auto kind = live.empty() ? Create : op(rng);
+    if (i >= ops) {
+      kind = Create;
+    }
+    else if (kind == Create && live.size() >= opts.files) {
+      kind = Remove;
+    }
+
+    if (kind == Create) {
+      Live f;
+      f.id = id++;
+      f.clusters = draw();
+      if (!alloc.allocate(f.extents, 0, f.clusters)) {
+        if (i >= ops || live.empty()) {
+          // Volume too small for the requested files.
+          break;
+        }
+        kind = Remove;
+      }
+      else {
+        live.push_back(f);
+        continue;
+      }
+    }
+
+    std::uniform_int_distribution<size_t> pick(0, live.size() - 1);
+    auto &f = live[pick(rng)];
+    switch (kind) {
+    case Append: {
+      auto n = max(draw() / 4, 1ULL);
+      if (alloc.allocate(f.extents, f.clusters, n)) {
+        f.clusters += n;
+      }
+      break;
+    }
+    case Truncate: {
+      std::uniform_int_distribution<uint64_t> to(0, f.clusters);
+      f.clusters = to(rng);
+      alloc.truncate(f.extents, f.clusters);
+      break;
+    }
+    case Remove:
+      alloc.truncate(f.extents, 0);
+      std::swap(f, live.back());
+      live.pop_back();
+      break;
+    }
+  }
+
+  std::unique_ptr<SimBackend> rv(new SimBackend(clusters, opts.bytesPerCluster));
+  rv->add(L"\\??\\S:\\$MFT",
+          SimBackend::extents_t(1, SimBackend::Extent(0, mftLcn,
+                                min(mft, clusters - mftLcn))));
+  std::sort(live.begin(), live.end(), [](const Live & a, const Live & b) {
+    return a.id < b.id;
+  });
+  for (auto i = live.begin(), e = live.end(); i != e; ++i) {
+    rv->add(make_path(i->id), i->extents);
+  }
+  return rv;
+}
+
+} // namespace zen
@@ -0,0 +1,43 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#pragma once
+
+#include "sim.hpp"
+
+#include <memory>
+
+namespace zen
+{
+
+// Parameters of a synthetic aging run.
+// The workload creates, appends to, truncates and deletes files, using a
+// next-fit cluster allocator much like NTFS does, until the volume reached
+// the requested number of files and amount of churn.
+struct AgingOptions {
+  uint64_t files;           // Live files at the end of the run.
+  uint64_t clusters;        // Volume size; 0 == derive from files and fill.
+  uint64_t bytesPerCluster;
+  double fill;              // Target volume fill, when deriving the size.
+  double churn;             // Operations per final file.
+  uint64_t meanClusters;    // Mean (log-normal) file size at creation.
+  unsigned seed;
+
+  // Relative weights of the operations.
+  unsigned create;
+  unsigned append;
+  unsigned truncate;
+  unsigned remove;
+
+  AgingOptions()
+    : files(100000), clusters(0), bytesPerCluster(4096), fill(0.8), churn(4.0),
+      meanClusters(64), seed(1), create(4), append(3), truncate(1), remove(2) {
+  }
+};
+
+// Runs the workload and returns the resulting layout.
+// The same options (including the seed) always yield the same layout.
+std::unique_ptr<SimBackend> age(const AgingOptions &opts);
+
+} // namespace zen
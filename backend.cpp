@@ -0,0 +1,113 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#include "backend.hpp"
+
+namespace
+{
+
+struct file_close {
+  void operator()(HANDLE h) {
+    winx_defrag_fclose(h);
+  }
+};
+
+typedef std::unique_ptr <void, file_close> File;
+
+File openFile(const winx_file_info *file)
+{
+  HANDLE rv = nullptr;
+  if (winx_defrag_fopen(const_cast<winx_file_info *>(file), WINX_OPEN_FOR_MOVE,
+                        &rv)) {
+    std::string ex("Failed to open file: ");
+    ex.append(util::to_string(zen::filePath(const_cast<winx_file_info *>(file))));
+    throw std::exception(ex.c_str());
+  }
+  return File(rv);
+}
+
+} // namespace
+
+namespace zen
+{
+
+WinxBackend::WinxBackend(char volume)
+  : file_(nullptr), volume_(volume)
+{
+  file_ = winx_vopen(volume_);
+  if (!file_) {
+    throw std::exception("Failed to open volume");
+  }
+  if (winx_get_volume_information(volume_, &info) < 0) {
+    winx_fclose(file_);
+    file_ = nullptr;
+    throw std::exception("Failed to query volume");
+  }
+}
+
+WinxBackend::~WinxBackend()
+{
+  if (file_) {
+    winx_fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+winx_volume_region *WinxBackend::gaps()
+{
+  return winx_get_free_volume_regions(volume_, 0, nullptr, nullptr);
+}
+
+winx_volume_region *WinxBackend::gaps(uint64_t lcn, uint64_t count)
+{
+  return winx_get_free_volume_regions_in_range(volume_, lcn, count);
+}
+
+winx_file_info *WinxBackend::files(ftw_filter_callback filter,
+                                   ftw_progress_callback cb, ftw_terminator t,
+                                   void *userdata)
+{
+  // Walking other file systems, the filter would skip directories instead.
+  if (strcmp(info.fs_name, "NTFS")) {
+    filter = nullptr;
+  }
+  return winx_scan_disk(
+           volume_,
+           WINX_FTW_RECURSIVE | WINX_FTW_SKIP_RESIDENT_STREAMS | WINX_FTW_DUMP_FILES |
+           WINX_FTW_LAZY_PATHS,
+           filter,
+           cb,
+           t,
+           userdata);
+}
+
+int WinxBackend::dump(winx_file_info *f)
+{
+  return winx_ftw_dump_file(f, nullptr, nullptr);
+}
+
+NTSTATUS WinxBackend::move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                           uint64_t lcn)
+{
+  IO_STATUS_BLOCK iosb;
+  MOVEFILE_DESCRIPTOR mfd;
+  memset(&mfd, 0, sizeof(mfd));
+
+  auto file = openFile(f);
+  mfd.FileHandle = file.get();
+  mfd.StartVcn.QuadPart = vcn;
+  mfd.NumVcns = (ULONG)count;
+  mfd.TargetLcn.QuadPart = lcn;
+  auto status = ::NtFsControlFile(winx_fileno(file_), nullptr, nullptr, 0,
+                                  &iosb, FSCTL_MOVE_FILE, &mfd, sizeof(mfd),
+                                  nullptr, 0);
+  if (NT_SUCCESS(status)) {
+    //::FlushFileBuffers(mfd.FileHandle);
+    ::NtWaitForSingleObject(winx_fileno(file_), FALSE, nullptr);
+    status = iosb.Status;
+  }
+  return status;
+}
+
+} // namespace zen
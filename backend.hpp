@@ -0,0 +1,112 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#pragma once
+
+#include "util.hpp"
+
+#include <cstdint>
+
+extern "C" {
+#include "ntndk.h"
+#include "zenwinx.h"
+
+#ifdef I
+#undef I
+#endif
+#ifdef E
+#undef E
+#endif
+#ifdef D
+#undef D
+#endif
+}
+
+namespace zen
+{
+
+// The native path of |f|. Volumes are scanned with WINX_FTW_LAZY_PATHS, so
+// the path gets built on first use and is kept from then on.
+inline const wchar_t *filePath(winx_file_info *f)
+{
+  auto rv = winx_ftw_get_path(f);
+  return rv ? rv : L"\\??\\(unknown)";
+}
+
+// Everything the gap closing engine needs from a volume: The allocation
+// bitmap (as a list of free regions), the file extents and a way to move
+// clusters around.
+// GapEnumeration, FileEnumeration and the Operation only ever talk to a
+// volume through this interface, so that the engine may run against
+// something else than a live NTFS volume.
+class Backend
+{
+public:
+  winx_volume_information info;
+
+  Backend() {
+    memset(&info, 0, sizeof(info));
+  }
+  virtual ~Backend() {}
+
+  // Free regions of the volume, release with releaseGaps().
+  virtual winx_volume_region *gaps() = 0;
+  // Free regions within |count| clusters starting at |lcn|. Regions are not
+  // clipped, the first and the last one may extend beyond the range.
+  // Backends able to look at parts of the bitmap should override this.
+  virtual winx_volume_region *gaps(uint64_t lcn, uint64_t count) {
+    return gaps();
+  }
+  virtual void releaseGaps(winx_volume_region *regions) {
+    winx_release_free_volume_regions(regions);
+  }
+
+  // All streams of the volume including dumped block maps, release with
+  // releaseFiles(). Returns nullptr on failure or termination.
+  // Streams |filter| returns nonzero for are of no use to the caller and may
+  // be left out while scanning, like ntfs_scan_disk does. Backends are free
+  // to hand them out anyway.
+  virtual winx_file_info *files(ftw_filter_callback filter,
+                                ftw_progress_callback cb, ftw_terminator t,
+                                void *userdata) = 0;
+  virtual void releaseFiles(winx_file_info *files) {
+    winx_scan_disk_release(files);
+  }
+  // Whether the block maps of the files handed out must stay, because the
+  // backend reads them later on. Otherwise callers keeping the extents
+  // elsewhere release them with winx_ftw_release_blockmaps().
+  virtual bool keepsBlockmaps() const {
+    return false;
+  }
+
+  // Refreshes the block map of a single file.
+  virtual int dump(winx_file_info *f) = 0;
+
+  // Moves |count| clusters starting at |vcn| of |f| to |lcn|.
+  virtual NTSTATUS move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                        uint64_t lcn) = 0;
+};
+
+// Live volume, backed by zenwinx and the Windows defrag API.
+class WinxBackend : public Backend
+{
+private:
+  WINX_FILE *file_;
+  const char volume_;
+
+public:
+  explicit WinxBackend(char volume);
+  virtual ~WinxBackend();
+
+  virtual winx_volume_region *gaps() override;
+  virtual winx_volume_region *gaps(uint64_t lcn, uint64_t count) override;
+  virtual winx_file_info *files(ftw_filter_callback filter,
+                                ftw_progress_callback cb, ftw_terminator t,
+                                void *userdata) override;
+  virtual int dump(winx_file_info *f) override;
+  virtual NTSTATUS move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                        uint64_t lcn) override;
+};
+
+} // namespace zen
@@ -0,0 +1,460 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#include "cache.hpp"
+#include "journal.hpp"
+#include "zen.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace
+{
+
+// Cache file: header, then the layout (see SimBackend::save), then the
+// number of files followed by the MFT and parent directory id of each.
+const char cacheMagic[8] = { 'S', 'G', 'C', 'A', 'C', 'H', 'E', '\0' };
+const uint32_t cacheVersion = 2;
+
+// Dumping files one by one costs way more per file than scanning the MFT,
+// so journals with changes to more than this share of the files are not
+// worth it.
+const size_t maxChangesShare = 16;
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t serial;
+  uint64_t journalId;
+  uint64_t nextUsn;
+};
+
+bool sameRegions(winx_volume_region *a, winx_volume_region *b)
+{
+  auto ra = zen::List<winx_volume_region>(a);
+  auto rb = zen::List<winx_volume_region>(b);
+  auto i = ra.begin(), ie = ra.end();
+  auto j = rb.begin(), je = rb.end();
+  for (; i != ie && j != je; ++i, ++j) {
+    if (i->lcn != j->lcn || i->length != j->length) {
+      return false;
+    }
+  }
+  return i == ie && j == je;
+}
+
+struct volume_close {
+  void operator()(WINX_FILE *f) {
+    winx_fclose(f);
+  }
+};
+
+// Current paths of directories, looked up by id.
+class Directories
+{
+private:
+  std::unique_ptr<WINX_FILE, volume_close> volume_;
+  const char letter_;
+  std::unordered_map<uint64_t, std::wstring> paths_;
+
+public:
+  explicit Directories(char volume)
+    : volume_(winx_vopen(volume)), letter_(volume) {
+    if (!volume_) {
+      throw std::exception("Failed to open volume");
+    }
+  }
+
+  // Empty if the directory does not exist anymore.
+  const std::wstring &path(uint64_t id) {
+    auto i = paths_.find(id);
+    if (i != paths_.end()) {
+      return i->second;
+    }
+    auto &rv = paths_[id];
+    auto p = winx_get_path_by_id(volume_.get(), letter_, id);
+    if (p) {
+      rv = p;
+      winx_free(p);
+      // The root directory comes with a trailing separator.
+      if (!rv.empty() && rv.back() == L'\\') {
+        rv.pop_back();
+      }
+    }
+    return rv;
+  }
+};
+
+// Refreshes the extents of |file| from |backend|. Returns false if there
+// are none (anymore), i.e. if the file is gone or resident.
+bool dumpFile(zen::Backend &backend, zen::SimBackend::File &file)
+{
+  winx_file_info f;
+  memset(&f, 0, sizeof(f));
+  f.path = winx_wcsdup(file.path.c_str());
+  f.flags = file.flags;
+  file.extents.clear();
+  if (f.path && backend.dump(&f) >= 0) {
+    auto bm = zen::List<winx_blockmap>(f.disp.blockmap);
+    for (auto b = bm.begin(), be = bm.end(); b != be; ++b) {
+      file.extents.push_back(zen::SimBackend::Extent(b->vcn, b->lcn,
+                             b->length));
+    }
+    std::sort(file.extents.begin(), file.extents.end(),
+    [](const zen::SimBackend::Extent & a, const zen::SimBackend::Extent & b) {
+      return a.vcn < b.vcn;
+    });
+  }
+  winx_list_destroy((list_entry **)(void *)&f.disp.blockmap);
+  winx_free(f.path);
+  return !file.extents.empty();
+}
+
+// The part of |path| following the directory, i.e. the name of the file
+// and the stream.
+std::wstring baseName(const std::wstring &path)
+{
+  auto sep = path.rfind(L'\\');
+  return sep == std::wstring::npos ? path : path.substr(sep);
+}
+
+// The stream name part of |path|, if any.
+std::wstring streamName(const std::wstring &path)
+{
+  auto sep = path.rfind(L'\\');
+  auto colon = path.find(L':', sep == std::wstring::npos ? 0 : sep);
+  return colon == std::wstring::npos ? std::wstring() : path.substr(colon);
+}
+
+} // namespace
+
+namespace zen
+{
+
+CacheBackend::CacheBackend(std::unique_ptr<Backend> backend, char volume,
+                           const std::wstring &file)
+  : backend_(std::move(backend)), volume_(volume), file_(file),
+    journaled_(false), hit_(false), changes_(0), files_(nullptr)
+{
+  memset(&journal_, 0, sizeof(journal_));
+  info = backend_->info;
+}
+
+std::unique_ptr<SimBackend> CacheBackend::load(ids_t &ids)
+{
+  std::unique_ptr<SimBackend> rv;
+  std::ifstream in(file_.c_str(), std::ios::binary);
+  if (!in) {
+    return rv;
+  }
+  CacheHeader header;
+  in.read((char *)&header, sizeof(header));
+  if (!in || memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) ||
+      header.version != cacheVersion ||
+      header.serial != (uint64_t)info.ntfs_data.VolumeSerialNumber.QuadPart ||
+      header.journalId != journal_.journal_id ||
+      header.nextUsn < journal_.first_usn ||
+      header.nextUsn > journal_.next_usn) {
+    return rv;
+  }
+  try {
+    rv = SimBackend::load(in);
+    uint64_t count;
+    in.read((char *)&count, sizeof(count));
+    if (!in || count != rv->table().size()) {
+      throw std::exception("Truncated scan cache");
+    }
+    ids.resize((size_t)count);
+    in.read((char *)ids.data(), ids.size() * sizeof(ids_t::value_type));
+    if (!in) {
+      throw std::exception("Truncated scan cache");
+    }
+  }
+  catch (const std::exception &) {
+    // Torn or otherwise broken, so just scan.
+    return std::unique_ptr<SimBackend>();
+  }
+  if (rv->clusters() != info.total_clusters ||
+      rv->info.bytes_per_cluster != info.bytes_per_cluster) {
+    return std::unique_ptr<SimBackend>();
+  }
+
+  // Moves do not show up in the journal, but in the bitmap.
+  auto live = backend_->gaps();
+  if (!live) {
+    return std::unique_ptr<SimBackend>();
+  }
+  if (header.nextUsn != journal_.next_usn) {
+    // Changed since, so bring the files the journal knows about up to date.
+    try {
+      auto journal = Journal::read(volume_, journal_, header.nextUsn);
+      auto table = rv->table();
+      if (!refresh(table, ids, *journal, live)) {
+        backend_->releaseGaps(live);
+        return std::unique_ptr<SimBackend>();
+      }
+      rv = SimBackend::record(info, live, std::move(table));
+      changes_ = journal->changes().size();
+    }
+    catch (const std::exception &) {
+      backend_->releaseGaps(live);
+      return std::unique_ptr<SimBackend>();
+    }
+    backend_->releaseGaps(live);
+    return rv;
+  }
+  auto cached = rv->gaps();
+  const auto same = sameRegions(live, cached);
+  backend_->releaseGaps(live);
+  rv->releaseGaps(cached);
+  if (!same) {
+    return std::unique_ptr<SimBackend>();
+  }
+  return rv;
+}
+
+bool CacheBackend::refresh(SimBackend::files_t &table, ids_t &ids,
+                           const Journal &journal, winx_volume_region *gaps)
+{
+  const auto &changes = journal.changes();
+  if (changes.size() > table.size() / maxChangesShare) {
+    return false;
+  }
+
+  // Directories renamed or moved take all files below along, but only the
+  // directories themselves get journaled.
+  bool moved = false;
+  for (auto i = changes.begin(), e = changes.end(); i != e; ++i) {
+    const auto &c = i->second;
+    if ((c.attributes & FILE_ATTRIBUTE_DIRECTORY) &&
+        (c.reasons & Journal::RenameNewName) && !c.created() &&
+        !c.deleted()) {
+      moved = true;
+      break;
+    }
+  }
+
+  Directories dirs(volume_);
+  SimBackend::files_t files;
+  ids_t fileIds;
+  std::unordered_set<uint64_t> cached; // Changed files already in the table.
+  files.reserve(table.size());
+  fileIds.reserve(ids.size());
+  for (size_t n = 0, ne = table.size(); n != ne; ++n) {
+    auto &file = table[n];
+    auto id = ids[n];
+    auto i = changes.find(id.first);
+    if (i == changes.end()) {
+      if (moved && !file.path.empty()) {
+        const auto &dir = dirs.path(id.second);
+        if (dir.empty()) {
+          continue;
+        }
+        file.path = dir + baseName(file.path);
+      }
+      if (!file.extents.empty()) {
+        files.push_back(std::move(file));
+        fileIds.push_back(id);
+      }
+      continue;
+    }
+
+    const auto &c = i->second;
+    cached.insert(id.first);
+    if (c.deleted() || c.created()) {
+      // Gone, or the MFT record went to another file since.
+      continue;
+    }
+    if (moved || (c.reasons & Journal::RenameNewName)) {
+      const auto &dir = dirs.path(c.parent);
+      if (dir.empty()) {
+        continue;
+      }
+      file.path = dir + L"\\" + c.name + streamName(file.path);
+      id.second = c.parent;
+    }
+    if (c.reasons & (Journal::BasicInfoChange | Journal::CompressionChange |
+                     Journal::EncryptionChange)) {
+      file.flags = c.attributes;
+    }
+    if ((c.reasons & Journal::clusterChanges) &&
+        !dumpFile(*backend_, file)) {
+      continue;
+    }
+    if (!file.extents.empty()) {
+      files.push_back(std::move(file));
+      fileIds.push_back(id);
+    }
+  }
+
+  // Files new to the table: Those created since, and those that were
+  // resident before. Only the default streams, though; named streams of
+  // them show up with the next full scan.
+  for (auto i = changes.begin(), e = changes.end(); i != e; ++i) {
+    const auto &c = i->second;
+    if (c.deleted() || !(c.created() || (c.reasons & Journal::clusterChanges))) {
+      continue;
+    }
+    if (!c.created() && cached.count(i->first)) {
+      continue;
+    }
+    const auto &dir = dirs.path(c.parent);
+    if (dir.empty()) {
+      continue;
+    }
+    SimBackend::File file;
+    file.path = dir + L"\\" + c.name;
+    file.flags = c.attributes;
+    if (dumpFile(*backend_, file)) {
+      files.push_back(std::move(file));
+      fileIds.push_back(ids_t::value_type(i->first, c.parent));
+    }
+  }
+
+  // Moves do not show up in the journal. The files moved since would have
+  // their old clusters in a gap now, unless somebody else took them.
+  std::vector<std::pair<uint64_t, uint64_t> > free;
+  auto regs = List<winx_volume_region>(gaps);
+  for (auto i = regs.begin(), e = regs.end(); i != e; ++i) {
+    free.push_back(std::make_pair(i->lcn + i->length, i->lcn));
+  }
+  std::sort(free.begin(), free.end());
+  for (auto i = files.begin(), e = files.end(); i != e; ++i) {
+    for (auto x = i->extents.begin(), xe = i->extents.end(); x != xe; ++x) {
+      // The first gap ending behind the extent start.
+      auto g = std::upper_bound(free.begin(), free.end(),
+                                std::make_pair(x->lcn, (uint64_t)~0ULL));
+      if (g != free.end() && g->second < x->lcn + x->length) {
+        return false;
+      }
+    }
+  }
+
+  table.swap(files);
+  ids.swap(fileIds);
+  return true;
+}
+
+bool CacheBackend::store()
+{
+  if (!files_) {
+    return false;
+  }
+  auto gaps = backend_->gaps();
+  if (!gaps) {
+    return false;
+  }
+  auto layout = SimBackend::record(info, gaps, files_);
+  backend_->releaseGaps(gaps);
+  return store(*layout);
+}
+
+bool CacheBackend::store(const SimBackend &layout)
+{
+  // The layout is only good if nobody else changed the volume since the
+  // scan: All that happened since then are our own moves.
+  winx_usn_journal journal;
+  if (!journaled_ || winx_get_usn_journal(volume_, &journal) < 0 ||
+      journal.journal_id != journal_.journal_id ||
+      journal.next_usn != journal_.next_usn ||
+      layout.table().size() != ids_.size()) {
+    return false;
+  }
+
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+  header.version = cacheVersion;
+  header.serial = info.ntfs_data.VolumeSerialNumber.QuadPart;
+  header.journalId = journal_.journal_id;
+  header.nextUsn = journal_.next_usn;
+
+  std::ofstream out(file_.c_str(), std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::exception("Failed to create scan cache");
+  }
+  out.write((const char *)&header, sizeof(header));
+  layout.save(out);
+  const uint64_t count = ids_.size();
+  out.write((const char *)&count, sizeof(count));
+  out.write((const char *)ids_.data(), ids_.size() * sizeof(ids_t::value_type));
+  out.flush();
+  if (!out) {
+    throw std::exception("Failed to write scan cache");
+  }
+  return true;
+}
+
+winx_volume_region *CacheBackend::gaps()
+{
+  return backend_->gaps();
+}
+
+winx_volume_region *CacheBackend::gaps(uint64_t lcn, uint64_t count)
+{
+  return backend_->gaps(lcn, count);
+}
+
+void CacheBackend::releaseGaps(winx_volume_region *regions)
+{
+  backend_->releaseGaps(regions);
+}
+
+winx_file_info *CacheBackend::files(ftw_filter_callback,
+                                    ftw_progress_callback cb,
+                                    ftw_terminator t, void *userdata)
+{
+  hit_ = false;
+  changes_ = 0;
+  files_ = nullptr;
+  ids_.clear();
+  journaled_ = winx_get_usn_journal(volume_, &journal_) >= 0;
+  if (journaled_) {
+    ids_t ids;
+    auto cached = load(ids);
+    if (cached) {
+      // Paths and flags are all the live volume needs to dump and move.
+      files_ = cached->files(nullptr, cb, t, userdata);
+      hit_ = files_ != nullptr;
+      // Handed out with their index into the table as the MFT id.
+      auto fl = List<winx_file_info>(files_);
+      for (auto i = fl.begin(), e = fl.end(); i != e; ++i) {
+        ids_.push_back(ids[(size_t)i->internal.BaseMftId]);
+      }
+      return files_;
+    }
+  }
+  // Unfiltered, as the cache must serve runs with other options as well.
+  files_ = backend_->files(nullptr, cb, t, userdata);
+  auto fl = List<winx_file_info>(files_);
+  for (auto i = fl.begin(), e = fl.end(); i != e; ++i) {
+    ids_.push_back(ids_t::value_type(i->internal.BaseMftId,
+                                     i->internal.ParentDirectoryMftId));
+  }
+  return files_;
+}
+
+void CacheBackend::releaseFiles(winx_file_info *files)
+{
+  if (files == files_) {
+    files_ = nullptr;
+  }
+  backend_->releaseFiles(files);
+}
+
+int CacheBackend::dump(winx_file_info *f)
+{
+  return backend_->dump(f);
+}
+
+NTSTATUS CacheBackend::move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                            uint64_t lcn)
+{
+  return backend_->move(f, vcn, count, lcn);
+}
+
+} // namespace zen
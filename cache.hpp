@@ -0,0 +1,81 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#pragma once
+
+#include "sim.hpp"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace zen
+{
+
+class Journal;
+
+// Scan cache of a live volume: The file table and the allocation bitmap as
+// of the end of the last run, keyed by the volume serial number and the
+// state of the change journal. If neither the journal moved on nor the
+// bitmap changed since, the files are handed out from the cache instead of
+// scanning the volume again. If the journal moved on only a little, the
+// files it recorded changes for are brought up to date one by one instead.
+// Everything else goes to the live volume.
+class CacheBackend : public Backend
+{
+private:
+  // MFT id and parent directory id of each file.
+  typedef std::vector<std::pair<uint64_t, uint64_t> > ids_t;
+
+  std::unique_ptr<Backend> backend_;
+  const char volume_;
+  const std::wstring file_;
+  winx_usn_journal journal_; // As of the last files() call.
+  bool journaled_;
+  bool hit_;
+  uint64_t changes_;
+  winx_file_info *files_; // Handed out last.
+  ids_t ids_; // Of the files handed out last, in list order.
+
+  std::unique_ptr<SimBackend> load(ids_t &ids);
+  bool refresh(SimBackend::files_t &table, ids_t &ids, const Journal &journal,
+               winx_volume_region *gaps);
+
+public:
+  CacheBackend(std::unique_ptr<Backend> backend, char volume,
+               const std::wstring &file);
+
+  // The last files() call was served from the cache.
+  bool hit() const {
+    return hit_;
+  }
+  // Number of files the change journal had changes for since the cache
+  // was stored, if it was brought up to date.
+  uint64_t changes() const {
+    return changes_;
+  }
+
+  // Stores |layout|, or the files handed out last, as they are now.
+  // Returns false if the volume changed in ways the files do not reflect.
+  bool store();
+  bool store(const SimBackend &layout);
+
+  virtual winx_volume_region *gaps() override;
+  virtual winx_volume_region *gaps(uint64_t lcn, uint64_t count) override;
+  virtual void releaseGaps(winx_volume_region *regions) override;
+  virtual winx_file_info *files(ftw_filter_callback filter,
+                                ftw_progress_callback cb, ftw_terminator t,
+                                void *userdata) override;
+  virtual void releaseFiles(winx_file_info *files) override;
+  // store() records the files handed out from their block maps.
+  virtual bool keepsBlockmaps() const override {
+    return true;
+  }
+  virtual int dump(winx_file_info *f) override;
+  virtual NTSTATUS move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                        uint64_t lcn) override;
+};
+
+} // namespace zen
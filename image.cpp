@@ -0,0 +1,822 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#include "image.hpp"
+#include "zen.hpp"
+
+#include <algorithm>
+
+extern "C" {
+#include "ntfs.h"
+}
+
+namespace
+{
+
+const size_t copyBufferSize = 1 << 20;
+const int readQueueDepth = 8;
+
+const USHORT recordInUse = 0x1;
+const USHORT attributeCompressed = 0x1;
+const USHORT attributeSparse = 0x8000;
+const USHORT volumeDirty = 0x1;
+const ULONG attributeEnd = 0xffffffff;
+
+inline size_t align8(size_t n)
+{
+  return (n + 7) & ~(size_t)7;
+}
+
+std::wstring attributeName(const ATTRIBUTE *attr)
+{
+  auto name = (const WCHAR *)((const char *)attr + attr->NameOffset);
+  return std::wstring(name, name + attr->NameLength);
+}
+
+// Offset of the first attribute of |type| (and |name|, if given) within a
+// record, or 0.
+size_t findAttribute(const std::vector<char> &record, ULONG type,
+                     const std::wstring *name)
+{
+  auto frh = (const FILE_RECORD_HEADER *)record.data();
+  const size_t end = frh->BytesInUse;
+  for (size_t offset = frh->AttributeOffset;
+       offset + sizeof(ATTRIBUTE) <= end;) {
+    auto attr = (const ATTRIBUTE *)(record.data() + offset);
+    if ((ULONG)attr->AttributeType == attributeEnd ||
+        attr->Length < sizeof(ATTRIBUTE) || offset + attr->Length > end ||
+        attr->NameOffset + attr->NameLength * sizeof(WCHAR) > attr->Length) {
+      break;
+    }
+    if ((ULONG)attr->AttributeType == type &&
+        (!name || attributeName(attr) == *name)) {
+      return offset;
+    }
+    offset += attr->Length;
+  }
+  return 0;
+}
+
+// The stream a path refers to, i.e. whatever follows the colon in the last
+// path component ("" for the default $DATA stream).
+bool streamName(const wchar_t *path, std::wstring &name)
+{
+  if (!path) {
+    return false;
+  }
+  std::wstring p(path);
+  auto sep = p.find_last_of(L'\\');
+  auto colon = p.find(L':', sep == std::wstring::npos ? 0 : sep + 1);
+  name = colon == std::wstring::npos ? L"" : p.substr(colon + 1);
+  // Attributes with default names (file::$BITMAP etc.) are not $DATA.
+  return name.find(L':') == std::wstring::npos;
+}
+
+// Whether |f| may be movable, judged by what the scan found without going
+// back to its record: Metafiles, directories, compressed and sparse streams
+// are not. Runs not following each other by vcn are sparse or come from
+// several records. Other streams spread over several records are only
+// found out when moved.
+bool scannedMovable(const winx_file_info *f)
+{
+  if (is_directory(f) || is_compressed(f) || is_sparse(f) ||
+      f->internal.BaseMftId < FILE_first_user) {
+    return false;
+  }
+  uint64_t vcn = 0;
+  auto bm = zen::List<winx_blockmap>(f->disp.blockmap);
+  for (auto i = bm.begin(), e = bm.end(); i != e; ++i) {
+    if (i->vcn != vcn) {
+      return false;
+    }
+    vcn += i->length;
+  }
+  return true;
+}
+
+bool decodeRuns(const NONRESIDENT_ATTRIBUTE *attr, zen::ImageBackend::runs_t &rv)
+{
+  auto p = (const unsigned char *)attr + attr->RunArrayOffset;
+  auto end = (const unsigned char *)attr + attr->Attribute.Length;
+  auto vcn = attr->LowVcn;
+  int64_t lcn = 0;
+  while (p < end && *p) {
+    const unsigned lengthBytes = *p & 0xf, offsetBytes = *p >> 4;
+    if (!lengthBytes || lengthBytes > 8 || offsetBytes > 8 ||
+        p + 1 + lengthBytes + offsetBytes > end) {
+      return false;
+    }
+    uint64_t length = 0;
+    for (unsigned i = 0; i != lengthBytes; ++i) {
+      length |= (uint64_t)p[1 + i] << (8 * i);
+    }
+    if (!length) {
+      return false;
+    }
+    zen::ImageBackend::Run run(vcn, zen::ImageBackend::sparse, length);
+    if (offsetBytes) {
+      uint64_t delta = 0;
+      for (unsigned i = 0; i != offsetBytes; ++i) {
+        delta |= (uint64_t)p[1 + lengthBytes + i] << (8 * i);
+      }
+      if (offsetBytes < 8 && (p[lengthBytes + offsetBytes] & 0x80)) {
+        delta |= ~0ULL << (8 * offsetBytes);
+      }
+      lcn += (int64_t)delta;
+      run.lcn = (uint64_t)lcn;
+    }
+    rv.push_back(run);
+    vcn += length;
+    p += 1 + lengthBytes + offsetBytes;
+  }
+  return p < end;
+}
+
+void encodeNumber(std::vector<unsigned char> &out, int64_t v, unsigned &bytes)
+{
+  bytes = 1;
+  while (bytes < 8 && (v >= (1LL << (8 * bytes - 1)) ||
+                       v < -(1LL << (8 * bytes - 1)))) {
+    bytes++;
+  }
+  for (unsigned i = 0; i != bytes; ++i) {
+    out.push_back((unsigned char)(v >> (8 * i)));
+  }
+}
+
+std::vector<unsigned char> encodeRuns(const zen::ImageBackend::runs_t &runs)
+{
+  std::vector<unsigned char> rv;
+  int64_t prev = 0;
+  for (auto i = runs.begin(), e = runs.end(); i != e; ++i) {
+    auto header = rv.size();
+    rv.push_back(0);
+    unsigned lengthBytes, offsetBytes = 0;
+    encodeNumber(rv, (int64_t)i->length, lengthBytes);
+    if (i->lcn != zen::ImageBackend::sparse) {
+      encodeNumber(rv, (int64_t)i->lcn - prev, offsetBytes);
+      prev = (int64_t)i->lcn;
+    }
+    rv[header] = (unsigned char)(lengthBytes | (offsetBytes << 4));
+  }
+  rv.push_back(0);
+  return rv;
+}
+
+// Replaces the run array of the attribute at |offset|, growing or shrinking
+// the attribute as required.
+bool setRuns(std::vector<char> &record, size_t offset,
+             const zen::ImageBackend::runs_t &runs)
+{
+  auto frh = (FILE_RECORD_HEADER *)record.data();
+  auto attr = (NONRESIDENT_ATTRIBUTE *)(record.data() + offset);
+  const auto encoded = encodeRuns(runs);
+  const auto length = align8(attr->RunArrayOffset + encoded.size());
+  const auto tail = offset + attr->Attribute.Length;
+  const auto inUse = (size_t)frh->BytesInUse;
+  const auto newInUse = inUse - attr->Attribute.Length + length;
+  if (newInUse > frh->BytesAllocated || newInUse > record.size()) {
+    return false;
+  }
+  memmove(record.data() + offset + length, record.data() + tail,
+          inUse - tail);
+  if (newInUse < inUse) {
+    memset(record.data() + newInUse, 0, inUse - newInUse);
+  }
+  auto runArray = record.data() + offset + attr->RunArrayOffset;
+  memset(runArray, 0, length - attr->RunArrayOffset);
+  memcpy(runArray, encoded.data(), encoded.size());
+  attr->Attribute.Length = (ULONG)length;
+  frh->BytesInUse = (ULONG)newInUse;
+  return true;
+}
+
+// The raw MFT scanner opens files through the native API.
+std::wstring nativePath(const std::wstring &path)
+{
+  auto len = ::GetFullPathNameW(path.c_str(), 0, nullptr, nullptr);
+  std::vector<wchar_t> full(len + 1);
+  if (!len ||
+      !::GetFullPathNameW(path.c_str(), len + 1, full.data(), nullptr)) {
+    throw std::exception("Invalid image path");
+  }
+  return std::wstring(L"\\??\\") + full.data();
+}
+
+} // namespace
+
+namespace zen
+{
+
+ImageBackend::ImageBackend(const std::wstring &path, char volume)
+  : path_(nativePath(path)), volume_(volume), bytesPerRecord_(0),
+    mirrored_(0), used_(0), moves_(0), movedClusters_(0)
+{
+  image_.open(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+  if (!image_) {
+    throw std::exception("Failed to open image");
+  }
+
+  NTFS_BOOT_SECTOR bs;
+  read(0, &bs, sizeof(bs));
+  if (memcmp(bs.OemId, "NTFS    ", sizeof(bs.OemId))) {
+    throw std::exception("Not an NTFS image");
+  }
+  uint64_t sectorsPerCluster = bs.SectorsPerCluster;
+  if (sectorsPerCluster > 0x80) {
+    auto shift = 256 - sectorsPerCluster;
+    sectorsPerCluster = shift < 16 ? 1ULL << shift : 0;
+  }
+  const uint64_t bytesPerCluster = bs.BytesPerSector * sectorsPerCluster;
+  if (bs.ClustersPerFileRecord < 0) {
+    auto shift = -bs.ClustersPerFileRecord;
+    bytesPerRecord_ = shift < 16 ? 1ULL << shift : 0;
+  }
+  else {
+    bytesPerRecord_ = bytesPerCluster * bs.ClustersPerFileRecord;
+  }
+  if (!bs.BytesPerSector || bs.BytesPerSector % NTFS_USA_BLOCK_SIZE ||
+      !sectorsPerCluster || !bytesPerRecord_ ||
+      bytesPerRecord_ % NTFS_USA_BLOCK_SIZE) {
+    throw std::exception("Invalid NTFS boot sector");
+  }
+
+  info.volume_letter = volume_;
+  strcpy(info.fs_name, "NTFS");
+  info.total_clusters = bs.TotalSectors / sectorsPerCluster;
+  info.bytes_per_cluster = bytesPerCluster;
+  info.bytes_per_sector = bs.BytesPerSector;
+  info.sectors_per_cluster = (ULONG)sectorsPerCluster;
+  info.total_bytes = info.total_clusters * bytesPerCluster;
+  info.device_capacity = info.total_bytes;
+  info.ntfs_data.VolumeSerialNumber.QuadPart = bs.VolumeSerialNumber;
+  info.ntfs_data.TotalClusters.QuadPart = info.total_clusters;
+  info.ntfs_data.BytesPerCluster = (ULONG)bytesPerCluster;
+  info.ntfs_data.BytesPerSector = bs.BytesPerSector;
+  info.ntfs_data.BytesPerFileRecordSegment = (ULONG)bytesPerRecord_;
+  info.ntfs_data.MftStartLcn.QuadPart = bs.MftStartLcn;
+  info.ntfs_data.Mft2StartLcn.QuadPart = bs.Mft2StartLcn;
+
+  // Assume contiguous system records until the $MFT record is read, which
+  // is also how NTFS itself bootstraps.
+  mft_.push_back(Run(0, bs.MftStartLcn,
+                     (FILE_first_user * bytesPerRecord_ + bytesPerCluster - 1) /
+                     bytesPerCluster));
+  parts_t p;
+  runs_t r;
+  if (!parts(FILE_MFT, AttributeData, L"", p) || !runs(p, r) || r.empty()) {
+    throw std::exception("Failed to read $MFT");
+  }
+  mft_ = r;
+
+  r.clear();
+  if (!parts(FILE_MFTMirr, AttributeData, L"", p) || !runs(p, r)) {
+    throw std::exception("Failed to read $MFTMirr");
+  }
+  mirror_ = r;
+  mirrored_ = ((const NONRESIDENT_ATTRIBUTE *)(p[0].record.data() +
+               p[0].offset))->DataSize / bytesPerRecord_;
+
+  r.clear();
+  if (!parts(FILE_Bitmap, AttributeData, L"", p) || !runs(p, r)) {
+    throw std::exception("Failed to read $Bitmap");
+  }
+  bitmapRuns_ = r;
+  bitmap_.resize((size_t)((info.total_clusters + 7) / 8));
+  loadStream(bitmapRuns_, bitmap_.data(), bitmap_.size());
+  for (auto c = 0ULL; c != info.total_clusters; ++c) {
+    if (used(c)) {
+      used_++;
+    }
+  }
+
+  // Refuse volumes NTFS did not shut down cleanly: Replaying $LogFile later
+  // on would undo what we did here.
+  std::vector<char> record;
+  if (readRecord(FILE_Volume, record)) {
+    if (auto offset = findAttribute(record, AttributeVolumeName, nullptr)) {
+      auto attr = (const RESIDENT_ATTRIBUTE *)(record.data() + offset);
+      auto label = (const WCHAR *)((const char *)attr + attr->ValueOffset);
+      auto len = min((size_t)attr->ValueLength / sizeof(WCHAR), (size_t)MAX_PATH);
+      std::copy(label, label + len, info.label);
+    }
+    if (auto offset = findAttribute(record, AttributeVolumeInformation,
+                                    nullptr)) {
+      auto attr = (const RESIDENT_ATTRIBUTE *)(record.data() + offset);
+      auto vi = (const VOLUME_INFORMATION *)((const char *)attr +
+                                             attr->ValueOffset);
+      if (vi->Flags & volumeDirty) {
+        throw std::exception("The image is dirty, run chkdsk first");
+      }
+    }
+  }
+
+  buffer_.resize((size_t)max((uint64_t)copyBufferSize, bytesPerCluster));
+  update();
+}
+
+void ImageBackend::update()
+{
+  info.free_bytes = (info.total_clusters - used_) * info.bytes_per_cluster;
+  info.ntfs_data.FreeClusters.QuadPart = info.total_clusters - used_;
+}
+
+void ImageBackend::read(uint64_t offset, void *buffer, size_t length)
+{
+  image_.seekg((std::streamoff)offset);
+  image_.read((char *)buffer, length);
+  if (!image_) {
+    throw std::exception("Failed to read from the image");
+  }
+}
+
+void ImageBackend::write(uint64_t offset, const void *buffer, size_t length)
+{
+  image_.seekp((std::streamoff)offset);
+  image_.write((const char *)buffer, length);
+  if (!image_) {
+    throw std::exception("Failed to write to the image");
+  }
+}
+
+void ImageBackend::readStream(const runs_t &runs, uint64_t offset,
+                              void *buffer, size_t length)
+{
+  const auto bpc = info.bytes_per_cluster;
+  auto out = (char *)buffer;
+  while (length) {
+    const auto vcn = offset / bpc;
+    auto run = std::find_if(runs.begin(), runs.end(), [vcn](const Run & r) {
+      return vcn >= r.vcn && vcn < r.vcn + r.length;
+    });
+    if (run == runs.end() || run->lcn == sparse) {
+      throw std::exception("Invalid stream offset");
+    }
+    const auto within = offset - run->vcn * bpc;
+    const auto n = (size_t)min((uint64_t)length, run->length * bpc - within);
+    read(run->lcn * bpc + within, out, n);
+    out += n;
+    offset += n;
+    length -= n;
+  }
+}
+
+void ImageBackend::loadStream(const runs_t &runs, void *buffer,
+                              size_t length)
+{
+  const auto bpc = info.bytes_per_cluster;
+  const auto chunk = max((uint64_t)copyBufferSize, bpc);
+  auto q = winx_readq_open(path_.c_str(), readQueueDepth, (ULONG)chunk, 0);
+  if (!q) {
+    readStream(runs, 0, buffer, length);
+    return;
+  }
+
+  // Queue everything up front, in stream order; the queue keeps
+  // readQueueDepth chunks in flight while the data is copied out.
+  int rv = 0;
+  for (auto r = runs.begin(), e = runs.end(); r != e && rv >= 0; ++r) {
+    if (r->lcn == sparse) {
+      continue;
+    }
+    for (auto vcn = r->vcn; vcn < r->vcn + r->length && vcn * bpc < length;) {
+      const auto n = min(chunk / bpc, r->vcn + r->length - vcn);
+      rv = winx_readq_add(q, (r->lcn + vcn - r->vcn) * bpc, (ULONG)(n * bpc),
+                          vcn * bpc);
+      if (rv < 0) {
+        break;
+      }
+      vcn += n;
+    }
+  }
+
+  auto out = (char *)buffer;
+  size_t copied = 0;
+  char *data;
+  ULONG len;
+  ULONGLONG key;
+  while (rv >= 0 && (rv = winx_readq_next(q, &data, nullptr, &len, &key)) > 0) {
+    const auto n = (size_t)min((uint64_t)len, length - key);
+    memcpy(out + key, data, n);
+    copied += n;
+  }
+  winx_readq_close(q);
+  if (rv < 0) {
+    throw std::exception("Failed to read from the image");
+  }
+  if (copied != length) {
+    throw std::exception("Invalid stream offset");
+  }
+}
+
+void ImageBackend::writeStream(const runs_t &runs, uint64_t offset,
+                               const void *buffer, size_t length)
+{
+  const auto bpc = info.bytes_per_cluster;
+  auto in = (const char *)buffer;
+  while (length) {
+    const auto vcn = offset / bpc;
+    auto run = std::find_if(runs.begin(), runs.end(), [vcn](const Run & r) {
+      return vcn >= r.vcn && vcn < r.vcn + r.length;
+    });
+    if (run == runs.end() || run->lcn == sparse) {
+      throw std::exception("Invalid stream offset");
+    }
+    const auto within = offset - run->vcn * bpc;
+    const auto n = (size_t)min((uint64_t)length, run->length * bpc - within);
+    write(run->lcn * bpc + within, in, n);
+    in += n;
+    offset += n;
+    length -= n;
+  }
+}
+
+bool ImageBackend::readRecord(uint64_t id, std::vector<char> &record)
+{
+  const auto &last = mft_.back();
+  if ((id + 1) * bytesPerRecord_ >
+      (last.vcn + last.length) * info.bytes_per_cluster) {
+    return false;
+  }
+  record.resize((size_t)bytesPerRecord_);
+  readStream(mft_, id * bytesPerRecord_, record.data(), record.size());
+
+  auto frh = (FILE_RECORD_HEADER *)record.data();
+  const auto count = (ULONG)(bytesPerRecord_ / NTFS_USA_BLOCK_SIZE);
+  if (!is_file_record(frh) || frh->Ntfs.UsaCount != count + 1 ||
+      frh->Ntfs.UsaOffset & 1 ||
+      frh->Ntfs.UsaOffset + (count + 1) * sizeof(USHORT) >
+      NTFS_USA_BLOCK_SIZE - sizeof(USHORT) ||
+      frh->BytesAllocated != bytesPerRecord_ ||
+      frh->BytesInUse > bytesPerRecord_ ||
+      frh->AttributeOffset >= frh->BytesInUse) {
+    return false;
+  }
+  auto usa = (USHORT *)(record.data() + frh->Ntfs.UsaOffset);
+  for (ULONG i = 1; i <= count; ++i) {
+    auto end = (USHORT *)(record.data() + i * NTFS_USA_BLOCK_SIZE -
+                          sizeof(USHORT));
+    if (*end != usa[0]) {
+      return false;
+    }
+    *end = usa[i];
+  }
+  return true;
+}
+
+void ImageBackend::writeRecord(uint64_t id, std::vector<char> record)
+{
+  // Protect the record again, with the next update sequence number.
+  auto h = (NTFS_RECORD_HEADER *)record.data();
+  auto usa = (USHORT *)(record.data() + h->UsaOffset);
+  usa[0]++;
+  if (!usa[0] || usa[0] == 0xffff) {
+    usa[0] = 1;
+  }
+  for (ULONG i = 1; i < h->UsaCount; ++i) {
+    auto end = (USHORT *)(record.data() + i * NTFS_USA_BLOCK_SIZE -
+                          sizeof(USHORT));
+    usa[i] = *end;
+    *end = usa[0];
+  }
+  writeStream(mft_, id * bytesPerRecord_, record.data(), record.size());
+  if (id < mirrored_) {
+    writeStream(mirror_, id * bytesPerRecord_, record.data(), record.size());
+  }
+}
+
+bool ImageBackend::parts(uint64_t id, ULONG type, const std::wstring &name,
+                         parts_t &rv)
+{
+  rv.clear();
+  Part base;
+  base.id = id;
+  if (!readRecord(id, base.record)) {
+    return false;
+  }
+  auto frh = (const FILE_RECORD_HEADER *)base.record.data();
+  if (!(frh->Flags & recordInUse) || frh->BaseFileRecord) {
+    return false;
+  }
+
+  auto list = findAttribute(base.record, AttributeAttributeList, nullptr);
+  if (!list) {
+    base.offset = findAttribute(base.record, type, &name);
+    if (!base.offset) {
+      return false;
+    }
+    rv.push_back(std::move(base));
+    return true;
+  }
+
+  // Nonresident attribute lists are rare enough to not bother.
+  auto attr = (const RESIDENT_ATTRIBUTE *)(base.record.data() + list);
+  if (attr->Attribute.Nonresident ||
+      attr->ValueOffset + attr->ValueLength > attr->Attribute.Length) {
+    return false;
+  }
+  auto p = (const char *)attr + attr->ValueOffset;
+  auto end = p + attr->ValueLength;
+  while (p + sizeof(ATTRIBUTE_LIST) <= end) {
+    auto entry = (const ATTRIBUTE_LIST *)p;
+    if (entry->Length < sizeof(ATTRIBUTE_LIST) || p + entry->Length > end ||
+        entry->NameOffset + entry->NameLength * sizeof(WCHAR) > entry->Length) {
+      return false;
+    }
+    auto entryName = (const WCHAR *)(p + entry->NameOffset);
+    if ((ULONG)entry->AttributeType == type &&
+        std::wstring(entryName, entryName + entry->NameLength) == name) {
+      Part part;
+      part.id = GetMftIdFromFRN(entry->FileReferenceNumber);
+      if (part.id == id) {
+        part.record = base.record;
+      }
+      else if (!readRecord(part.id, part.record) ||
+               GetMftIdFromFRN(((const FILE_RECORD_HEADER *)
+                                part.record.data())->BaseFileRecord) != id) {
+        return false;
+      }
+      part.offset = findAttribute(part.record, type, &name);
+      if (!part.offset) {
+        return false;
+      }
+      rv.push_back(std::move(part));
+    }
+    p += entry->Length;
+  }
+  return !rv.empty();
+}
+
+bool ImageBackend::runs(const parts_t &parts, runs_t &rv) const
+{
+  rv.clear();
+  for (auto i = parts.begin(), e = parts.end(); i != e; ++i) {
+    auto attr = (const NONRESIDENT_ATTRIBUTE *)(i->record.data() + i->offset);
+    if (!attr->Attribute.Nonresident ||
+        attr->RunArrayOffset >= attr->Attribute.Length) {
+      return false;
+    }
+    const auto vcn = rv.empty() ? 0 : rv.back().vcn + rv.back().length;
+    if (attr->LowVcn != vcn || !decodeRuns(attr, rv)) {
+      return false;
+    }
+  }
+  for (auto i = rv.begin(), e = rv.end(); i != e; ++i) {
+    if (i->lcn != sparse && i->lcn + i->length > info.total_clusters) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ImageBackend::stream(const winx_file_info *f, parts_t &parts,
+                          runs_t &runs)
+{
+  // The name does as well as the path, which files may not have yet.
+  std::wstring name;
+  return streamName(f->path ? f->path : f->name, name) &&
+         this->parts(f->internal.BaseMftId, AttributeData, name, parts) &&
+         this->runs(parts, runs);
+}
+
+bool ImageBackend::movable(const winx_file_info *f, parts_t &parts,
+                           runs_t &runs)
+{
+  // Metafiles stay put, as do directories, compressed and sparse streams
+  // and streams spread over several records.
+  if (is_directory(f) || f->internal.BaseMftId < FILE_first_user ||
+      !stream(f, parts, runs) || parts.size() != 1) {
+    return false;
+  }
+  auto attr = (const NONRESIDENT_ATTRIBUTE *)(parts[0].record.data() +
+              parts[0].offset);
+  if (attr->Attribute.Flags & (attributeCompressed | attributeSparse)) {
+    return false;
+  }
+  return std::none_of(runs.begin(), runs.end(), [](const Run & r) {
+    return r.lcn == sparse;
+  });
+}
+
+bool ImageBackend::isFree(uint64_t lcn, uint64_t length) const
+{
+  if (lcn + length > info.total_clusters) {
+    return false;
+  }
+  for (auto c = lcn, e = lcn + length; c != e; ++c) {
+    if (used(c)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void ImageBackend::allocate(uint64_t lcn, uint64_t length)
+{
+  for (auto c = lcn, e = lcn + length; c != e; ++c) {
+    auto &b = bitmap_[(size_t)(c / 8)];
+    auto m = (unsigned char)(1 << (c % 8));
+    if (!(b & m)) {
+      b |= m;
+      used_++;
+    }
+  }
+  const auto first = lcn / 8, last = (lcn + length + 7) / 8;
+  writeStream(bitmapRuns_, first, &bitmap_[(size_t)first],
+              (size_t)(last - first));
+  update();
+}
+
+void ImageBackend::release(uint64_t lcn, uint64_t length)
+{
+  for (auto c = lcn, e = lcn + length; c != e; ++c) {
+    auto &b = bitmap_[(size_t)(c / 8)];
+    auto m = (unsigned char)(1 << (c % 8));
+    if (b & m) {
+      b &= ~m;
+      used_--;
+    }
+  }
+  const auto first = lcn / 8, last = (lcn + length + 7) / 8;
+  writeStream(bitmapRuns_, first, &bitmap_[(size_t)first],
+              (size_t)(last - first));
+  update();
+}
+
+void ImageBackend::copy(uint64_t from, uint64_t to, uint64_t length)
+{
+  const auto bpc = info.bytes_per_cluster;
+  const auto chunk = buffer_.size() / bpc;
+  while (length) {
+    const auto n = min(length, chunk);
+    read(from * bpc, buffer_.data(), (size_t)(n * bpc));
+    write(to * bpc, buffer_.data(), (size_t)(n * bpc));
+    from += n;
+    to += n;
+    length -= n;
+  }
+}
+
+winx_volume_region *ImageBackend::gaps()
+{
+  return winx_bitmap_to_regions(bitmap_.data(), 0, info.total_clusters,
+                                nullptr, nullptr);
+}
+
+winx_volume_region *ImageBackend::gaps(uint64_t lcn, uint64_t count)
+{
+  // The map starts at a byte boundary.
+  const auto start = lcn & ~7ULL;
+  if (start >= info.total_clusters) {
+    return nullptr;
+  }
+  count = min(lcn + count, info.total_clusters) - start;
+  return winx_bitmap_to_regions(bitmap_.data() + start / 8, start, count,
+                                nullptr, nullptr);
+}
+
+winx_file_info *ImageBackend::files(ftw_filter_callback filter,
+                                    ftw_progress_callback cb,
+                                    ftw_terminator t, void *userdata)
+{
+  auto rv = winx_scan_image(
+              &path_[0],
+              volume_,
+              WINX_FTW_SKIP_RESIDENT_STREAMS | WINX_FTW_DUMP_FILES |
+              WINX_FTW_LAZY_PATHS,
+              filter,
+              cb,
+              t,
+              userdata);
+  if (!rv) {
+    return nullptr;
+  }
+  // Whatever cannot be moved offline loses its block map, which makes it
+  // unprocessable. Reading each record again would take longer than the
+  // scan, so move() checks the rest.
+  auto fl = List<winx_file_info>(rv);
+  for (auto i = fl.begin(), e = fl.end(); i != e; ++i) {
+    if (i->disp.blockmap && !scannedMovable(&*i)) {
+      winx_ftw_release_blockmap(&*i);
+    }
+  }
+  return rv;
+}
+
+int ImageBackend::dump(winx_file_info *f)
+{
+  parts_t parts;
+  runs_t runs;
+  if (!stream(f, parts, runs)) {
+    return -1;
+  }
+  f->disp.clusters = 0;
+  f->disp.fragments = 0;
+  winx_ftw_release_blockmap(f);
+
+  winx_blockmap *block = nullptr;
+  for (auto i = runs.begin(), e = runs.end(); i != e; ++i) {
+    if (i->lcn == sparse) {
+      continue;
+    }
+    block = winx_ftw_add_block(f, block);
+    block->vcn = i->vcn;
+    block->lcn = i->lcn;
+    block->length = i->length;
+    f->disp.clusters += block->length;
+    if (block == f->disp.blockmap ||
+        block->lcn != block->prev->lcn + block->prev->length) {
+      f->disp.fragments++;
+    }
+  }
+  return 0;
+}
+
+NTSTATUS ImageBackend::move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                            uint64_t lcn)
+{
+  parts_t parts;
+  runs_t runs;
+  if (!movable(f, parts, runs)) {
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  // Split the runs into the kept and the moved parts.
+  runs_t kept, moved;
+  uint64_t total = 0;
+  const auto end = vcn + count;
+  for (auto i = runs.begin(), e = runs.end(); i != e; ++i) {
+    const auto iend = i->vcn + i->length;
+    if (iend <= vcn || i->vcn >= end) {
+      kept.push_back(*i);
+      continue;
+    }
+    if (i->vcn < vcn) {
+      kept.push_back(Run(i->vcn, i->lcn, vcn - i->vcn));
+    }
+    const auto mvcn = max(i->vcn, vcn);
+    const auto mend = min(iend, end);
+    moved.push_back(Run(mvcn, i->lcn + (mvcn - i->vcn), mend - mvcn));
+    total += mend - mvcn;
+    if (iend > end) {
+      kept.push_back(Run(end, i->lcn + (end - i->vcn), iend - end));
+    }
+  }
+  if (!total) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  if (!isFree(lcn, total)) {
+    return STATUS_ALREADY_COMMITTED;
+  }
+
+  runs_t sources(moved);
+  auto target = lcn;
+  for (auto i = moved.begin(), e = moved.end(); i != e; ++i) {
+    i->lcn = target;
+    target += i->length;
+  }
+  kept.insert(kept.end(), moved.begin(), moved.end());
+  std::sort(kept.begin(), kept.end(), [](const Run & a, const Run & b) {
+    return a.vcn < b.vcn;
+  });
+  runs.clear();
+  for (auto i = kept.begin(), e = kept.end(); i != e; ++i) {
+    if (!runs.empty()) {
+      auto &last = runs.back();
+      if (last.vcn + last.length == i->vcn &&
+          last.lcn + last.length == i->lcn) {
+        last.length += i->length;
+        continue;
+      }
+    }
+    runs.push_back(*i);
+  }
+  auto &part = parts[0];
+  if (!setRuns(part.record, part.offset, runs)) {
+    // NTFS would move the attribute to another record.
+    return STATUS_BUFFER_TOO_SMALL;
+  }
+
+  // Allocate, copy, then switch the record over and free the old clusters.
+  // Whatever happens in between, at worst clusters are leaked.
+  allocate(lcn, total);
+  target = lcn;
+  for (auto i = sources.begin(), e = sources.end(); i != e; ++i) {
+    copy(i->lcn, target, i->length);
+    target += i->length;
+  }
+  image_.flush();
+  writeRecord(part.id, part.record);
+  image_.flush();
+  for (auto i = sources.begin(), e = sources.end(); i != e; ++i) {
+    release(i->lcn, i->length);
+  }
+  image_.flush();
+
+  moves_++;
+  movedClusters_ += total;
+  return STATUS_SUCCESS;
+}
+
+} // namespace zen
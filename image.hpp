@@ -0,0 +1,106 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#pragma once
+
+#include "backend.hpp"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace zen
+{
+
+// Unmounted NTFS volume image, defragmented offline.
+// Files come from the raw MFT scanner. Moves do what NTFS would do for
+// FSCTL_MOVE_FILE, just without NTFS: Copy the cluster data, rewrite the run
+// list in the MFT record (and $MFTMirr, where mirrored) and update $Bitmap.
+// Nothing is journaled, so the image must not be mounted meanwhile.
+class ImageBackend : public Backend
+{
+public:
+  struct Run {
+    uint64_t vcn;
+    uint64_t lcn; // sparse for runs not backed by clusters.
+    uint64_t length;
+
+    Run() : vcn(0), lcn(0), length(0) {}
+    Run(uint64_t v, uint64_t l, uint64_t n) : vcn(v), lcn(l), length(n) {}
+  };
+  typedef std::vector<Run> runs_t;
+  static const uint64_t sparse = ~0ULL;
+
+private:
+  // A part of a nonresident attribute: The record it lives in (fixups
+  // applied) and the offset of the attribute within the record.
+  struct Part {
+    uint64_t id;
+    std::vector<char> record;
+    size_t offset;
+  };
+  typedef std::vector<Part> parts_t;
+
+  std::wstring path_; // Native path, for the scanner.
+  std::fstream image_;
+  const char volume_;
+  uint64_t bytesPerRecord_;
+  runs_t mft_;
+  runs_t mirror_;
+  uint64_t mirrored_; // Number of records mirrored in $MFTMirr.
+  runs_t bitmapRuns_;
+  std::vector<unsigned char> bitmap_; // Contents of $Bitmap, set == in use.
+  std::vector<char> buffer_;
+  uint64_t used_;
+  uint64_t moves_;
+  uint64_t movedClusters_;
+
+  void read(uint64_t offset, void *buffer, size_t length);
+  void write(uint64_t offset, const void *buffer, size_t length);
+  void readStream(const runs_t &runs, uint64_t offset, void *buffer,
+                  size_t length);
+  void writeStream(const runs_t &runs, uint64_t offset, const void *buffer,
+                   size_t length);
+  // Reads a whole stream with several large reads in flight.
+  void loadStream(const runs_t &runs, void *buffer, size_t length);
+  bool readRecord(uint64_t id, std::vector<char> &record);
+  void writeRecord(uint64_t id, std::vector<char> record);
+
+  bool parts(uint64_t id, ULONG type, const std::wstring &name,
+             parts_t &rv);
+  bool runs(const parts_t &parts, runs_t &rv) const;
+  bool stream(const winx_file_info *f, parts_t &parts, runs_t &runs);
+  bool movable(const winx_file_info *f, parts_t &parts, runs_t &runs);
+
+  void allocate(uint64_t lcn, uint64_t length);
+  void release(uint64_t lcn, uint64_t length);
+  void copy(uint64_t from, uint64_t to, uint64_t length);
+  void update();
+
+public:
+  ImageBackend(const std::wstring &path, char volume);
+
+  bool used(uint64_t lcn) const {
+    return (bitmap_[(size_t)(lcn / 8)] & (1 << (lcn % 8))) != 0;
+  }
+  bool isFree(uint64_t lcn, uint64_t length) const;
+
+  uint64_t moves() const {
+    return moves_;
+  }
+  uint64_t movedClusters() const {
+    return movedClusters_;
+  }
+
+  virtual winx_volume_region *gaps() override;
+  virtual winx_volume_region *gaps(uint64_t lcn, uint64_t count) override;
+  virtual winx_file_info *files(ftw_filter_callback filter,
+                                ftw_progress_callback cb, ftw_terminator t,
+                                void *userdata) override;
+  virtual int dump(winx_file_info *f) override;
+  virtual NTSTATUS move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                        uint64_t lcn) override;
+};
+
+} // namespace zen
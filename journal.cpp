@@ -0,0 +1,141 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#include "journal.hpp"
+
+#include <fstream>
+
+namespace
+{
+
+// USN_RECORD (version 2), as found in the journal.
+#pragma pack(push, 1)
+struct UsnRecord {
+  uint32_t length;
+  uint16_t majorVersion;
+  uint16_t minorVersion;
+  uint64_t file;
+  uint64_t parent;
+  uint64_t usn;
+  uint64_t timestamp;
+  uint32_t reason;
+  uint32_t sourceInfo;
+  uint32_t securityId;
+  uint32_t attributes;
+  uint16_t nameLength;
+  uint16_t nameOffset;
+};
+#pragma pack(pop)
+
+// Records are 8 byte aligned and never cross a page of the journal.
+const size_t recordAlignment = 8;
+const size_t maxRecordLength = 4096;
+
+const size_t bufferSize = 1 << 20;
+
+inline uint64_t mftId(uint64_t frn)
+{
+  return frn & 0xffffffffffffULL;
+}
+
+struct volume_close {
+  void operator()(WINX_FILE *f) {
+    winx_fclose(f);
+  }
+};
+
+} // namespace
+
+namespace zen
+{
+
+std::unique_ptr<Journal> Journal::read(char volume,
+                                       const winx_usn_journal &journal,
+                                       uint64_t usn)
+{
+  if (usn < journal.first_usn || usn > journal.next_usn) {
+    throw std::exception("The change journal does not reach back far enough");
+  }
+  std::unique_ptr<WINX_FILE, volume_close> f(winx_vopen(volume));
+  if (!f) {
+    throw std::exception("Failed to open volume");
+  }
+  std::unique_ptr<Journal> rv(new Journal());
+  rv->nextUsn_ = usn;
+  std::vector<char> buffer(bufferSize);
+  while (usn < journal.next_usn) {
+    auto n = winx_read_usn_journal(f.get(), journal.journal_id, &usn,
+                                   buffer.data(), (int)buffer.size());
+    if (n < 0) {
+      throw std::exception("Failed to read the change journal");
+    }
+    if (!n) {
+      break;
+    }
+    rv->parse(buffer.data(), (size_t)n, journal.next_usn);
+  }
+  return rv;
+}
+
+std::unique_ptr<Journal> Journal::load(const std::wstring &file)
+{
+  std::ifstream in(file.c_str(), std::ios::binary);
+  if (!in) {
+    throw std::exception("Failed to open journal file");
+  }
+  std::unique_ptr<Journal> rv(new Journal());
+  std::vector<char> buffer(bufferSize);
+  size_t left = 0;
+  for (;;) {
+    in.read(buffer.data() + left, buffer.size() - left);
+    const auto n = left + (size_t)in.gcount();
+    if (n == left) {
+      // Whatever is left is a torn record.
+      break;
+    }
+    const auto used = rv->parse(buffer.data(), n);
+    left = n - used;
+    memmove(buffer.data(), buffer.data() + used, left);
+  }
+  return rv;
+}
+
+size_t Journal::parse(const char *buffer, size_t length, uint64_t end)
+{
+  size_t pos = 0;
+  while (length - pos >= recordAlignment) {
+    auto r = (const UsnRecord *)(buffer + pos);
+    if (!r->length || r->length % recordAlignment ||
+        r->length > maxRecordLength) {
+      // Padding up to the next page, or no record at all.
+      pos += recordAlignment;
+      continue;
+    }
+    if (r->length > length - pos) {
+      break;
+    }
+    pos += r->length;
+    if (r->majorVersion != 2 || r->length < sizeof(UsnRecord) ||
+        r->nameOffset + (size_t)r->nameLength > r->length ||
+        r->usn >= end) {
+      continue;
+    }
+    nextUsn_ = r->usn + r->length;
+    records_++;
+
+    auto &c = changes_[mftId(r->file)];
+    if (r->reason & FileCreate) {
+      // Another file altogether, if the record got reused.
+      c.reasons = 0;
+    }
+    c.reasons |= r->reason;
+    c.parent = mftId(r->parent);
+    c.attributes = r->attributes;
+    c.name.assign((const wchar_t *)((const char *)r + r->nameOffset),
+                  r->nameLength / sizeof(wchar_t));
+  }
+  return pos;
+}
+
+} // namespace zen
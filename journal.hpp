@@ -0,0 +1,108 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#pragma once
+
+#include "backend.hpp"
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace zen
+{
+
+// Change journal records (USN_RECORD version 2), folded per file: What
+// happened to each file over a range of the journal, as of its last record.
+// Records come from a live volume or from a raw dump of the $UsnJrnl:$J
+// stream, so that journals can be looked at offline as well.
+class Journal
+{
+public:
+  // USN_REASON_XXX
+  enum {
+    DataOverwrite = 0x00000001,
+    DataExtend = 0x00000002,
+    DataTruncation = 0x00000004,
+    NamedDataOverwrite = 0x00000010,
+    NamedDataExtend = 0x00000020,
+    NamedDataTruncation = 0x00000040,
+    FileCreate = 0x00000100,
+    FileDelete = 0x00000200,
+    EaChange = 0x00000400,
+    SecurityChange = 0x00000800,
+    RenameOldName = 0x00001000,
+    RenameNewName = 0x00002000,
+    IndexableChange = 0x00004000,
+    BasicInfoChange = 0x00008000,
+    HardLinkChange = 0x00010000,
+    CompressionChange = 0x00020000,
+    EncryptionChange = 0x00040000,
+    ObjectIdChange = 0x00080000,
+    ReparsePointChange = 0x00100000,
+    StreamChange = 0x00200000,
+    Close = 0x80000000
+  };
+
+  // Changes that may have moved clusters of a file around.
+  static const uint32_t clusterChanges =
+    DataOverwrite | DataExtend | DataTruncation | NamedDataOverwrite |
+    NamedDataExtend | NamedDataTruncation | CompressionChange |
+    EncryptionChange | ReparsePointChange | StreamChange;
+
+  struct Change {
+    uint64_t parent;     // MFT id of the parent directory.
+    uint32_t reasons;    // All reasons since the file was created last.
+    uint32_t attributes; // FILE_ATTRIBUTE_XXX
+    std::wstring name;
+
+    Change() : parent(0), reasons(0), attributes(0) {}
+
+    bool deleted() const {
+      return (reasons & FileDelete) != 0;
+    }
+    bool created() const {
+      return (reasons & FileCreate) != 0;
+    }
+  };
+  // By MFT id, i.e. file reference numbers without the sequence number.
+  typedef std::unordered_map<uint64_t, Change> changes_t;
+
+private:
+  changes_t changes_;
+  uint64_t records_;
+  uint64_t nextUsn_;
+
+public:
+  Journal() : records_(0), nextUsn_(0) {}
+
+  // Reads the records from |usn| up to the state |journal| describes.
+  // Throws if any of them are gone already.
+  static std::unique_ptr<Journal> read(char volume,
+                                       const winx_usn_journal &journal,
+                                       uint64_t usn);
+  // Loads a raw $UsnJrnl:$J dump. Sparse parts read as zeros and get
+  // skipped.
+  static std::unique_ptr<Journal> load(const std::wstring &file);
+
+  // Folds the records in |buffer| up to |end|. Returns the number of bytes
+  // used; a record cut off at the end of the buffer is left for the next
+  // call.
+  size_t parse(const char *buffer, size_t length,
+               uint64_t end = ~0ULL);
+
+  const changes_t &changes() const {
+    return changes_;
+  }
+  uint64_t records() const {
+    return records_;
+  }
+  // The usn following the last record parsed.
+  uint64_t nextUsn() const {
+    return nextUsn_;
+  }
+};
+
+} // namespace zen
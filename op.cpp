@@ -3,6 +3,7 @@
 /* Written by Nils Maier in 2014. */
 
 #include "op.hpp"
+#include "image.hpp"
 
 #include <iomanip>
 #include <iostream>
@@ -12,6 +13,24 @@
 
 using util::ConsoleHandler;
 
+// Dry runs: What a move is assumed to cost on top of the data it copies
+// (the FSCTL_MOVE_FILE round trip, MFT and bitmap updates).
+static const double dryRunMoveOverhead = 0.02;
+
+static std::wstring duration(double seconds)
+{
+  auto s = (uint64_t)(seconds + 0.5);
+  std::wstringstream ss;
+  if (s >= 3600) {
+    ss << s / 3600 << L"h ";
+  }
+  if (s >= 60) {
+    ss << s / 60 % 60 << L"m ";
+  }
+  ss << s % 60 << L"s";
+  return ss.str();
+}
+
 static void __cdecl progress(winx_file_info *f, uint64_t *count)
 {
   if (!(++*count % 13579)) {
@@ -24,44 +43,29 @@ static void move_file(
   Operation &op, winx_file_info *f, const winx_volume_region *g)
 {
   op.fe->pop(f);
+  if (op.tracer) {
+    op.tracer->pick(f, g->lcn);
+  }
 
   auto target = *g;
 
-  IO_STATUS_BLOCK iosb;
-  MOVEFILE_DESCRIPTOR mfd;
-  memset(&mfd, 0, sizeof(mfd));
-
   auto startlcn = 0;
   auto numlcns = f->disp.clusters;
   while (auto cur = (ULONG)min(numlcns, MAXULONG32 - 10)) {
-    NTSTATUS status;
-    {
-      auto file = zen::openFile(f);
-      mfd.FileHandle = file.get();
-      mfd.StartVcn.QuadPart = startlcn;
-      mfd.NumVcns = cur;
-      mfd.TargetLcn.QuadPart = target.lcn;
-      if (op.opts.verbose) {
-        std::wcout << L"Moving " << cur << L" segments (" <<
-                   op.vol(cur) << L") to " << target.lcn <<
-                   L"(" << op.vol(target.length) << L")" <<
-                   std::endl;
-      }
-      status = ::NtFsControlFile(op.vol, nullptr, nullptr, 0, &iosb,
-                                 FSCTL_MOVE_FILE, &mfd,
-                                 sizeof(mfd), nullptr, 0);
-      if (NT_SUCCESS(status)) {
-        //::FlushFileBuffers(mfd.FileHandle);
-        ::NtWaitForSingleObject(op.vol, FALSE, nullptr);
-        status = iosb.Status;
-      }
+    if (op.opts.verbose) {
+      std::wcout << L"Moving " << cur << L" segments (" <<
+                 op.vol(cur) << L") to " << target.lcn <<
+                 L"(" << op.vol(target.length) << L")" <<
+                 std::endl;
     }
+    auto status = op.vol.backend().move(f, startlcn, cur, target.lcn);
 
-    op.ge->push(f);
-    winx_ftw_dump_file(f, nullptr, nullptr);
+    op.ge->push(op.fe->table(), f);
+    op.vol.backend().dump(f);
 
     if (NT_SUCCESS(status)) {
-      op.ge->pop(f);
+      op.fe->dumped(f);
+      op.ge->pop(op.fe->table(), f);
       op.fe->push(f);
       numlcns -= cur;
       target.lcn += cur;
@@ -69,7 +73,14 @@ static void move_file(
       continue;
     }
 
-    // No success
+    // No success: Whatever the move did, only the clusters the file had,
+    // has now and was to go to may differ from what the gaps say.
+    op.fe->extents(f, [&](uint64_t lcn, uint64_t length) {
+      op.ge->resync(lcn, length);
+    });
+    op.fe->dumped(f);
+    op.ge->resync(op.fe->table(), f);
+    op.ge->resync(target.lcn, cur);
     if (status == STATUS_ALREADY_COMMITTED) {
       // Area vanished. File is still good.
       op.fe->push(const_cast<winx_file_info *>(f));
@@ -121,8 +132,8 @@ static bool move_set(
       auto f = *i;
 
       if (op.opts.verbose) {
-        std::wcout << L"Found " << f->path << L"(" <<
-                   std::fixed << f->disp.blockmap->lcn <<
+        std::wcout << L"Found " << zen::filePath(f) << L"(" <<
+                   std::fixed << op.fe->lcn(f) <<
                    L", " << op.vol(f->disp.clusters) << L", frag: " <<
                    std::fixed << f->disp.fragments << L")" << std::endl;
       }
@@ -167,17 +178,17 @@ static void defrag(Operation &op)
 
     if (*i == op.last) {
       if (op.opts.verbose) {
-        std::wcout << L"Skipping " << (*i)->path << std::endl;
+        std::wcout << L"Skipping " << zen::filePath(*i) << std::endl;
       }
       op.fe->pop(*i);
     }
     if (op.opts.verbose) {
-      std::wcout << L"Handling file at: " << (*i)->path << L" (" <<
+      std::wcout << L"Handling file at: " << zen::filePath(*i) << L" (" <<
                  op.vol((*i)->disp.clusters) << L", frags: " <<
                  std::fixed << (*i)->disp.fragments << L")" << std::endl;
     }
     else {
-      std::wcout << L"\r" << util::light << (*i)->path + 4 << util::clear <<
+      std::wcout << L"\r" << util::light << zen::filePath(*i) + 4 << util::clear <<
                  L" frags: " << util::red << (*i)->disp.fragments << util::clear <<
                  L"" << std::flush;
     }
@@ -192,17 +203,19 @@ static void defrag(Operation &op)
       }
     }
     catch (const std::exception &ex) {
-      std::wcerr << std::endl << (*i)->path << L": " << util::red <<
+      std::wcerr << std::endl << zen::filePath(*i) << L": " << util::red <<
                  util::to_wstring(ex.what()) << util::clear << std::endl;
-      op.ge->scan();
     }
   }
   std::wcout << std::endl;
 }
 
+// |failed| tells whether a move went wrong, in which case the gaps around it
+// got read again and |g| may be gone.
 static bool widen_behind(Operation &op, const winx_volume_region *g,
-                         size_t maxMoves)
+                         size_t maxMoves, bool &failed)
 {
+  failed = false;
   auto r = *g;
   size_t moved = 0;
   uint64_t movedlen = 0;
@@ -231,8 +244,9 @@ static bool widen_behind(Operation &op, const winx_volume_region *g,
       moved++;
     }
     catch (const std::exception &ex) {
-      std::wcerr << std::endl << f->path << ": " << util::red <<
+      std::wcerr << std::endl << zen::filePath(f) << ": " << util::red <<
                  util::to_wstring(ex.what()) << util::clear << std::endl;
+      failed = true;
       return false;
     }
   }
@@ -263,18 +277,27 @@ static void close_gaps(Operation &op)
                std::right << std::setprecision(1) << std::fixed <<
                p << L"%) " << std::flush;
     auto files = op.fe->findBest(g, partialOK);
+    if (op.tracer) {
+      op.tracer->gap(*g, files.size());
+    }
     if (!files.empty()) {
       auto r = *g;
       if (!move_set(op, files, r)) {
-        op.ge->scan();
         continue;
       }
       partialOK = false;
     }
     else {
-      auto widened = widen_behind(op, g, partialOK ? 100 : 3);
+      const auto lcn = g->lcn;
+      bool failed;
+      auto widened = widen_behind(op, g, partialOK ? 100 : 3, failed);
       if (!widened && partialOK) {
-        op.ge->pop(g);
+        if (failed) {
+          g = op.ge->find(lcn);
+        }
+        if (g) {
+          op.ge->pop(g);
+        }
         partialOK = false;
       }
       else {
@@ -303,6 +326,25 @@ void Options::parse(int argc, wchar_t **argv)
    "Aggressive processing (disregarding maxsize)")
   ("no-gaps", "Do not attempt to close gaps")
   ("no-defrag", "Do not attempt to defrag files")
+  ("image",
+   po::wvalue<std::wstring>(&image),
+   "Process an unmounted NTFS volume image offline instead of a volume")
+  ("trace",
+   po::wvalue<std::wstring>(&trace),
+   "Record the initial layout, planner decisions and moves to a trace file")
+  ("replay",
+   po::wvalue<std::wstring>(&replay),
+   "Replay a trace file and check the planner still decides the same")
+  ("dry-run,n",
+   "Plan the run against a copy of the layout and predict the outcome "
+   "without moving anything")
+  ("dry-run-rate",
+   po::value<double>(&dryRunRate)->default_value(dryRunRate),
+   "Move throughput in MB/sec to assume for dry run estimates")
+  ("scan-cache",
+   po::wvalue<std::wstring>(&scanCache),
+   "Keep the scanned files in this file, and reuse them as long as the "
+   "volume did not change much, according to the change journal")
   ;
   po::options_description hidden("Hidden options");
   hidden.add_options()
@@ -311,6 +353,33 @@ void Options::parse(int argc, wchar_t **argv)
   ("volume",
    po::wvalue<std::wstring>(),
    "Volume to defrag")
+  ("layout",
+   po::wvalue<std::wstring>(&layout),
+   "Process a simulated volume layout instead of a volume")
+  ("dump-layout",
+   po::wvalue<std::wstring>(&dumpLayout),
+   "Record the layout of the volume for simulated runs")
+  ("generate-layout",
+   po::wvalue<std::wstring>(),
+   "Generate an aged, simulated volume layout")
+  ("aging-files",
+   po::value<uint64_t>(&aging.files)->default_value(aging.files),
+   "Number of files in the generated layout")
+  ("aging-clusters",
+   po::value<uint64_t>(&aging.clusters)->default_value(aging.clusters),
+   "Clusters of the generated layout (0 = derive from fill)")
+  ("aging-fill",
+   po::value<double>(&aging.fill)->default_value(aging.fill),
+   "Fill ratio of the generated layout")
+  ("aging-churn",
+   po::value<double>(&aging.churn)->default_value(aging.churn),
+   "Operations per file during aging")
+  ("aging-mean",
+   po::value<uint64_t>(&aging.meanClusters)->default_value(aging.meanClusters),
+   "Mean file size in clusters")
+  ("aging-seed",
+   po::value<unsigned>(&aging.seed)->default_value(aging.seed),
+   "Random seed")
   ;
   po::options_description all("All options");
   all.add(desc).add(hidden);
@@ -381,15 +450,39 @@ void Options::parse(int argc, wchar_t **argv)
     util::unregisterPath();
     throw Exit(0);
   }
+  if (vm.count("generate-layout")) {
+    auto file = vm["generate-layout"].as<std::wstring>();
+    std::wcout << L"Aging a volume with " << util::light << aging.files <<
+               util::clear << L" files" << std::endl;
+    auto sim = zen::age(aging);
+    sim->save(file);
+    std::wcout << L"Wrote " << util::light << file << util::clear << L": " <<
+               sim->clusters() << L" clusters, " << sim->usedClusters() <<
+               L" in use" << std::endl;
+    throw Exit(0);
+  }
   if (vm.count("volume")) {
     auto v = vm["volume"].as<std::wstring>();
     volume = (char) v[0];
   }
+  if (!layout.empty()) {
+    volume = 'S';
+  }
+  if (!replay.empty()) {
+    volume = 'R';
+  }
+  if (!image.empty() && !volume) {
+    volume = 'I';
+  }
   verbose = vm.count("verbose");
   aggressive = vm.count("aggressive") > 0;
   gaps = vm.count("no-gaps") < 1;
   defrag = vm.count("no-defrag") < 1;
   widen = vm.count("widen") > 0;
+  dryRun = vm.count("dry-run") > 0;
+  if (dryRun && dryRunRate <= 0) {
+    throw std::exception("The dry run rate must be positive");
+  }
 
   if ((volume < 'a' || volume > 'z') && (volume < 'A' || volume > 'Z')) {
     throw std::exception("You need to specify a volume!");
@@ -399,7 +492,70 @@ void Options::parse(int argc, wchar_t **argv)
 void Operation::init(int argc, wchar_t **argv)
 {
   opts.parse(argc, argv);
-  vol.init(opts.volume);
+  std::unique_ptr<zen::Backend> backend;
+  if (!opts.replay.empty()) {
+    // The recorded options, so that the planner gets to decide the same.
+    tracer = new zen::TraceBackend(opts.replay);
+    backend.reset(tracer);
+    const auto &to = tracer->options();
+    opts.maxSize = (size_t)to.maxSize;
+    opts.aggressive = to.aggressive;
+    opts.gaps = to.gaps;
+    opts.defrag = to.defrag;
+    opts.widen = to.widen;
+  }
+  else if (!opts.layout.empty()) {
+    backend = zen::SimBackend::load(opts.layout);
+  }
+  else if (!opts.image.empty()) {
+    backend.reset(new zen::ImageBackend(opts.image, (char)toupper(opts.volume)));
+  }
+  else {
+    backend.reset(new zen::WinxBackend(opts.volume));
+    if (!opts.scanCache.empty()) {
+      cache = new zen::CacheBackend(std::move(backend), opts.volume,
+                                    opts.scanCache);
+      backend.reset(cache);
+    }
+  }
+  if (opts.dryRun && !opts.replay.empty()) {
+    // Replays do not move anything either way.
+    opts.dryRun = false;
+  }
+  if (opts.dryRun && opts.layout.empty()) {
+    // Plan against an in-memory copy of what the volume looks like now.
+    util::title << L"Enumerating files" << std::flush;
+    uint64_t count = 0;
+    auto sim = zen::SimBackend::record(*backend,
+                                       (ftw_progress_callback)progress, &count);
+    std::wcout << L"\r";
+    if (cache) {
+      // Nothing will be moved, so the scan is good for the next run.
+      if (cache->hit()) {
+        std::wcout << L"Using the scan cache";
+        if (cache->changes()) {
+          std::wcout << L", " << cache->changes() << L" files changed since";
+        }
+        std::wcout << std::endl;
+      }
+      else if (cache->store(*sim)) {
+        std::wcout << L"Updated the scan cache" << std::endl;
+      }
+      cache = nullptr;
+    }
+    backend = std::move(sim);
+  }
+  if (!opts.trace.empty() && !tracer) {
+    zen::TraceBackend::Options to;
+    to.maxSize = opts.maxSize;
+    to.aggressive = opts.aggressive;
+    to.gaps = opts.gaps;
+    to.defrag = opts.defrag;
+    to.widen = opts.widen;
+    tracer = new zen::TraceBackend(std::move(backend), opts.trace, to);
+    backend.reset(tracer);
+  }
+  vol.init(std::move(backend));
   opts.maxSize = opts.maxSize * 1024 / vol.info.bytes_per_cluster;
   std::wcout << std::setw(20) << std::left << L"Processing volume: " <<
              util::light << (wchar_t)toupper(opts.volume) << L": " << vol.info.label << " ("
@@ -414,23 +570,49 @@ void Operation::init(int argc, wchar_t **argv)
              << vol.info.bytes_per_cluster << util::clear << std::endl;
   std::wcout << std::setw(20) << std::left << L"Using max gap size: " <<
              util::light << vol(opts.maxSize) << util::clear << std::endl;
+  if (opts.dryRun) {
+    std::wcout << util::yellow << L"Dry run: Nothing will be moved" <<
+               util::clear << std::endl;
+  }
   std::wcout << std::endl;
 
   util::title << L"Enumerating files" << std::flush;
 
-  ge.reset(new zen::GapEnumeration(opts.volume));
+  if (!opts.dumpLayout.empty()) {
+    uint64_t count = 0;
+    auto sim = zen::SimBackend::record(vol.backend(),
+                                       (ftw_progress_callback)progress, &count);
+    sim->save(opts.dumpLayout);
+    std::wcout << L"\rWrote " << util::light << sim->table().size() <<
+               util::clear << L" files to " << util::light << opts.dumpLayout <<
+               util::clear << std::endl;
+    throw Exit(0);
+  }
+
+  ge.reset(new zen::GapEnumeration(vol.backend()));
   uint64_t count = 0;
-  fe.reset(new zen::FileEnumeration(opts.volume, (ftw_progress_callback)progress,
-                                    &count));
+  // Only defragmenting, widening or aggressive runs move files into gaps
+  // larger than maxSize, so other runs never touch larger files.
+  const uint64_t maxClusters =
+    opts.defrag || opts.widen || opts.aggressive ? 0 : opts.maxSize;
+  fe.reset(new zen::FileEnumeration(vol.backend(), (ftw_progress_callback)progress,
+                                    &count, maxClusters));
   std::wcout << L"\rFound " << util::light << fe->count() << util::clear <<
              L" processable files in total" << std::endl;
+  if (cache && cache->hit()) {
+    std::wcout << L"Using the scan cache";
+    if (cache->changes()) {
+      std::wcout << L", " << cache->changes() << L" files changed since";
+    }
+    std::wcout << std::endl;
+  }
   std::wcout << L"Found " << util::yellow << fe->unprocessable() << util::clear
              << L" unprocessable files" << std::endl;
 
   if (opts.verbose) {
     std::wcout << util::yellow;
     for (auto i = fe->unmovable().begin(), e = fe->unmovable().end(); i != e; ++i) {
-      std::wcout << ((*i)->path + 4) << std::endl;
+      std::wcout << (zen::filePath(*i) + 4) << std::endl;
     }
     std::wcout << util::clear;
   }
@@ -454,32 +636,54 @@ void Operation::run()
     if (opts.defrag) {
       // Some defragmentation.
       defrag(*this);
-      ge->scan();
+      ge->rebuild();
     }
 
     replaced = false;
 
     if (opts.gaps) {
       close_gaps(*this);
-      ge->scan();
+      ge->rebuild();
     }
   }
 
   util::title << L"Finishing" << std::flush;
+  if (tracer) {
+    tracer->finish();
+  }
+  if (cache && !cache->store()) {
+    std::wcout << std::endl << util::yellow <<
+               L"The volume changed during the run, not updating the scan cache" <<
+               util::clear << std::endl;
+  }
   ge->scan();
   std::wcout << std::endl << L"Final gap count: " << util::light << ge->count()
              << util::clear << std::endl;
-  std::wcout << L"Carried out " << util::light << moved << util::clear <<
-             L" successful moves, having moved " << util::light << vol(movedLen) <<
-             util::clear << L" (" << vol(movedLen / seconds()) << L"/sec)." <<
-             std::endl;
+  if (opts.dryRun) {
+    auto bytes = movedLen * vol.info.bytes_per_cluster;
+    auto estimate = moved * dryRunMoveOverhead +
+                    bytes / (opts.dryRunRate * 1048576.0);
+    std::wcout << L"Would carry out " << util::light << moved << util::clear <<
+               L" moves, moving " << util::light << vol(movedLen) <<
+               util::clear << L"." << std::endl;
+    std::wcout << L"Estimated duration: " << util::light <<
+               duration(estimate) << util::clear << L" at " <<
+               std::setprecision(1) << std::fixed << opts.dryRunRate <<
+               L" MB/sec (planned in " << std::setprecision(2) << seconds() <<
+               L" sec)" << std::endl;
+  }
+  else {
+    std::wcout << L"Carried out " << util::light << moved << util::clear <<
+               L" successful moves, having moved " << util::light <<
+               vol(movedLen) << util::clear << L" (" <<
+               vol(movedLen / seconds()) << L"/sec)." << std::endl;
+  }
 
   uint64_t smallish = 0, smallsize = 0;
   uint64_t largish = 0, largesize = 0;
-  auto largest = ge->sbegin();
-  if (largest != ge->send()) {
+  if (auto largest = ge->largest()) {
     std::wcout << L"Largest consecutive gap: " << util::blue <<
-               vol(largest->first) << util::clear << std::endl;
+               vol(largest->length) << util::clear << std::endl;
   }
   for (auto i = ge->begin(), e = ge->end(); i != e; ++i) {
     if (i->second->length <= opts.maxSize) {
@@ -505,6 +709,29 @@ void Operation::run()
                L" small gaps covering " << util::light << vol(smallsize)
                << util::clear << std::endl;
   }
+
+  if (tracer && !tracer->replaying()) {
+    std::wcout << L"Wrote " << util::light << tracer->written() <<
+               util::clear << L" events to " << util::light << opts.trace <<
+               util::clear << std::endl;
+  }
+  else if (tracer) {
+    std::wcout << L"Replay matched " << util::light << tracer->matched() <<
+               util::clear << L" of " << tracer->recorded() <<
+               L" recorded events" << std::endl;
+    if (tracer->ended()) {
+      std::wcout << util::yellow << L"The recorded run was cut short there" <<
+                 util::clear << std::endl;
+    }
+    if (tracer->diverged()) {
+      std::wcout << util::red << L"Diverged" << util::clear << std::endl <<
+                 L"  recorded: " << tracer->describe(tracer->expected()) <<
+                 std::endl <<
+                 L"  replayed: " << tracer->describe(tracer->actual()) <<
+                 std::endl;
+      throw std::exception("The planner diverged from the trace");
+    }
+  }
 }
 
 std::wstring Operation::metrics() const
@@ -6,6 +6,9 @@
 
 #include "util.hpp"
 #include "zen.hpp"
+#include "aging.hpp"
+#include "trace.hpp"
+#include "cache.hpp"
 
 struct Options {
   size_t maxSize;
@@ -15,10 +18,19 @@ struct Options {
   bool gaps;
   bool defrag;
   bool widen;
+  bool dryRun;
+  double dryRunRate; // MB/sec
+  std::wstring layout;
+  std::wstring image;
+  std::wstring dumpLayout;
+  std::wstring trace;
+  std::wstring replay;
+  std::wstring scanCache;
+  zen::AgingOptions aging;
 
   Options()
     : maxSize(102400), volume('\0'), verbose(0), aggressive(false), gaps(true),
-      defrag(true), widen(false) {
+      defrag(true), widen(false), dryRun(false), dryRunRate(100.0) {
   }
 
   void parse(int argc, wchar_t **argv);
@@ -35,9 +47,12 @@ struct Operation {
   uint64_t freq;
   const winx_file_info *last;
   bool replaced;
+  zen::TraceBackend *tracer; // Owned by vol, if recording or replaying.
+  zen::CacheBackend *cache; // Owned by vol, if keeping a scan cache.
 
   Operation()
-    : moved(0), movedLen(0), last(nullptr), replaced(false) {
+    : moved(0), movedLen(0), last(nullptr), replaced(false), tracer(nullptr),
+      cache(nullptr) {
     LARGE_INTEGER li;
     ::QueryPerformanceFrequency(&li);
     freq = li.QuadPart;
@@ -0,0 +1,453 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#include "sim.hpp"
+#include "zen.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+namespace
+{
+
+// Layout file: header, volume bitmap, then per file the flags, the path
+// (UTF-16) and the extents. Everything little endian, as written.
+const char layoutMagic[8] = { 'S', 'G', 'L', 'A', 'Y', 'O', 'U', 'T' };
+const uint32_t layoutVersion = 1;
+
+struct LayoutHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t clusters;
+  uint64_t bytesPerCluster;
+  uint64_t files;
+};
+
+template<typename T>
+inline void write(std::ostream &out, const T &v)
+{
+  out.write((const char *)&v, sizeof(v));
+}
+
+template<typename T>
+inline void read(std::istream &in, T &v)
+{
+  in.read((char *)&v, sizeof(v));
+  if (!in) {
+    throw std::exception("Truncated layout file");
+  }
+}
+
+} // namespace
+
+namespace zen
+{
+
+SimBackend::SimBackend(uint64_t clusters, uint64_t bytesPerCluster)
+  : bitmap_((size_t)((clusters + 7) / 8), 0), used_(0), moves_(0),
+    movedClusters_(0)
+{
+  info.volume_letter = 'S';
+  strcpy(info.fs_name, "NTFS");
+  wcscpy(info.label, L"Simulated");
+  info.total_clusters = clusters;
+  info.bytes_per_cluster = bytesPerCluster;
+  info.bytes_per_sector = 512;
+  info.sectors_per_cluster = (ULONG)(bytesPerCluster / 512);
+  info.total_bytes = clusters * bytesPerCluster;
+  info.device_capacity = info.total_bytes;
+  info.ntfs_data.TotalClusters.QuadPart = clusters;
+  info.ntfs_data.BytesPerCluster = (ULONG)bytesPerCluster;
+  info.ntfs_data.BytesPerSector = 512;
+  info.ntfs_data.BytesPerFileRecordSegment = 1024;
+  update();
+}
+
+void SimBackend::update()
+{
+  info.free_bytes = (info.total_clusters - used_) * info.bytes_per_cluster;
+  info.ntfs_data.FreeClusters.QuadPart = info.total_clusters - used_;
+}
+
+void SimBackend::save(const std::wstring &file) const
+{
+  std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+  if (!out) {
+    throw std::exception("Failed to create layout file");
+  }
+  save(out);
+}
+
+void SimBackend::save(std::ostream &out) const
+{
+  LayoutHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, layoutMagic, sizeof(layoutMagic));
+  header.version = layoutVersion;
+  header.clusters = info.total_clusters;
+  header.bytesPerCluster = info.bytes_per_cluster;
+  header.files = files_.size();
+  write(out, header);
+  out.write((const char *)bitmap_.data(), bitmap_.size());
+  for (auto i = files_.begin(), e = files_.end(); i != e; ++i) {
+    write(out, (uint32_t)i->flags);
+    write(out, (uint32_t)i->path.size());
+    for (auto c = i->path.begin(), ce = i->path.end(); c != ce; ++c) {
+      write(out, (uint16_t)*c);
+    }
+    write(out, (uint64_t)i->extents.size());
+    for (auto x = i->extents.begin(), xe = i->extents.end(); x != xe; ++x) {
+      write(out, x->vcn);
+      write(out, x->lcn);
+      write(out, x->length);
+    }
+  }
+  if (!out) {
+    throw std::exception("Failed to write layout file");
+  }
+}
+
+std::unique_ptr<SimBackend> SimBackend::load(const std::wstring &file)
+{
+  std::ifstream in(file.c_str(), std::ios::binary);
+  if (!in) {
+    throw std::exception("Failed to open layout file");
+  }
+  return load(in);
+}
+
+std::unique_ptr<SimBackend> SimBackend::load(std::istream &in)
+{
+  LayoutHeader header;
+  read(in, header);
+  if (memcmp(header.magic, layoutMagic, sizeof(layoutMagic)) ||
+      header.version != layoutVersion || !header.bytesPerCluster) {
+    throw std::exception("Not a layout file");
+  }
+  std::unique_ptr<SimBackend> rv(
+    new SimBackend(header.clusters, header.bytesPerCluster));
+  in.read((char *)rv->bitmap_.data(), rv->bitmap_.size());
+  if (!in) {
+    throw std::exception("Truncated layout file");
+  }
+  for (auto c = 0ULL; c != header.clusters; ++c) {
+    if (rv->used(c)) {
+      rv->used_++;
+    }
+  }
+  rv->update();
+
+  rv->files_.resize((size_t)header.files);
+  for (auto i = rv->files_.begin(), e = rv->files_.end(); i != e; ++i) {
+    uint32_t flags, len;
+    read(in, flags);
+    read(in, len);
+    i->flags = flags;
+    i->path.resize(len);
+    for (auto c = i->path.begin(), ce = i->path.end(); c != ce; ++c) {
+      uint16_t ch;
+      read(in, ch);
+      *c = ch;
+    }
+    uint64_t count;
+    read(in, count);
+    i->extents.resize((size_t)count);
+    for (auto x = i->extents.begin(), xe = i->extents.end(); x != xe; ++x) {
+      read(in, x->vcn);
+      read(in, x->lcn);
+      read(in, x->length);
+      if (x->lcn + x->length > header.clusters) {
+        throw std::exception("Invalid extent in layout file");
+      }
+    }
+  }
+  return rv;
+}
+
+std::unique_ptr<SimBackend> SimBackend::record(Backend &source,
+    ftw_progress_callback cb, void *userdata)
+{
+  auto gaps = source.gaps();
+  auto files = source.files(nullptr, cb, nullptr, userdata);
+  if (!files) {
+    source.releaseGaps(gaps);
+    throw std::exception("Failed to gather volume information");
+  }
+  auto rv = record(source.info, gaps, files);
+  source.releaseGaps(gaps);
+  source.releaseFiles(files);
+  return rv;
+}
+
+std::unique_ptr<SimBackend> SimBackend::record(
+  const winx_volume_information &si, winx_volume_region *gaps,
+  winx_file_info *files)
+{
+  files_t table;
+  auto fl = List<winx_file_info>(files);
+  for (auto i = fl.begin(), e = fl.end(); i != e; ++i) {
+    File file;
+    // Built on the side, winx_ftw_get_path would keep the path of each file.
+    auto path = winx_ftw_build_path(&*i);
+    file.path = path ? path : L"";
+    winx_freep(&path);
+    file.flags = i->flags;
+    auto bm = List<winx_blockmap>(i->disp.blockmap);
+    for (auto b = bm.begin(), be = bm.end(); b != be; ++b) {
+      file.extents.push_back(Extent(b->vcn, b->lcn, b->length));
+    }
+    std::sort(file.extents.begin(), file.extents.end(),
+    [](const Extent & a, const Extent & b) {
+      return a.vcn < b.vcn;
+    });
+    table.push_back(file);
+  }
+  return record(si, gaps, std::move(table));
+}
+
+std::unique_ptr<SimBackend> SimBackend::record(
+  const winx_volume_information &si, winx_volume_region *gaps, files_t files)
+{
+  std::unique_ptr<SimBackend> rv(
+    new SimBackend(si.total_clusters, si.bytes_per_cluster));
+  memcpy(rv->info.label, si.label, sizeof(si.label));
+  memcpy(rv->info.fs_name, si.fs_name, sizeof(si.fs_name));
+
+  // Everything but the gaps is in use, including clusters of files we
+  // never get to see (metafiles and such), which remain unmovable.
+  std::fill(rv->bitmap_.begin(), rv->bitmap_.end(), 0xff);
+  rv->used_ = si.total_clusters;
+  auto regs = List<winx_volume_region>(gaps);
+  for (auto i = regs.begin(), e = regs.end(); i != e; ++i) {
+    rv->release(i->lcn, i->length);
+  }
+  rv->files_ = std::move(files);
+  return rv;
+}
+
+size_t SimBackend::add(const std::wstring &path, const extents_t &extents,
+                       unsigned long flags)
+{
+  File file;
+  file.path = path;
+  file.flags = flags;
+  file.extents = extents;
+  std::sort(file.extents.begin(), file.extents.end(),
+  [](const Extent & a, const Extent & b) {
+    return a.vcn < b.vcn;
+  });
+  for (auto i = file.extents.begin(), e = file.extents.end(); i != e; ++i) {
+    allocate(i->lcn, i->length);
+  }
+  files_.push_back(file);
+  return files_.size() - 1;
+}
+
+void SimBackend::assign(size_t id, const extents_t &extents)
+{
+  if (id >= files_.size()) {
+    throw std::exception("No such file in the layout");
+  }
+  auto &file = files_[id];
+  file.extents = extents;
+  std::sort(file.extents.begin(), file.extents.end(),
+  [](const Extent & a, const Extent & b) {
+    return a.vcn < b.vcn;
+  });
+}
+
+void SimBackend::allocate(uint64_t lcn, uint64_t length)
+{
+  if (lcn + length > info.total_clusters) {
+    throw std::exception("Extent beyond the end of the volume");
+  }
+  for (auto c = lcn, e = lcn + length; c != e; ++c) {
+    auto &b = bitmap_[c / 8];
+    auto m = (unsigned char)(1 << (c % 8));
+    if (!(b & m)) {
+      b |= m;
+      used_++;
+    }
+  }
+  update();
+}
+
+void SimBackend::release(uint64_t lcn, uint64_t length)
+{
+  for (auto c = lcn, e = min(lcn + length, info.total_clusters); c < e; ++c) {
+    auto &b = bitmap_[c / 8];
+    auto m = (unsigned char)(1 << (c % 8));
+    if (b & m) {
+      b &= ~m;
+      used_--;
+    }
+  }
+  update();
+}
+
+bool SimBackend::isFree(uint64_t lcn, uint64_t length) const
+{
+  if (lcn + length > info.total_clusters) {
+    return false;
+  }
+  for (auto c = lcn, e = lcn + length; c != e; ++c) {
+    if (used(c)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void SimBackend::fill(winx_file_info *f, const File &file) const
+{
+  f->disp.clusters = 0;
+  f->disp.fragments = 0;
+  winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+
+  winx_blockmap *block = nullptr;
+  for (auto i = file.extents.begin(), e = file.extents.end(); i != e; ++i) {
+    block = (winx_blockmap *)winx_list_insert(
+              (list_entry **)&f->disp.blockmap, (list_entry *)block,
+              sizeof(winx_blockmap));
+    block->vcn = i->vcn;
+    block->lcn = i->lcn;
+    block->length = i->length;
+    f->disp.clusters += block->length;
+    if (block == f->disp.blockmap ||
+        block->lcn != block->prev->lcn + block->prev->length) {
+      f->disp.fragments++;
+    }
+  }
+}
+
+winx_volume_region *SimBackend::gaps()
+{
+  return winx_bitmap_to_regions(bitmap_.data(), 0, info.total_clusters,
+                                nullptr, nullptr);
+}
+
+winx_volume_region *SimBackend::gaps(uint64_t lcn, uint64_t count)
+{
+  // The map starts at a byte boundary.
+  const auto start = lcn & ~7ULL;
+  if (start >= info.total_clusters) {
+    return nullptr;
+  }
+  count = min(lcn + count, info.total_clusters) - start;
+  return winx_bitmap_to_regions(bitmap_.data() + start / 8, start, count,
+                                nullptr, nullptr);
+}
+
+winx_file_info *SimBackend::files(ftw_filter_callback, ftw_progress_callback cb,
+                                  ftw_terminator t, void *userdata)
+{
+  winx_file_info *rv = nullptr, *f = nullptr;
+  for (size_t id = 0, e = files_.size(); id != e; ++id) {
+    if (t && t(userdata)) {
+      releaseFiles(rv);
+      return nullptr;
+    }
+    const auto &file = files_[id];
+    if (file.extents.empty()) {
+      // Like WINX_FTW_SKIP_RESIDENT_STREAMS
+      continue;
+    }
+    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)&rv,
+                                           (list_entry *)f,
+                                           sizeof(winx_file_info));
+    memset((char *)f + 2 * sizeof(void *), 0,
+           sizeof(winx_file_info) - 2 * sizeof(void *));
+    auto sep = file.path.find_last_of(L'\\');
+    f->name = winx_wcsdup(sep == std::wstring::npos ?
+                          file.path.c_str() : file.path.c_str() + sep + 1);
+    f->path = winx_wcsdup(file.path.c_str());
+    f->flags = file.flags;
+    f->internal.BaseMftId = id;
+    f->internal.ParentDirectoryMftId = 5; // FILE_root
+    fill(f, file);
+    if (cb) {
+      cb(f, userdata);
+    }
+  }
+  return rv;
+}
+
+int SimBackend::dump(winx_file_info *f)
+{
+  if (f->internal.BaseMftId >= files_.size()) {
+    return -1;
+  }
+  fill(f, files_[(size_t)f->internal.BaseMftId]);
+  return 0;
+}
+
+NTSTATUS SimBackend::move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                          uint64_t lcn)
+{
+  if (f->internal.BaseMftId >= files_.size()) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  auto &file = files_[(size_t)f->internal.BaseMftId];
+
+  // Split the extents into the kept and the moved parts.
+  extents_t kept, moved;
+  uint64_t total = 0;
+  const auto end = vcn + count;
+  for (auto i = file.extents.begin(), e = file.extents.end(); i != e; ++i) {
+    const auto iend = i->vcn + i->length;
+    if (iend <= vcn || i->vcn >= end) {
+      kept.push_back(*i);
+      continue;
+    }
+    if (i->vcn < vcn) {
+      kept.push_back(Extent(i->vcn, i->lcn, vcn - i->vcn));
+    }
+    const auto mvcn = max(i->vcn, vcn);
+    const auto mend = min(iend, end);
+    moved.push_back(Extent(mvcn, i->lcn + (mvcn - i->vcn), mend - mvcn));
+    total += mend - mvcn;
+    if (iend > end) {
+      kept.push_back(Extent(end, i->lcn + (end - i->vcn), iend - end));
+    }
+  }
+  if (!total) {
+    return STATUS_INVALID_PARAMETER;
+  }
+  if (!isFree(lcn, total)) {
+    // Same as the real thing, when the target area vanished.
+    return STATUS_ALREADY_COMMITTED;
+  }
+
+  auto target = lcn;
+  for (auto i = moved.begin(), e = moved.end(); i != e; ++i) {
+    release(i->lcn, i->length);
+    i->lcn = target;
+    target += i->length;
+  }
+  allocate(lcn, total);
+
+  kept.insert(kept.end(), moved.begin(), moved.end());
+  std::sort(kept.begin(), kept.end(), [](const Extent & a, const Extent & b) {
+    return a.vcn < b.vcn;
+  });
+  file.extents.clear();
+  for (auto i = kept.begin(), e = kept.end(); i != e; ++i) {
+    if (!file.extents.empty()) {
+      auto &last = file.extents.back();
+      if (last.vcn + last.length == i->vcn &&
+          last.lcn + last.length == i->lcn) {
+        last.length += i->length;
+        continue;
+      }
+    }
+    file.extents.push_back(*i);
+  }
+
+  moves_++;
+  movedClusters_ += total;
+  return STATUS_SUCCESS;
+}
+
+} // namespace zen
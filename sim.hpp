@@ -0,0 +1,114 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#pragma once
+
+#include "backend.hpp"
+
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace zen
+{
+
+// Simulated volume: A cluster bitmap plus a file extent table, all in
+// memory. Moves just rewrite the table and the bitmap, so whole runs can be
+// carried out (and profiled) without touching any disk.
+class SimBackend : public Backend
+{
+public:
+  struct Extent {
+    uint64_t vcn;
+    uint64_t lcn;
+    uint64_t length;
+
+    Extent() : vcn(0), lcn(0), length(0) {}
+    Extent(uint64_t v, uint64_t l, uint64_t n) : vcn(v), lcn(l), length(n) {}
+  };
+  typedef std::vector<Extent> extents_t;
+
+  struct File {
+    std::wstring path;
+    unsigned long flags;
+    extents_t extents; // Ordered by vcn.
+  };
+  typedef std::vector<File> files_t;
+
+private:
+  std::vector<unsigned char> bitmap_; // One bit per cluster, set == in use.
+  files_t files_;
+  uint64_t used_;
+  uint64_t moves_;
+  uint64_t movedClusters_;
+
+  void fill(winx_file_info *f, const File &file) const;
+  void update();
+
+public:
+  SimBackend(uint64_t clusters, uint64_t bytesPerCluster = 4096);
+
+  // Layouts, i.e. the bitmap plus the file table, may be stored and loaded
+  // again, so that runs can be repeated against the very same volume.
+  void save(const std::wstring &file) const;
+  void save(std::ostream &out) const;
+  static std::unique_ptr<SimBackend> load(const std::wstring &file);
+  static std::unique_ptr<SimBackend> load(std::istream &in);
+
+  // Records the current layout of another (usually live) volume.
+  static std::unique_ptr<SimBackend> record(Backend &source,
+      ftw_progress_callback cb = nullptr, void *userdata = nullptr);
+  // Same, from gaps and files another volume already enumerated.
+  static std::unique_ptr<SimBackend> record(const winx_volume_information &info,
+      winx_volume_region *gaps, winx_file_info *files);
+  // Same, from gaps and a file table kept elsewhere.
+  static std::unique_ptr<SimBackend> record(const winx_volume_information &info,
+      winx_volume_region *gaps, files_t files);
+
+  // Adds a file and marks its extents as used. Returns the file id.
+  size_t add(const std::wstring &path, const extents_t &extents,
+             unsigned long flags = 0);
+  // Replaces the extents of file |id|, leaving the bitmap alone.
+  void assign(size_t id, const extents_t &extents);
+
+  void allocate(uint64_t lcn, uint64_t length);
+  void release(uint64_t lcn, uint64_t length);
+
+  bool used(uint64_t lcn) const {
+    return (bitmap_[lcn / 8] & (1 << (lcn % 8))) != 0;
+  }
+  bool isFree(uint64_t lcn, uint64_t length) const;
+
+  uint64_t clusters() const {
+    return info.total_clusters;
+  }
+  uint64_t usedClusters() const {
+    return used_;
+  }
+  const std::vector<unsigned char> &bitmap() const {
+    return bitmap_;
+  }
+  const files_t &table() const {
+    return files_;
+  }
+
+  uint64_t moves() const {
+    return moves_;
+  }
+  uint64_t movedClusters() const {
+    return movedClusters_;
+  }
+
+  virtual winx_volume_region *gaps() override;
+  virtual winx_volume_region *gaps(uint64_t lcn, uint64_t count) override;
+  virtual winx_file_info *files(ftw_filter_callback filter,
+                                ftw_progress_callback cb, ftw_terminator t,
+                                void *userdata) override;
+  virtual int dump(winx_file_info *f) override;
+  virtual NTSTATUS move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                        uint64_t lcn) override;
+};
+
+} // namespace zen
@@ -0,0 +1,458 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#include "trace.hpp"
+#include "zen.hpp"
+
+#include <sstream>
+
+namespace
+{
+
+// Trace file: header, the initial layout (see SimBackend::save), then the
+// events as they happened, until the end of the file. A run that completed
+// ends with an End event. Everything little endian, as written.
+// Version 2 added what was read back after failed moves.
+const char traceMagic[8] = { 'S', 'G', 'T', 'R', 'A', 'C', 'E', '\0' };
+const uint32_t traceVersion = 2;
+
+const uint32_t traceAggressive = 0x1;
+const uint32_t traceNoGaps = 0x2;
+const uint32_t traceNoDefrag = 0x4;
+const uint32_t traceWiden = 0x8;
+
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t maxSize;
+};
+
+winx_volume_region *appendRegion(winx_volume_region **regions,
+                                 winx_volume_region *last, uint64_t lcn,
+                                 uint64_t length)
+{
+  last = (winx_volume_region *)winx_list_insert(
+           (list_entry **)(void *)regions, (list_entry *)last,
+           sizeof(winx_volume_region));
+  last->lcn = lcn;
+  last->length = length;
+  return last;
+}
+
+winx_volume_region *copyRegions(winx_volume_region *regions)
+{
+  winx_volume_region *rv = nullptr, *last = nullptr;
+  auto regs = zen::List<winx_volume_region>(regions);
+  for (auto i = regs.begin(), e = regs.end(); i != e; ++i) {
+    last = appendRegion(&rv, last, i->lcn, i->length);
+  }
+  return rv;
+}
+
+} // namespace
+
+namespace zen
+{
+
+TraceBackend::TraceBackend(std::unique_ptr<Backend> backend,
+                           const std::wstring &file, const Options &options)
+  : backend_(std::move(backend)), layout_(nullptr), options_(options),
+    failed_(false), started_(false), initialGaps_(nullptr), written_(0),
+    next_(0), complete_(false), diverged_(false), ended_(false)
+{
+  out_.open(file.c_str(), std::ios::binary | std::ios::trunc);
+  if (!out_) {
+    throw std::exception("Failed to create trace file");
+  }
+  info = backend_->info;
+
+  LARGE_INTEGER li;
+  ::QueryPerformanceFrequency(&li);
+  freq_ = li.QuadPart;
+  ::QueryPerformanceCounter(&li);
+  start_ = li.QuadPart;
+}
+
+TraceBackend::TraceBackend(const std::wstring &file)
+  : layout_(nullptr), failed_(false), started_(false), initialGaps_(nullptr),
+    written_(0), next_(0), complete_(false), diverged_(false), ended_(false)
+{
+  std::ifstream in(file.c_str(), std::ios::binary);
+  if (!in) {
+    throw std::exception("Failed to open trace file");
+  }
+  TraceHeader header;
+  in.read((char *)&header, sizeof(header));
+  if (!in || memcmp(header.magic, traceMagic, sizeof(traceMagic)) ||
+      header.version != traceVersion) {
+    throw std::exception("Not a trace file");
+  }
+  options_.maxSize = header.maxSize;
+  options_.aggressive = (header.flags & traceAggressive) != 0;
+  options_.gaps = !(header.flags & traceNoGaps);
+  options_.defrag = !(header.flags & traceNoDefrag);
+  options_.widen = (header.flags & traceWiden) != 0;
+
+  auto layout = SimBackend::load(in);
+
+  // A torn last event (the recorder crashed) is just dropped.
+  Event e;
+  while (in.read((char *)&e, sizeof(e))) {
+    if (e.kind == End) {
+      complete_ = true;
+      break;
+    }
+    events_.push_back(e);
+  }
+
+  layout_ = layout.get();
+  backend_ = std::move(layout);
+  info = backend_->info;
+
+  LARGE_INTEGER li;
+  ::QueryPerformanceFrequency(&li);
+  freq_ = li.QuadPart;
+  ::QueryPerformanceCounter(&li);
+  start_ = li.QuadPart;
+}
+
+TraceBackend::~TraceBackend()
+{
+  if (initialGaps_) {
+    winx_release_free_volume_regions(initialGaps_);
+    initialGaps_ = nullptr;
+  }
+}
+
+uint64_t TraceBackend::now() const
+{
+  LARGE_INTEGER li;
+  ::QueryPerformanceCounter(&li);
+  return (uint64_t)((li.QuadPart - start_) * 1e9 / freq_);
+}
+
+uint64_t TraceBackend::id(const winx_file_info *f) const
+{
+  if (replaying()) {
+    return f->internal.BaseMftId;
+  }
+  auto i = ids_.find(f);
+  return i == ids_.end() ? ~0ULL : i->second;
+}
+
+void TraceBackend::emit(Event &e)
+{
+  if (!started_) {
+    // Nothing to relate the event to without the layout.
+    return;
+  }
+  e.time = now();
+  out_.write((const char *)&e, sizeof(e));
+  written_++;
+}
+
+const TraceBackend::Event *TraceBackend::expect(const Event &e)
+{
+  if (diverged_ || ended_) {
+    return nullptr;
+  }
+  if (next_ == events_.size()) {
+    if (complete_) {
+      diverged_ = true;
+      expected_ = Event(End, 0, 0, 0, 0);
+      actual_ = e;
+      return nullptr;
+    }
+    // The recorded run was cut short here, and so is the replay.
+    ended_ = true;
+    ::InterlockedExchange(&util::ConsoleHandler::gTerminated, 1);
+    return nullptr;
+  }
+  const auto &rec = events_[next_];
+  if (!rec.same(e)) {
+    diverged_ = true;
+    expected_ = rec;
+    actual_ = e;
+    return nullptr;
+  }
+  next_++;
+  return &rec;
+}
+
+std::vector<TraceBackend::Event> TraceBackend::follow(uint32_t kind)
+{
+  std::vector<Event> rv;
+  while (next_ != events_.size() && events_[next_].kind == kind) {
+    rv.push_back(events_[next_++]);
+  }
+  return rv;
+}
+
+void TraceBackend::gap(const winx_volume_region &g, size_t files)
+{
+  Event e(Gap, files, 0, g.lcn, g.length);
+  failed_ = false;
+  if (replaying()) {
+    expect(e);
+  }
+  else {
+    emit(e);
+  }
+}
+
+void TraceBackend::pick(const winx_file_info *f, uint64_t lcn)
+{
+  Event e(Pick, id(f), 0, lcn, f->disp.clusters);
+  failed_ = false;
+  if (replaying()) {
+    expect(e);
+  }
+  else {
+    emit(e);
+  }
+}
+
+void TraceBackend::finish()
+{
+  if (replaying()) {
+    if (!diverged_ && !ended_ && next_ != events_.size()) {
+      // The planner is done, the recorded one was not.
+      diverged_ = true;
+      expected_ = events_[next_];
+      actual_ = Event(End, 0, 0, 0, 0);
+    }
+    return;
+  }
+  if (!util::ConsoleHandler::gTerminated) {
+    Event e(End, 0, 0, 0, 0);
+    emit(e);
+  }
+  out_.flush();
+  if (!out_) {
+    throw std::exception("Failed to write trace file");
+  }
+}
+
+std::wstring TraceBackend::describe(const Event &e) const
+{
+  std::wstringstream ss;
+  std::wstring path;
+  if (layout_ && e.file < layout_->table().size()) {
+    path = layout_->table()[(size_t)e.file].path;
+  }
+  else {
+    ss << L"#" << e.file;
+    path = ss.str();
+    ss.str(std::wstring());
+  }
+  switch (e.kind) {
+  case Gap:
+    ss << L"gap of " << e.length << L" clusters @ " << e.lcn << L", " <<
+       e.file << L" files chosen";
+    break;
+  case Pick:
+    ss << L"picked " << path << L" (" << e.length << L" clusters) for " <<
+       e.lcn;
+    break;
+  case Move:
+    ss << L"move of " << path << L" vcn " << e.vcn << L"+" << e.length <<
+       L" to " << e.lcn;
+    break;
+  case End:
+    ss << L"end of the run";
+    break;
+  case Gaps:
+    ss << L"free regions read within " << e.length << L" clusters @ " <<
+       e.lcn;
+    break;
+  case Region:
+    ss << L"free region of " << e.length << L" clusters @ " << e.lcn;
+    break;
+  case Dump:
+    ss << L"dump of " << path;
+    break;
+  case Extent:
+    ss << L"extent of " << path << L" vcn " << e.vcn << L"+" << e.length <<
+       L" @ " << e.lcn;
+    break;
+  default:
+    ss << L"unknown event " << e.kind;
+    break;
+  }
+  return ss.str();
+}
+
+winx_volume_region *TraceBackend::gaps()
+{
+  auto rv = backend_->gaps();
+  if (!replaying() && !started_ && !initialGaps_) {
+    initialGaps_ = copyRegions(rv);
+  }
+  return rv;
+}
+
+winx_volume_region *TraceBackend::gaps(uint64_t lcn, uint64_t count)
+{
+  if (!failed_) {
+    return backend_->gaps(lcn, count);
+  }
+  if (!replaying()) {
+    auto rv = backend_->gaps(lcn, count);
+    Event e(Gaps, 0, 0, lcn, count);
+    emit(e);
+    auto regs = List<winx_volume_region>(rv);
+    for (auto i = regs.begin(), ie = regs.end(); i != ie; ++i) {
+      Event r(Region, 0, 0, i->lcn, i->length);
+      emit(r);
+    }
+    return rv;
+  }
+
+  if (!expect(Event(Gaps, 0, 0, lcn, count))) {
+    return backend_->gaps(lcn, count);
+  }
+  // What was not free back then got taken by someone else meanwhile.
+  auto regions = follow(Region);
+  const auto end = min(lcn + count, layout_->clusters());
+  if (lcn < end) {
+    layout_->allocate(lcn, end - lcn);
+  }
+  winx_volume_region *rv = nullptr, *last = nullptr;
+  for (auto i = regions.begin(), ie = regions.end(); i != ie; ++i) {
+    const auto from = max(i->lcn, lcn);
+    const auto to = min(i->lcn + i->length, end);
+    if (from < to) {
+      layout_->release(from, to - from);
+    }
+    last = appendRegion(&rv, last, i->lcn, i->length);
+  }
+  return rv;
+}
+
+void TraceBackend::releaseGaps(winx_volume_region *regions)
+{
+  backend_->releaseGaps(regions);
+}
+
+winx_file_info *TraceBackend::files(ftw_filter_callback filter,
+                                    ftw_progress_callback cb, ftw_terminator t,
+                                    void *userdata)
+{
+  // The layout lacks files the filter rejected, which replays, running with
+  // the recorded options, reject alike.
+  auto rv = backend_->files(filter, cb, t, userdata);
+  if (!rv || replaying() || started_) {
+    return rv;
+  }
+
+  // The layout is what the planner starts out with: The first gaps and
+  // files it asked for.
+  if (!initialGaps_) {
+    auto g = backend_->gaps();
+    initialGaps_ = copyRegions(g);
+    backend_->releaseGaps(g);
+  }
+  auto layout = SimBackend::record(info, initialGaps_, rv);
+  winx_release_free_volume_regions(initialGaps_);
+  initialGaps_ = nullptr;
+
+  uint64_t id = 0;
+  auto fl = List<winx_file_info>(rv);
+  for (auto i = fl.begin(), e = fl.end(); i != e; ++i) {
+    ids_[&(*i)] = id++;
+  }
+
+  TraceHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, traceMagic, sizeof(traceMagic));
+  header.version = traceVersion;
+  header.flags = (options_.aggressive ? traceAggressive : 0) |
+                 (options_.gaps ? 0 : traceNoGaps) |
+                 (options_.defrag ? 0 : traceNoDefrag) |
+                 (options_.widen ? traceWiden : 0);
+  header.maxSize = options_.maxSize;
+  out_.write((const char *)&header, sizeof(header));
+  layout->save(out_);
+  started_ = true;
+  if (!out_) {
+    throw std::exception("Failed to write trace file");
+  }
+  return rv;
+}
+
+void TraceBackend::releaseFiles(winx_file_info *files)
+{
+  backend_->releaseFiles(files);
+}
+
+int TraceBackend::dump(winx_file_info *f)
+{
+  if (!failed_) {
+    return backend_->dump(f);
+  }
+  if (!replaying()) {
+    auto rv = backend_->dump(f);
+    Event e(Dump, id(f), 0, 0, 0);
+    e.status = (uint32_t)rv;
+    emit(e);
+    auto bm = List<winx_blockmap>(rv ? nullptr : f->disp.blockmap);
+    for (auto i = bm.begin(), ie = bm.end(); i != ie; ++i) {
+      Event x(Extent, e.file, i->vcn, i->lcn, i->length);
+      emit(x);
+    }
+    return rv;
+  }
+
+  auto rec = expect(Event(Dump, id(f), 0, 0, 0));
+  if (!rec) {
+    return backend_->dump(f);
+  }
+  const auto status = (int)rec->status;
+  auto extents = follow(Extent);
+  if (status) {
+    return status;
+  }
+  // The file as the failed move left it.
+  SimBackend::extents_t table;
+  for (auto i = extents.begin(), ie = extents.end(); i != ie; ++i) {
+    table.push_back(SimBackend::Extent(i->vcn, i->lcn, i->length));
+  }
+  layout_->assign((size_t)id(f), table);
+  return backend_->dump(f);
+}
+
+NTSTATUS TraceBackend::move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                            uint64_t lcn)
+{
+  Event e(Move, id(f), vcn, lcn, count);
+  if (replaying()) {
+    auto rec = expect(e);
+    if (rec && !NT_SUCCESS((NTSTATUS)rec->status)) {
+      // Failed back then (the area vanished, the file was locked...), so it
+      // fails again.
+      failed_ = true;
+      return (NTSTATUS)rec->status;
+    }
+    auto status = backend_->move(f, vcn, count, lcn);
+    if (rec && !NT_SUCCESS(status)) {
+      diverged_ = true;
+      expected_ = *rec;
+      actual_ = e;
+      actual_.status = (uint32_t)status;
+    }
+    failed_ = !NT_SUCCESS(status);
+    return status;
+  }
+
+  const auto start = now();
+  auto status = backend_->move(f, vcn, count, lcn);
+  e.status = (uint32_t)status;
+  e.duration = now() - start;
+  emit(e);
+  failed_ = !NT_SUCCESS(status);
+  return status;
+}
+
+} // namespace zen
@@ -0,0 +1,171 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+#pragma once
+
+#include "sim.hpp"
+
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace zen
+{
+
+// Binary trace of a run: The options, the initial layout of the volume,
+// each planner decision and each move along with its result and timing.
+// Recording wraps the backend the run goes against. Replaying runs the
+// planner again against the recorded layout, hands out the recorded move
+// results and checks that the planner makes the very same decisions.
+// A failed move may leave the volume other than the layout has it (the
+// target area vanished), so what the planner reads back after one is
+// recorded as well, and applied to the layout when replaying.
+class TraceBackend : public Backend
+{
+public:
+  struct Options {
+    uint64_t maxSize; // In KB, as given.
+    bool aggressive;
+    bool gaps;
+    bool defrag;
+    bool widen;
+
+    Options()
+      : maxSize(0), aggressive(false), gaps(true), defrag(true), widen(false) {}
+  };
+
+  enum Kind {
+    Gap = 1,  // A gap to be closed: lcn, length, file = files chosen.
+    Pick = 2, // A file chosen for a gap: file, lcn = target, length.
+    Move = 3, // A move: file, vcn, length, lcn = target, status, duration.
+    End = 4,  // The run completed.
+    // After a failed move, until the next decision or move:
+    Gaps = 5,   // Free regions read: lcn, length = range, Region events follow.
+    Region = 6, // A free region read: lcn, length.
+    Dump = 7,   // A file dumped: file, status, Extent events follow.
+    Extent = 8  // An extent of the file dumped: vcn, lcn, length.
+  };
+
+  struct Event {
+    uint32_t kind;
+    uint32_t status;
+    uint64_t file;
+    uint64_t vcn;
+    uint64_t lcn;
+    uint64_t length;
+    uint64_t time;     // ns since the start of the run.
+    uint64_t duration; // ns
+
+    Event()
+      : kind(0), status(0), file(0), vcn(0), lcn(0), length(0), time(0),
+        duration(0) {}
+    Event(uint32_t k, uint64_t f, uint64_t v, uint64_t l, uint64_t n)
+      : kind(k), status(0), file(f), vcn(v), lcn(l), length(n), time(0),
+        duration(0) {}
+
+    // Same decision, results and timing aside.
+    bool same(const Event &e) const {
+      return kind == e.kind && file == e.file && vcn == e.vcn &&
+             lcn == e.lcn && length == e.length;
+    }
+  };
+
+private:
+  std::unique_ptr<Backend> backend_;
+  SimBackend *layout_; // Replaying: The simulated volume, i.e. backend_.
+  Options options_;
+  uint64_t start_;
+  uint64_t freq_;
+  bool failed_; // The last move failed.
+
+  // Recording
+  std::ofstream out_;
+  bool started_; // The layout was written.
+  winx_volume_region *initialGaps_;
+  std::unordered_map<const winx_file_info *, uint64_t> ids_;
+  uint64_t written_;
+
+  // Replaying
+  std::vector<Event> events_;
+  size_t next_;
+  bool complete_;
+  bool diverged_;
+  bool ended_;
+  Event expected_;
+  Event actual_;
+
+  uint64_t now() const;
+  uint64_t id(const winx_file_info *f) const;
+  void emit(Event &e);
+  const Event *expect(const Event &e);
+  // Replaying: The events of |kind| following the one matched last.
+  std::vector<Event> follow(uint32_t kind);
+
+public:
+  // Records a run against |backend| into |file|.
+  TraceBackend(std::unique_ptr<Backend> backend, const std::wstring &file,
+               const Options &options);
+  // Loads |file| for replay.
+  explicit TraceBackend(const std::wstring &file);
+  virtual ~TraceBackend();
+
+  bool replaying() const {
+    return layout_ != nullptr;
+  }
+  const Options &options() const {
+    return options_;
+  }
+
+  // Planner decisions.
+  void gap(const winx_volume_region &g, size_t files);
+  void pick(const winx_file_info *f, uint64_t lcn);
+
+  // Marks the end of a completed run and flushes the trace.
+  void finish();
+
+  // Recording: Events written so far.
+  uint64_t written() const {
+    return written_;
+  }
+
+  // Replaying: Recorded events, events matched and the first mismatch.
+  size_t recorded() const {
+    return events_.size();
+  }
+  size_t matched() const {
+    return next_;
+  }
+  bool diverged() const {
+    return diverged_;
+  }
+  // The recorded run was cut short before the replay was done.
+  bool ended() const {
+    return ended_;
+  }
+  std::wstring describe(const Event &e) const;
+  const Event &expected() const {
+    return expected_;
+  }
+  const Event &actual() const {
+    return actual_;
+  }
+
+  virtual winx_volume_region *gaps() override;
+  virtual winx_volume_region *gaps(uint64_t lcn, uint64_t count) override;
+  virtual void releaseGaps(winx_volume_region *regions) override;
+  virtual winx_file_info *files(ftw_filter_callback filter,
+                                ftw_progress_callback cb, ftw_terminator t,
+                                void *userdata) override;
+  virtual void releaseFiles(winx_file_info *files) override;
+  virtual bool keepsBlockmaps() const override {
+    return backend_->keepsBlockmaps();
+  }
+  virtual int dump(winx_file_info *f) override;
+  virtual NTSTATUS move(winx_file_info *f, uint64_t vcn, uint64_t count,
+                        uint64_t lcn) override;
+};
+
+} // namespace zen
@@ -4,6 +4,9 @@
 
 #include "zen.hpp"
 
+#include <bitset>
+#include <intrin.h>
+
 #include <boost/dynamic_bitset.hpp>
 #include <boost/multi_array.hpp>
 #include <boost/regex.hpp>
@@ -17,17 +20,87 @@ static const boost::wregex excluded(
 
 static const size_t maxlen = 256;
 
-
 namespace
 {
 
-inline bool minlcn(const winx_blockmap &a, const winx_blockmap &b)
+struct ScanContext {
+  uint64_t maxClusters;
+  zen::ExtentTable *extents;
+  ftw_progress_callback cb;
+  void *userdata;
+};
+
+// Whether the NTFS scanner may drop |f| right away, before it gets a path:
+// Files in the root directory and in $Extend are judged by their paths
+// already, others by the part of it the name based exclusions look at.
+// Files excluded by the path of some directory above are left to scan().
+int scanFilter(winx_file_info *f, void *userdata)
+{
+  auto sc = (const ScanContext *)userdata;
+  if (!f->disp.blockmap || !f->name ||
+      (sc->maxClusters && f->disp.clusters > sc->maxClusters)) {
+    return 1;
+  }
+  std::wstring probe;
+  switch (f->internal.ParentDirectoryMftId) {
+  case 5: // FILE_root
+    probe.append(L"\\??\\");
+    probe.push_back((wchar_t)f->internal.VolumeLetter);
+    probe.append(L":\\");
+    break;
+  case 11: // FILE_Extend
+    return 1;
+  default:
+    probe.push_back(L'\\');
+    break;
+  }
+  probe.append(f->name);
+  return boost::regex_search(probe, excluded) ? 1 : 0;
+}
+
+// Called as streams are found: Right away on the scanning thread, or for
+// each shard of the NTFS scan as it gets done while others are still read and
+// decoded. Index the extents early, so that scan() is left with what needs
+// the paths. Streams the scanner drops later are left out by scan().
+void scanProgress(winx_file_info *f, void *userdata)
+{
+  auto sc = (ScanContext *)userdata;
+  if (f->disp.blockmap) {
+    sc->extents->add(f);
+  }
+  if (sc->cb) {
+    sc->cb(f, sc->userdata);
+  }
+}
+
+inline uint64_t popcount(uint64_t word)
+{
+  return std::bitset<64>(word).count();
+}
+
+inline uint64_t lowestBit(uint64_t word)
+{
+  unsigned long i;
+  _BitScanForward64(&i, word);
+  return i;
+}
+
+inline uint64_t highestBit(uint64_t word)
 {
-  return a.lcn < b.lcn;
+  unsigned long i;
+  _BitScanReverse64(&i, word);
+  return i;
 }
 
+// |n| bits starting at |bit|, n + bit <= 64
+inline uint64_t mask(uint64_t bit, uint64_t n)
+{
+  return (n == 64 ? ~0ULL : (1ULL << n) - 1) << bit;
 }
 
+} // namespace
+
+
 namespace zen
 {
 
@@ -42,60 +115,257 @@ winx::~winx()
 }
 
 
-const winx_volume_region *GapEnumeration::best(
-  uint64_t clusters,  const winx_volume_region *not,  bool behindOnly) const
+const GapIndex::Gap *GapIndex::pick(const Class &c,
+                                    const winx_volume_region *not,
+                                    bool behindOnly) const
 {
-  if (sizes_.empty()) {
+  if (behindOnly && not && c.maxLcn <= not->lcn) {
     return nullptr;
   }
-  // Find a matching region.
-  auto range = sizes_.equal_range(clusters);
-  for (auto i = range.first; i != range.second; ++i) {
-    if (behindOnly && not && i->second->lcn <= not->lcn) {
+  for (auto g = c.head; g; g = g->sizeNext) {
+    if (behindOnly && not && g->lcn <= not->lcn) {
       continue;
     }
-    if (i->second != not) {
-      return i->second;
+    if (g != not) {
+      return g;
+    }
+  }
+  return nullptr;
+}
+
+const GapIndex::Gap *GapIndex::best(
+  uint64_t clusters,  const winx_volume_region *not,  bool behindOnly) const
+{
+  if (classes_.empty()) {
+    return nullptr;
+  }
+  // Find a matching region.
+  auto c = classes_.find(clusters);
+  if (c != classes_.end()) {
+    if (auto rv = pick(c->second, not, behindOnly)) {
+      return rv;
     }
   }
 
   // No matching region. Find first greater region.
   // We don't just want a region that is only somewhat latter, as this
   // would cause additional small gaps, we might not be able to fill later.
-  for (auto i = sizes_.upper_bound(max(clusters * 3 / 2, clusters + 512)),
-       e = sizes_.end(); i != e; ++i) {
-    if (behindOnly && not && i->second->lcn <= not->lcn) {
-      continue;
-    }
-    if (i->second != not) {
-      return i->second;
+  for (auto i = classes_.upper_bound(max(clusters * 3 / 2, clusters + 512)),
+       e = classes_.end(); i != e; ++i) {
+    if (auto rv = pick(i->second, not, behindOnly)) {
+      return rv;
     }
   }
   // Still no region. Just return the max. region.
-  for (auto i = sizes_.rbegin(), e = sizes_.rend(); i != e; ++i) {
+  for (auto i = classes_.rbegin(), e = classes_.rend(); i != e; ++i) {
     if (i->first < clusters) {
       break;
     }
-    if (behindOnly && not && i->second->lcn <= not->lcn) {
+    if (auto rv = pick(i->second, not, behindOnly)) {
+      return rv;
+    }
+  }
+  return nullptr;
+}
+
+void GapIndex::insert(Gap *g)
+{
+  auto c = classes_.insert(classes_t::value_type(g->length, Class())).first;
+  g->sizeClass = c;
+  g->sizeNext = nullptr;
+  g->sizePrev = c->second.tail;
+  if (g->sizePrev) {
+    g->sizePrev->sizeNext = g;
+  }
+  else {
+    c->second.head = g;
+  }
+  c->second.tail = g;
+  c->second.maxLcn = max(c->second.maxLcn, g->lcn);
+}
+
+void GapIndex::erase(Gap *g)
+{
+  auto &c = g->sizeClass->second;
+  if (g->sizePrev) {
+    g->sizePrev->sizeNext = g->sizeNext;
+  }
+  else {
+    c.head = g->sizeNext;
+  }
+  if (g->sizeNext) {
+    g->sizeNext->sizePrev = g->sizePrev;
+  }
+  else {
+    c.tail = g->sizePrev;
+  }
+  if (!c.head) {
+    classes_.erase(g->sizeClass);
+  }
+}
+
+void ClusterBitmap::reset(uint64_t clusters, winx_volume_region *gaps)
+{
+  // Bits behind the end are in use, so that searches never stop there.
+  clusters_ = clusters;
+  words_.assign((size_t)((clusters + 63) / 64), ~0ULL);
+  used_.assign((words_.size() + blockWords - 1) / blockWords,
+               (uint32_t)blockClusters);
+  if (!used_.empty()) {
+    used_.back() = (uint32_t)((words_.size() - 1) % blockWords + 1) * 64;
+  }
+  auto regs = List<winx_volume_region>(gaps);
+  for (auto i = regs.begin(), e = regs.end(); i != e; ++i) {
+    release(i->lcn, i->length);
+  }
+}
+
+void ClusterBitmap::set(uint64_t lcn, uint64_t length, bool inUse)
+{
+  const auto end = min(lcn + length, clusters_);
+  while (lcn < end) {
+    const auto bit = lcn % 64;
+    const auto n = min(end - lcn, 64 - bit);
+    const auto m = mask(bit, n);
+    auto &word = words_[(size_t)(lcn / 64)];
+    auto &used = used_[(size_t)(lcn / blockClusters)];
+    used -= (uint32_t)popcount(word & m);
+    word = inUse ? word | m : word & ~m;
+    used += (uint32_t)popcount(word & m);
+    lcn += n;
+  }
+}
+
+uint64_t ClusterBitmap::used(uint64_t lcn, uint64_t end) const
+{
+  end = min(end, clusters_);
+  uint64_t rv = 0;
+  while (lcn < end) {
+    if (!(lcn % blockClusters) && end - lcn >= blockClusters) {
+      rv += used_[(size_t)(lcn / blockClusters)];
+      lcn += blockClusters;
       continue;
     }
-    if (i->second != not) {
-      return i->second;
+    const auto bit = lcn % 64;
+    const auto n = min(end - lcn, 64 - bit);
+    rv += popcount(words_[(size_t)(lcn / 64)] & mask(bit, n));
+    lcn += n;
+  }
+  return rv;
+}
+
+uint64_t ClusterBitmap::find(uint64_t lcn, bool inUse) const
+{
+  if (lcn >= clusters_) {
+    return clusters_;
+  }
+  const auto flip = inUse ? 0ULL : ~0ULL;
+  const auto skip = inUse ? 0 : (uint32_t)blockClusters;
+  auto w = (size_t)(lcn / 64);
+  auto word = (words_[w] ^ flip) & (~0ULL << (lcn % 64));
+  for (;;) {
+    if (word) {
+      return min(w * 64 + lowestBit(word), clusters_);
+    }
+    if (++w == words_.size()) {
+      return clusters_;
+    }
+    if (!(w % blockWords)) {
+      // Blocks without a single cluster of interest.
+      auto b = w / blockWords;
+      while (b != used_.size() && used_[b] == skip) {
+        ++b;
+      }
+      if (b == used_.size()) {
+        return clusters_;
+      }
+      w = b * blockWords;
+    }
+    word = words_[w] ^ flip;
+  }
+}
+
+uint64_t ClusterBitmap::runStart(uint64_t lcn) const
+{
+  if (lcn >= clusters_) {
+    return lcn;
+  }
+  auto w = (size_t)(lcn / 64);
+  if (words_[w] & (1ULL << (lcn % 64))) {
+    return lcn;
+  }
+  auto word = words_[w] & ((1ULL << (lcn % 64)) - 1);
+  for (;;) {
+    if (word) {
+      return w * 64 + highestBit(word) + 1;
+    }
+    if (!w--) {
+      return 0;
+    }
+    if (w % blockWords == blockWords - 1) {
+      // Blocks all free.
+      auto b = w / blockWords;
+      while (b && !used_[b]) {
+        --b;
+      }
+      if (!used_[b]) {
+        return 0;
+      }
+      w = b * blockWords + blockWords - 1;
     }
+    word = words_[w];
   }
-  // Nothing :(
-  return nullptr;
 }
 
-void GapEnumeration::filter()
+void GapEnumeration::fill(winx_volume_region *gaps)
 {
-  regions_.clear();
-  sizes_.clear();
-  auto regs = List<winx_volume_region>(info_);
+  free();
+  auto regs = List<winx_volume_region>(gaps);
   for (auto i = regs.begin(), e = regs.end(); i != e; ++i) {
-    regions_.insert(regions_.end(), regions_t::value_type(i->lcn, &(*i)));
-    sizes_.insert(sizes_.end(), sizes_t::value_type(i->length, &(*i)));
+    add(i->lcn, i->length);
+  }
+}
+
+void GapEnumeration::add(uint64_t lcn, uint64_t length)
+{
+  Gap *g;
+  if (spare_) {
+    g = spare_;
+    spare_ = g->sizeNext;
+  }
+  else {
+    store_.emplace_back();
+    g = &store_.back();
   }
+  g->next = g->prev = nullptr;
+  g->lcn = lcn;
+  g->length = length;
+  // Mostly in order, when filling.
+  regions_.insert(regions_.end(), regions_t::value_type(lcn, g));
+  sizes_.insert(g);
+}
+
+void GapEnumeration::update(regions_t::iterator g, uint64_t lcn,
+                            uint64_t length)
+{
+  auto r = g->second;
+  sizes_.erase(r);
+  if (r->lcn != lcn) {
+    // Gaps never move past their neighbours.
+    regions_.insert(regions_.erase(g), regions_t::value_type(lcn, r));
+  }
+  r->lcn = lcn;
+  r->length = length;
+  sizes_.insert(r);
+}
+
+void GapEnumeration::remove(regions_t::iterator g)
+{
+  auto r = g->second;
+  sizes_.erase(r);
+  regions_.erase(g);
+  r->sizeNext = spare_;
+  spare_ = r;
 }
 
 void GapEnumeration::pop(const uint64_t lcn, const uint64_t length)
@@ -103,188 +373,291 @@ void GapEnumeration::pop(const uint64_t lcn, const uint64_t length)
   // The idea here is that we always move files to the beginning of a gap.
   auto g = regions_.find(lcn);
   if (g == regions_.end()) {
-#ifdef _DEBUG
-    ::DebugBreak();
-#endif
-    scan();
-    return;
-  }
-  auto range = sizes_.equal_range(g->second->length);
-  for (auto i = range.first; i != range.second; ++i) {
-    if (i->second != g->second) {
-      continue;
+    // Otherwise cut the clusters out of the gap they are in, if any.
+    g = regions_.upper_bound(lcn);
+    if (g == regions_.begin()) {
+      return;
     }
-    sizes_.erase(i);
-    break;
+    --g;
+    const auto end = g->first + g->second->length;
+    if (end <= lcn) {
+      return;
+    }
+    update(g, g->first, lcn - g->first);
+    if (end > lcn + length) {
+      add(lcn + length, end - lcn - length);
+    }
+    return;
   }
   if (g->second->length > length) {
-    auto n = g->second;
-    regions_.erase(g);
-    n->lcn += length;
-    n->length -= length;
-    regions_.insert(sizes_t::value_type(n->lcn, n));
-    sizes_.insert(sizes_t::value_type(n->length, n));
+    update(g, lcn + length, g->second->length - length);
     return;
   }
   if (g->second->length < length) {
-    ::DebugBreak(); // Something went horribly wrong!
+    // The gaps drifted from the volume, e.g. clusters were freed behind
+    // our back. Go by what the volume says now.
+    resync(lcn, length);
     return;
   }
-  regions_.erase(g);
+  remove(g);
 }
 
-void GapEnumeration::pop(const winx_file_info *f)
+void GapEnumeration::pop(const ExtentTable &extents, const winx_file_info *f)
 {
-  auto bm = List<winx_blockmap>(f->disp.blockmap);
-  for (auto i = bm.begin(), e = bm.end(); i != e; ++i) {
-    pop(i->lcn, i->length);
-  }
+  extents.each(f, [this](uint64_t lcn, uint64_t length) {
+    bitmap_.allocate(lcn, length);
+    pop(lcn, length);
+  });
 }
 
-void GapEnumeration::push(const winx_file_info *f)
+void GapEnumeration::push(const ExtentTable &extents, const winx_file_info *f)
 {
-  auto bm = List<winx_blockmap>(f->disp.blockmap);
-  for (auto b = bm.begin(), be = bm.end(); b != be; ++b) {
-    if (!b->length) {
-      continue;
+  extents.each(f, [this](uint64_t lcn, uint64_t length) {
+    if (!length) {
+      return;
+    }
+    bitmap_.release(lcn, length);
+
+    auto prev = regions_.lower_bound(lcn);
+    auto next = regions_.find(lcn + length);
+    bool mergePrev = false;
+    if (prev != regions_.begin()) {
+      --prev;
+      mergePrev = prev->second->lcn + prev->second->length == lcn;
     }
-    auto prev = std::prev(regions_.lower_bound(b->lcn));
-    auto next = regions_.find(b->lcn + b->length);
-    bool mergePrev = prev != regions_.end() &&
-                     prev->second->lcn + prev->second->length == b->lcn;
     bool mergeNext = next != regions_.end();
 
     // Try to merge with existing region(s).
     if (mergePrev && mergeNext) {
-      auto range = sizes_.equal_range(prev->second->length);
-      for (auto i = range.first; i != range.second; ++i) {
-        if (i->second != prev->second) {
-          continue;
-        }
-        sizes_.erase(i);
-        break;
-      }
-      range = sizes_.equal_range(next->second->length);
-      for (auto i = range.first; i != range.second; ++i) {
-        if (i->second != next->second) {
-          continue;
-        }
-        sizes_.erase(i);
-        break;
-      }
-      prev->second->length += b->length + next->second->length;
-      regions_.erase(next);
-      sizes_.insert(sizes_t::value_type(prev->second->length, prev->second));
-      continue;
+      const auto merged = prev->second->length + length +
+                          next->second->length;
+      remove(next);
+      update(prev, prev->first, merged);
+      return;
     }
 
     if (mergePrev) {
-      auto range = sizes_.equal_range(prev->second->length);
-      for (auto i = range.first; i != range.second; ++i) {
-        if (i->second != prev->second) {
-          continue;
-        }
-        sizes_.erase(i);
-        break;
-      }
-      prev->second->length += b->length;
-      sizes_.insert(sizes_t::value_type(prev->second->length, prev->second));
-      continue;
+      update(prev, prev->first, prev->second->length + length);
+      return;
     }
     if (mergeNext) {
-      auto range = sizes_.equal_range(next->second->length);
-      for (auto i = range.first; i != range.second; ++i) {
-        if (i->second != next->second) {
-          continue;
-        }
-        sizes_.erase(i);
-        break;
-      }
-      auto n = next->second;
-      regions_.erase(next);
-      n->lcn = b->lcn;
-      n->length += b->length;
-      regions_.insert(regions_t::value_type(n->lcn, n));
-      sizes_.insert(sizes_t::value_type(n->length, n));
-      continue;
-    }
-
-    if (!info_) {
-      DebugBreak();
-      scan();
+      update(next, lcn, next->second->length + length);
       return;
     }
 
     // Insert a new region.
-    auto item = prev != regions_.end() ? prev->second : std::prev(
-                  regions_.end())->second;
-    auto nr = (winx_volume_region *)winx_list_insert((list_entry **)(
-                void *)&info_, (list_entry *)item, sizeof(winx_volume_region));
-    nr->lcn = b->lcn;
-    nr->length = b->length;
-    regions_.insert(regions_t::value_type(nr->lcn, nr));
-    sizes_.insert(sizes_t::value_type(nr->length, nr));
+    add(lcn, length);
+  });
+}
+
+void GapEnumeration::resync(uint64_t lcn, uint64_t length)
+{
+  auto end = min(lcn + length, bitmap_.clusters());
+  if (lcn >= end) {
+    return;
+  }
+  auto gaps = backend_.gaps(lcn, end - lcn);
+  bitmap_.allocate(lcn, end - lcn);
+  auto regs = List<winx_volume_region>(gaps);
+  for (auto i = regs.begin(), e = regs.end(); i != e; ++i) {
+    const auto from = max(i->lcn, lcn);
+    const auto to = min(i->lcn + i->length, end);
+    if (from < to) {
+      bitmap_.release(from, to - from);
+    }
+  }
+  backend_.releaseGaps(gaps);
+
+  // Drop the gaps touching the free runs the range is part of, then add
+  // those runs as they are now.
+  lcn = bitmap_.runStart(lcn);
+  end = bitmap_.nextUsed(end);
+  auto g = regions_.upper_bound(lcn);
+  if (g != regions_.begin() &&
+      std::prev(g)->second->lcn + std::prev(g)->second->length > lcn) {
+    --g;
+  }
+  while (g != regions_.end() && g->first < end) {
+    lcn = min(lcn, g->first);
+    end = max(end, g->first + g->second->length);
+    remove(g++);
+  }
+  for (auto c = bitmap_.nextFree(lcn); c < end;) {
+    const auto to = min(bitmap_.nextUsed(c), end);
+    add(c, to - c);
+    c = bitmap_.nextFree(to);
   }
 }
 
-FileEnumeration::known_t FileEnumeration::known_;
+void GapEnumeration::resync(const ExtentTable &extents,
+                            const winx_file_info *f)
+{
+  extents.each(f, [this](uint64_t lcn, uint64_t length) {
+    resync(lcn, length);
+  });
+}
 
-void FileEnumeration::order(winx_file_info &f)
+void ExtentTable::add(winx_file_info *f)
 {
-  if (!f.disp.blockmap || f.disp.blockmap == f.disp.blockmap->next) {
-    return;
+  auto s = span(f);
+  if (s) {
+    live_ -= s->count;
+  }
+  else {
+    spans_.push_back(Span());
+    f->user_defined_flags = (unsigned long)spans_.size();
+  }
+  // Lowest lcn first.
+  std::vector<std::pair<uint64_t, uint64_t> > extents;
+  auto bm = List<winx_blockmap>(f->disp.blockmap);
+  for (auto i = bm.begin(), e = bm.end(); i != e; ++i) {
+    extents.push_back(std::make_pair(i->lcn, i->length));
+  }
+  std::sort(extents.begin(), extents.end());
+  const auto offset = lcns_.size();
+  const auto count = extents.size();
+  for (auto i = extents.begin(), e = extents.end(); i != e; ++i) {
+    lcns_.push_back(i->first);
+    lengths_.push_back(i->second);
+  }
+
+  auto &ns = spans_[f->user_defined_flags - 1];
+  ns.offset = offset;
+  ns.count = count;
+  live_ += count;
+  if (lcns_.size() > 2 * live_ + 4096) {
+    compact();
   }
-  auto bm = List<winx_blockmap>(f.disp.blockmap);
-  f.disp.blockmap = &*std::min_element(bm.begin(), bm.end(), minlcn);
 }
 
+void ExtentTable::compact()
+{
+  std::vector<uint64_t> lcns, lengths;
+  lcns.reserve(live_);
+  lengths.reserve(live_);
+  for (auto i = spans_.begin(), e = spans_.end(); i != e; ++i) {
+    const auto offset = lcns.size();
+    lcns.insert(lcns.end(), lcns_.begin() + i->offset,
+                lcns_.begin() + i->offset + i->count);
+    lengths.insert(lengths.end(), lengths_.begin() + i->offset,
+                   lengths_.begin() + i->offset + i->count);
+    i->offset = offset;
+  }
+  lcns_.swap(lcns);
+  lengths_.swap(lengths);
+}
+
+void ExtentTable::keep(const std::vector<winx_file_info *> &files)
+{
+  std::vector<uint64_t> lcns, lengths;
+  std::vector<Span> spans;
+  std::vector<winx_file_info *> missing;
+  lcns.reserve(live_);
+  lengths.reserve(live_);
+  spans.reserve(files.size());
+  for (auto i = files.begin(), e = files.end(); i != e; ++i) {
+    auto s = span(*i);
+    if (!s) {
+      missing.push_back(*i);
+      continue;
+    }
+    Span ns = { lcns.size(), s->count };
+    lcns.insert(lcns.end(), lcns_.begin() + s->offset,
+                lcns_.begin() + s->offset + s->count);
+    lengths.insert(lengths.end(), lengths_.begin() + s->offset,
+                   lengths_.begin() + s->offset + s->count);
+    spans.push_back(ns);
+    (*i)->user_defined_flags = (unsigned long)spans.size();
+  }
+  lcns_.swap(lcns);
+  lengths_.swap(lengths);
+  spans_.swap(spans);
+  live_ = lcns_.size();
+  for (auto i = missing.begin(), e = missing.end(); i != e; ++i) {
+    (*i)->user_defined_flags = 0;
+    add(*i);
+  }
+}
+
+FileEnumeration::known_t FileEnumeration::known_;
+
 void FileEnumeration::scan(ftw_progress_callback cb, void *userdata)
 {
   free();
-  info_ = winx_scan_disk(
-            volume_,
-            WINX_FTW_RECURSIVE | WINX_FTW_SKIP_RESIDENT_STREAMS | WINX_FTW_DUMP_FILES,
-            nullptr,
-            cb,
-            terminator,
-            userdata);
+  ScanContext sc = { maxClusters_, &extents_, cb, userdata };
+  info_ = backend_.files(scanFilter, scanProgress, terminator, &sc);
   if (!info_) {
     if (util::ConsoleHandler::gTerminated) {
       return;
     }
     throw std::exception("Failed to gather volume information");
   }
+  std::vector<pair_t> usable;
   List<winx_file_info> infos(info_);
-  std::for_each(infos.begin(), infos.end(), [this](winx_file_info & f) {
-    winx_freep(&f.name);
+  std::for_each(infos.begin(), infos.end(), [&](winx_file_info & f) {
+    if (f.path && !f.internal.Arena) {
+      // Files without paths still need their names to build them from,
+      // and names of scanned files go with the arena anyway.
+      winx_freep(&f.name);
+    }
+    if (maxClusters_ && f.disp.clusters > maxClusters_) {
+      // Not necessarily filtered by the backend.
+      f.user_defined_flags = 0;
+      return;
+    }
     if (f.disp.fragments > 1) {
       fragmented_++;
     }
     if (!f.disp.blockmap) {
+      f.user_defined_flags = 0;
       unmovable_.push_back(&f);
       unprocessable_++;
       return;
     }
-    if (boost::regex_search(f.path, excluded)) {
+    // Built on the side, so that only the files moved later on keep their
+    // paths. Files without one stay put.
+    auto path = winx_ftw_build_path(&f);
+    const auto exclude = !path || boost::regex_search(path, excluded);
+    winx_freep(&path);
+    if (exclude) {
+      f.user_defined_flags = 0;
       unmovable_.push_back(&f);
       unprocessable_++;
       return;
     }
-    order(f);
-    buckets_.insert(std::make_pair(f.disp.clusters, &f));
+    usable.push_back(std::make_pair(f.disp.clusters, &f));
   });
+
+  // Indexed while scanning, but dropped since or not handed out.
+  files_t handed;
+  handed.reserve(usable.size());
+  for (auto i = usable.begin(), e = usable.end(); i != e; ++i) {
+    handed.push_back(i->second);
+  }
+  extents_.keep(handed);
+
+  // The planner goes by the table from here on. Files get dumped again as
+  // they are moved.
+  if (!backend_.keepsBlockmaps()) {
+    winx_ftw_release_blockmaps(info_);
+  }
+
+  // In key order, each file goes right to the end of the buckets.
+  std::stable_sort(usable.begin(), usable.end(),
+  [](const pair_t & a, const pair_t & b) {
+    return a.first < b.first;
+  });
+  for (auto i = usable.begin(), e = usable.end(); i != e; ++i) {
+    buckets_.insert(buckets_.end(), *i);
+  }
 }
 
 winx_file_info *FileEnumeration::findAt(uint64_t lcn)
 {
   if (lcns_.empty()) {
     for (auto bi = buckets_.begin(), be = buckets_.end(); bi != be; ++bi) {
-      auto bm = zen::List<winx_blockmap>(bi->second->disp.blockmap);
-      std::for_each(
-        bm.begin(),
-        bm.end(),
-      [&](const winx_blockmap & block) {
-        lcns_.insert(std::make_pair(block.lcn, bi->second));
+      extents_.each(bi->second, [&](uint64_t lcn, uint64_t) {
+        lcns_.insert(std::make_pair(lcn, bi->second));
       });
     }
   }
@@ -298,12 +671,8 @@ winx_file_info *FileEnumeration::findAt(uint64_t lcn)
 void FileEnumeration::pop(const winx_file_info *f)
 {
   if (!lcns_.empty()) {
-    auto bm = zen::List<winx_blockmap>(f->disp.blockmap);
-    std::for_each(
-      bm.begin(),
-      bm.end(),
-    [&](const winx_blockmap & i) {
-      lcns_.erase(i.lcn);
+    extents_.each(f, [&](uint64_t lcn, uint64_t) {
+      lcns_.erase(lcn);
     });
   }
   auto range = buckets_.equal_range(f->disp.clusters);
@@ -316,18 +685,21 @@ void FileEnumeration::pop(const winx_file_info *f)
   assert(false);
 }
 
+void FileEnumeration::dumped(winx_file_info *f)
+{
+  extents_.add(f);
+  if (!backend_.keepsBlockmaps()) {
+    winx_ftw_release_blockmap(f);
+  }
+}
+
 void FileEnumeration::push(winx_file_info *f)
 {
   if (!lcns_.empty()) {
-    auto bm = zen::List<winx_blockmap>(f->disp.blockmap);
-    std::for_each(
-      bm.begin(),
-      bm.end(),
-    [this, f](const winx_blockmap & i) {
-      lcns_.insert(std::make_pair(i.lcn, f));
+    extents_.each(f, [this, f](uint64_t lcn, uint64_t) {
+      lcns_.insert(std::make_pair(lcn, f));
     });
   }
-  order(*f);
   buckets_.insert(std::make_pair(f->disp.clusters, f));
 }
 
@@ -337,7 +709,7 @@ FileEnumeration::files_t FileEnumeration::findBest(uint64_t lcn,
   files_t rvs;
 
   auto filter = [&](const winx_file_info * f) -> bool {
-    if (f->disp.blockmap->lcn <= lcn) {
+    if (extents_.lcn(f) <= lcn) {
       return true;
     }
     return false;
@@ -351,7 +723,7 @@ FileEnumeration::files_t FileEnumeration::findBest(uint64_t lcn,
       if (filter(i->second)) {
         continue;
       }
-      if (!perfect || perfect->disp.blockmap->lcn < i->second->disp.blockmap->lcn) {
+      if (!perfect || extents_.lcn(perfect) < extents_.lcn(i->second)) {
         perfect = i->second;
       }
     }
@@ -396,7 +768,7 @@ FileEnumeration::files_t FileEnumeration::findBest(uint64_t lcn,
       }
       auto range = known_.equal_range(i->first);
       for (auto ri = range.first; ri != range.second; ++ri) {
-        if (ri->second->disp.blockmap->lcn >= i->second->disp.blockmap->lcn) {
+        if (extents_.lcn(ri->second) >= extents_.lcn(i->second)) {
           continue;
         }
         known_.erase(ri);
@@ -4,32 +4,19 @@
 
 #pragma once
 
-#include "util.hpp"
+#include "backend.hpp"
 
 #include <shlwapi.h>
 
 #include <cstdint>
+#include <deque>
 #include <map>
+#include <memory>
 #include <vector>
 
 #include <boost/pool/pool_alloc.hpp>
 #include <boost/iterator/iterator_adaptor.hpp>
 
-extern "C" {
-#include "ntndk.h"
-#include "zenwinx.h"
-
-#ifdef I
-#undef I
-#endif
-#ifdef E
-#undef E
-#endif
-#ifdef D
-#undef D
-#endif
-}
-
 namespace zen
 {
 template<typename T>
@@ -51,36 +38,26 @@ public:
 class Volume
 {
 private:
-  WINX_FILE *file_;
+  std::unique_ptr<Backend> backend_;
 
 public:
   winx_volume_information info;
 
-  Volume() : file_(nullptr) {}
-
-  void init(char volume) {
-    file_ = winx_vopen(volume);
-    if (!file_) {
-      throw std::exception("Failed to open volume");
-    }
-    if (winx_get_volume_information(volume, &info) < 0) {
-      throw std::exception("Failed to query volume");
-    }
+  Volume() {
+    memset(&info, 0, sizeof(info));
   }
 
-  ~Volume() {
-    if (file_) {
-      winx_fclose(file_);
-      file_ = nullptr;
-    }
+  void init(char volume) {
+    init(std::unique_ptr<Backend>(new WinxBackend(volume)));
   }
 
-  HANDLE handle() {
-    return file_->hFile;
+  void init(std::unique_ptr<Backend> backend) {
+    backend_ = std::move(backend);
+    info = backend_->info;
   }
 
-  operator HANDLE() {
-    return file_->hFile;
+  Backend &backend() {
+    return *backend_;
   }
 
   std::wstring operator()(uint64_t clusters) const {
@@ -89,29 +66,6 @@ public:
   }
 };
 
-namespace
-{
-struct file_close {
-  void operator()(HANDLE h) {
-    winx_defrag_fclose(h);
-  }
-};
-} // namespace
-
-typedef std::unique_ptr <void, file_close> File;
-
-File openFile(const winx_file_info *file)
-{
-  HANDLE rv = nullptr;
-  if (winx_defrag_fopen(const_cast<winx_file_info *>(file), WINX_OPEN_FOR_MOVE,
-                        &rv)) {
-    std::string ex("Failed to open file: ");
-    ex.append(util::to_string(file->path));
-    throw std::exception(ex.c_str());
-  }
-  return File(rv);
-}
-
 template<typename T>
 class List
 {
@@ -169,57 +123,238 @@ public:
   }
 };
 
+// The allocation bitmap of a volume, kept in memory: One bit per cluster,
+// set == in use, plus the number of clusters in use per block of 4096
+// clusters, so that counting (rank) and searching (select) skip blocks
+// that are all free or all in use.
+class ClusterBitmap
+{
+private:
+  static const uint64_t blockClusters = 4096;
+  static const size_t blockWords = (size_t)(blockClusters / 64);
+
+  std::vector<uint64_t> words_;
+  std::vector<uint32_t> used_; // Per block.
+  uint64_t clusters_;
+
+  void set(uint64_t lcn, uint64_t length, bool inUse);
+  uint64_t find(uint64_t lcn, bool inUse) const;
+
+public:
+  ClusterBitmap() : clusters_(0) {}
+
+  // Everything but |gaps| is in use.
+  void reset(uint64_t clusters, winx_volume_region *gaps);
+
+  void allocate(uint64_t lcn, uint64_t length) {
+    set(lcn, length, true);
+  }
+  void release(uint64_t lcn, uint64_t length) {
+    set(lcn, length, false);
+  }
+
+  uint64_t clusters() const {
+    return clusters_;
+  }
+  // Clusters in use within [lcn, end).
+  uint64_t used(uint64_t lcn, uint64_t end) const;
+  // The first free cluster at or behind |lcn|, clusters() if there is none.
+  uint64_t nextFree(uint64_t lcn) const {
+    return find(lcn, false);
+  }
+  // The first cluster in use at or behind |lcn|, clusters() if there is none.
+  uint64_t nextUsed(uint64_t lcn) const {
+    return find(lcn, true);
+  }
+  // The first cluster of the free run |lcn| is part of, |lcn| if in use.
+  uint64_t runStart(uint64_t lcn) const;
+
+  // Free regions, release with winx_release_free_volume_regions().
+  winx_volume_region *regions() const {
+    return winx_bitmap_to_regions((const unsigned char *)words_.data(), 0,
+                                  clusters_, nullptr, nullptr);
+  }
+};
+
+// Gaps by size: One intrusive list per distinct size, oldest first, so that
+// adding and removing a gap never looks at the other gaps of its size.
+class GapIndex
+{
+public:
+  struct Gap;
+
+private:
+  struct Class {
+    Gap *head;
+    Gap *tail;       // Gaps are appended, so the oldest comes first.
+    uint64_t maxLcn; // Upper bound of the lcns in the list, never lowered.
+
+    Class() : head(nullptr), tail(nullptr), maxLcn(0) {}
+  };
+  typedef std::pair<const uint64_t, Class> pair_t;
+  typedef boost::fast_pool_allocator
+  < pair_t, boost::default_user_allocator_new_delete, boost::details::pool::null_mutex, 1024 >
+  alloc_t;
+  typedef std::map<uint64_t, Class, std::less<uint64_t>, alloc_t> classes_t;
+
+  classes_t classes_;
+
+  const Gap *pick(const Class &c, const winx_volume_region *not,
+                  bool behindOnly) const;
+
+public:
+  // A gap, linked into the list of its size.
+  struct Gap : public winx_volume_region {
+    Gap *sizeNext;
+    Gap *sizePrev;
+    classes_t::iterator sizeClass;
+  };
+
+  void clear() {
+    classes_.clear();
+  }
+
+  // Gaps must not change their length while indexed.
+  void insert(Gap *g);
+  void erase(Gap *g);
+
+  // A gap of exactly |clusters|, or one considerably larger, so that the
+  // rest is not just another small gap, or the largest one large enough.
+  // Never |not|, and with |behindOnly| only gaps behind it; the oldest gap
+  // of a size wins. Sizes are found in O(log sizes), but gaps |not| rules
+  // out are still skipped one by one, unless a whole size lies before it.
+  const Gap *best(uint64_t clusters, const winx_volume_region *not,
+                  bool behindOnly) const;
+
+  const Gap *largest() const {
+    return classes_.empty() ? nullptr : classes_.rbegin()->second.tail;
+  }
+};
+
+// Extents of the files the planner works with, packed into one table
+// instead of the circular block lists: Each file refers to a contiguous span
+// of lcns and lengths, lowest lcn first, by the slot kept in its
+// user_defined_flags. Files dumped again get a new span; the table is
+// compacted once most of it is stale.
+class ExtentTable
+{
+private:
+  struct Span {
+    size_t offset;
+    size_t count;
+  };
+
+  std::vector<uint64_t> lcns_;
+  std::vector<uint64_t> lengths_;
+  std::vector<Span> spans_;
+  size_t live_;
+
+  const Span *span(const winx_file_info *f) const {
+    const auto slot = (size_t)f->user_defined_flags;
+    return slot && slot <= spans_.size() ? &spans_[slot - 1] : nullptr;
+  }
+
+  void compact();
+
+public:
+  ExtentTable() : live_(0) {}
+
+  void clear() {
+    lcns_.clear();
+    lengths_.clear();
+    spans_.clear();
+    live_ = 0;
+  }
+
+  // (Re)reads the extents of |f| from its block map.
+  void add(winx_file_info *f);
+
+  // Drops the extents of all files but |files|, adding those not read yet.
+  void keep(const std::vector<winx_file_info *> &files);
+
+  bool contains(const winx_file_info *f) const {
+    return span(f) != nullptr;
+  }
+
+  // The lowest lcn of |f|, 0 if it has no extents.
+  uint64_t lcn(const winx_file_info *f) const {
+    auto s = span(f);
+    return s && s->count ? lcns_[s->offset] : 0;
+  }
+
+  // Calls |fn(lcn, length)| for each extent of |f|.
+  template<typename Fn>
+  void each(const winx_file_info *f, Fn fn) const {
+    auto s = span(f);
+    if (!s) {
+      return;
+    }
+    for (auto i = s->offset, e = s->offset + s->count; i != e; ++i) {
+      fn(lcns_[i], lengths_[i]);
+    }
+  }
+};
+
 class GapEnumeration
 {
 private:
-  typedef std::pair<uint64_t, winx_volume_region *> pair_t;
+  typedef GapIndex::Gap Gap;
+  typedef std::pair<uint64_t, Gap *> pair_t;
   typedef boost::fast_pool_allocator
   < pair_t, boost::default_user_allocator_new_delete, boost::details::pool::null_mutex, 1024 >
   alloc_t;
-  typedef std::map<uint64_t, winx_volume_region *, std::less<uint64_t>, alloc_t>
+  typedef std::map<uint64_t, Gap *, std::less<uint64_t>, alloc_t>
   regions_t;
-  typedef std::multimap<uint64_t, winx_volume_region *, std::less<uint64_t>, alloc_t>
-  sizes_t;
 
-  winx_volume_region *info_;
+  std::deque<Gap> store_;
+  Gap *spare_; // Gaps of the store no longer in use, by sizeNext.
   regions_t regions_;
-  sizes_t sizes_;
-  const char volume_;
+  GapIndex sizes_;
+  ClusterBitmap bitmap_;
+  Backend &backend_;
+
+  void fill(winx_volume_region *gaps);
+  void add(uint64_t lcn, uint64_t length);
+  void update(regions_t::iterator g, uint64_t lcn, uint64_t length);
+  void remove(regions_t::iterator g);
 
   void free() {
-    if (info_) {
-      winx_release_free_volume_regions(info_);
-      info_ = nullptr;
-    }
     regions_.clear();
     sizes_.clear();
+    store_.clear();
+    spare_ = nullptr;
   }
 
 public:
   typedef const regions_t::value_type value_type;
   typedef regions_t::const_iterator const_iterator;
-  typedef sizes_t::const_reverse_iterator size_iterator;
 
-  GapEnumeration(char volume)
-    : info_(nullptr), volume_(volume) {
+  GapEnumeration(Backend &backend)
+    : spare_(nullptr), backend_(backend) {
     scan();
   }
-  ~GapEnumeration() {
-    free();
-  }
-
-  void filter();
 
+  // Reads the gaps and the bitmap from the volume.
   void scan() {
-    free();
-    info_ = winx_get_free_volume_regions(
-              volume_,
-              0,
-              nullptr,
-              this);
-    filter();
+    auto gaps = backend_.gaps();
+    bitmap_.reset(backend_.info.total_clusters, gaps);
+    fill(gaps);
+    backend_.releaseGaps(gaps);
+  }
+
+  // Builds the gaps from the bitmap again, bringing back those popped,
+  // without going to the volume.
+  void rebuild() {
+    auto gaps = bitmap_.regions();
+    fill(gaps);
+    winx_release_free_volume_regions(gaps);
   }
 
+  // Reads |length| clusters at |lcn| from the volume again, for when moves
+  // went wrong, and fixes up the gaps around them.
+  void resync(uint64_t lcn, uint64_t length);
+  void resync(const ExtentTable &extents, const winx_file_info *f);
+
   const winx_volume_region *next() const {
     if (regions_.empty()) {
       return nullptr;
@@ -227,18 +362,43 @@ public:
     return regions_.begin()->second;
   }
 
+  // The gap starting at |lcn|, if any.
+  const winx_volume_region *find(uint64_t lcn) const {
+    auto g = regions_.find(lcn);
+    return g != regions_.end() ? g->second : nullptr;
+  }
+
   const winx_volume_region *best(
     uint64_t clusters,
     const winx_volume_region *not = nullptr,
-    bool behindOnly = false) const;
+    bool behindOnly = false) const {
+    return sizes_.best(clusters, not, behindOnly);
+  }
 
+  // Regions popped are merely done with, while files popped and pushed
+  // take and give back their clusters in the bitmap as well, going by
+  // their extents in the table.
   void pop(const winx_volume_region *r) {
     pop(r->lcn, r->length);
   }
   void pop(const uint64_t lcn, const uint64_t length);
-  void pop(const winx_file_info *f);
+  void pop(const ExtentTable &extents, const winx_file_info *f);
 
-  void push(const winx_file_info *f);
+  void push(const ExtentTable &extents, const winx_file_info *f);
+
+  // Free clusters within [lcn, end).
+  uint64_t freeClusters(uint64_t lcn, uint64_t end) const {
+    end = min(end, bitmap_.clusters());
+    return lcn < end ? end - lcn - bitmap_.used(lcn, end) : 0;
+  }
+  // The first free cluster at or behind |lcn|, i.e. where the next free run
+  // starts.
+  uint64_t nextFree(uint64_t lcn) const {
+    return bitmap_.nextFree(lcn);
+  }
+  const ClusterBitmap &bitmap() const {
+    return bitmap_;
+  }
 
   const_iterator begin() const {
     return regions_.begin();
@@ -251,11 +411,8 @@ public:
     return regions_.size();
   }
 
-  size_iterator sbegin() const {
-    return sizes_.rbegin();
-  }
-  size_iterator send() const {
-    return sizes_.rend();
+  const winx_volume_region *largest() const {
+    return sizes_.largest();
   }
 };
 
@@ -286,28 +443,29 @@ private:
 
   static known_t known_;
 
-  const char volume_;
+  Backend &backend_;
   buckets_t buckets_;
   lcns_t lcns_;
+  ExtentTable extents_;
   files_t unmovable_;
   winx_file_info *info_;
+  uint64_t maxClusters_;
   uint64_t fragmented_;
   uint64_t unprocessable_;
 
-  void order(winx_file_info &f);
-
   void scan(ftw_progress_callback cb, void *userdata);
 
   void free() {
     if (info_) {
 #ifndef NO_PATCH
-      winx_scan_disk_release(info_);
+      backend_.releaseFiles(info_);
 #endif
       info_ = nullptr;
     }
 
     buckets_.clear();
     lcns_.clear();
+    extents_.clear();
     unmovable_.clear();
   }
 
@@ -315,9 +473,12 @@ public:
   typedef const buckets_t::value_type value_type;
   typedef buckets_t::iterator iterator;
 
-  FileEnumeration(char volume, ftw_progress_callback cb = nullptr,
-                  void *ud = nullptr)
-    : volume_(volume), info_(nullptr), fragmented_(0), unprocessable_(0) {
+  // Files larger than |maxClusters| are of no use to the run and left out,
+  // 0 if there is no such limit.
+  FileEnumeration(Backend &backend, ftw_progress_callback cb = nullptr,
+                  void *ud = nullptr, uint64_t maxClusters = 0)
+    : backend_(backend), info_(nullptr), maxClusters_(maxClusters),
+      fragmented_(0), unprocessable_(0) {
     scan(cb, ud);
   }
   ~FileEnumeration() {
@@ -334,6 +495,25 @@ public:
 
   winx_file_info *findAt(uint64_t lcn);
 
+  // The lowest lcn of a file handed out.
+  uint64_t lcn(const winx_file_info *f) const {
+    return extents_.lcn(f);
+  }
+  // Calls |fn(lcn, length)| for each extent of a file as it was handed out.
+  template<typename Fn>
+  void extents(const winx_file_info *f, Fn fn) const {
+    extents_.each(f, fn);
+  }
+  // The extents of the files handed out. Block maps are released once
+  // indexed, unless the backend needs them.
+  const ExtentTable &table() const {
+    return extents_;
+  }
+
+  // Indexes |f| again, dumped since it was popped, then releases its block
+  // map.
+  void dumped(winx_file_info *f);
+
   void pop(const winx_file_info *f);
 
   void push(winx_file_info *f);
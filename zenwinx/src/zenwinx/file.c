@@ -573,7 +573,8 @@ NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle)
     if(f == NULL || phandle == NULL)
         return STATUS_INVALID_PARAMETER;
     
-    if(f->path == NULL)
+    /* paths may be built on demand */
+    if(winx_ftw_get_path(f) == NULL)
         return STATUS_INVALID_PARAMETER;
     
     if(f->path[0] == 0)
@@ -663,4 +664,85 @@ void winx_defrag_fclose(HANDLE h)
     NtCloseSafe(h);
 }
 
+/**
+ * @internal
+ * @brief FILE_NAME_INFORMATION,
+ * large enough for the longest path.
+ */
+typedef struct _file_name_information {
+    ULONG FileNameLength;
+    wchar_t FileName[32767];
+} file_name_information;
+
+/**
+ * @brief Retrieves the path of
+ * a file by its file reference number.
+ * @param[in] f the volume handle,
+ * as returned by winx_vopen.
+ * @param[in] volume_letter the volume letter.
+ * @param[in] id the file reference number,
+ * either with the sequence number or without.
+ * @return The native path of the file,
+ * e.g. \??\C:\dir\file, to be released by
+ * winx_free. NULL indicates failure, e.g.
+ * if the file does not exist anymore.
+ * @note Files having hard links get
+ * any of their paths returned.
+ */
+wchar_t *winx_get_path_by_id(WINX_FILE *f,char volume_letter,ULONGLONG id)
+{
+    UNICODE_STRING us;
+    OBJECT_ATTRIBUTES oa;
+    IO_STATUS_BLOCK iosb;
+    NTSTATUS status;
+    HANDLE hFile;
+    file_name_information *fni;
+    wchar_t *path;
+    size_t length;
+
+    DbgCheck1(f,NULL);
+
+    us.Buffer = (wchar_t *)&id;
+    us.Length = us.MaximumLength = sizeof(ULONGLONG);
+    InitializeObjectAttributes(&oa,&us,0,f->hFile,NULL);
+    status = NtCreateFile(&hFile,FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+                &oa,&iosb,NULL,0,
+                FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                FILE_OPEN,FILE_OPEN_BY_FILE_ID | FILE_OPEN_FOR_BACKUP_INTENT |
+                FILE_OPEN_REPARSE_POINT | FILE_SYNCHRONOUS_IO_NONALERT,NULL,0);
+    if(status != STATUS_SUCCESS){
+        strace(status,"cannot open file %I64u",id);
+        return NULL;
+    }
+
+    fni = winx_tmalloc(sizeof(file_name_information));
+    if(fni == NULL){
+        mtrace();
+        NtClose(hFile);
+        return NULL;
+    }
+    status = NtQueryInformationFile(hFile,&iosb,fni,
+        sizeof(file_name_information),FileNameInformation);
+    NtClose(hFile);
+    if(status != STATUS_SUCCESS){
+        strace(status,"cannot get path of file %I64u",id);
+        winx_free(fni);
+        return NULL;
+    }
+
+    /* the path is relative to the root of the volume */
+    length = fni->FileNameLength / sizeof(wchar_t);
+    path = winx_tmalloc((length + 7) * sizeof(wchar_t));
+    if(path == NULL){
+        mtrace();
+    } else {
+        wcscpy(path,L"\\??\\A:");
+        path[4] = winx_toupper(volume_letter);
+        memcpy(path + 6,fni->FileName,length * sizeof(wchar_t));
+        path[6 + length] = 0;
+    }
+    winx_free(fni);
+    return path;
+}
+
 /** @} */
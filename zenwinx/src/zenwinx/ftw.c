@@ -49,10 +49,19 @@
  */
 #define LLINVALID ((ULONGLONG) -1)
 
+/**
+ * @internal
+ * @brief Maximum length of a path, in characters.
+ */
+#define MAX_LONG_PATH 32767
+
 /* external functions prototypes */
 winx_file_info *ntfs_scan_disk(char volume_letter,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
     ftw_terminator t, void *user_defined_data);
+winx_file_info *ntfs_scan_image(wchar_t *path,char volume_letter,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
+    ftw_terminator t, void *user_defined_data);
 
 /**
  * @internal
@@ -97,13 +106,13 @@ void validate_blockmap(winx_file_info *f)
     if(b1) b2 = b1->next;
     if(b1 && b2 && b2 != b1){
         if(b1->vcn == b2->vcn){
-            etrace("%ws: wrong map detected:", f->path);
+            etrace("%ws: wrong map detected:", f->path ? f->path : f->name);
             for(b1 = f->disp.blockmap; b1; b1 = b1->next){
                 etrace("VCN = %I64u, LCN = %I64u, LEN = %I64u",
                     b1->vcn, b1->lcn, b1->length);
                 if(b1->next == f->disp.blockmap) break;
             }
-            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+            winx_ftw_release_blockmap(f);
         }
     }
 #endif
@@ -148,12 +157,12 @@ int winx_ftw_dump_file(winx_file_info *f,
     /* reset disposition related fields */
     f->disp.clusters = 0;
     f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+    winx_ftw_release_blockmap(f);
     
     /* open the file */
     status = winx_defrag_fopen(f,WINX_OPEN_FOR_DUMP,&hFile);
     if(status != STATUS_SUCCESS){
-        strace(status,"cannot open %ws",f->path);
+        strace(status,"cannot open %ws",f->path ? f->path : f->name);
         return 0; /* file is locked by system */
     }
     
@@ -207,8 +216,7 @@ int winx_ftw_dump_file(winx_file_info *f,
                 goto dump_failed;
             }
             
-            block = (winx_blockmap *)winx_list_insert((list_entry **)&f->disp.blockmap,
-                (list_entry *)block,sizeof(winx_blockmap));
+            block = winx_ftw_add_block(f,block);
             block->lcn = filemap->Pair[i].Lcn;
             block->length = filemap->Pair[i].Vcn - startVcn;
             block->vcn = startVcn;
@@ -240,7 +248,7 @@ cleanup:
 empty_map_detected:
     f->disp.clusters = 0;
     f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+    winx_ftw_release_blockmap(f);
     winx_free(filemap);
     winx_defrag_fclose(hFile);
     return 0;
@@ -248,7 +256,7 @@ empty_map_detected:
 dump_failed:
     f->disp.clusters = 0;
     f->disp.fragments = 0;
-    winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+    winx_ftw_release_blockmap(f);
     winx_free(filemap);
     winx_defrag_fclose(hFile);
     return (-1);
@@ -592,53 +600,125 @@ static int ftw_helper(wchar_t *path, int flags,
 
 /**
  * @internal
- * @brief Removes resident streams from the file list.
+ * @brief Checks whether a stream
+ * is resident or not.
  */
-static void ftw_remove_resident_streams(winx_file_info **filelist)
+static int ftw_is_resident_stream(winx_file_info *f)
 {
-    winx_file_info *f, *head, *next = NULL;
+    return (f->disp.fragments == 0);
+}
 
-    for(f = *filelist; f; f = next){
-        head = *filelist;
-        next = f->next;
-        if(f->disp.fragments == 0){
-            winx_free(f->name);
-            winx_free(f->path);
-            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-            winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+/**
+ * @internal
+ * @brief Checks whether a stream
+ * is invalid or not.
+ * @note Streams scanned with
+ * WINX_FTW_LAZY_PATHS flag have
+ * no paths, but names to build
+ * them from.
+ */
+static int ftw_is_invalid_stream(winx_file_info *f)
+{
+    if(f->path == NULL)
+        return (f->name == NULL);
+    return (f->path[0] == 0);
+}
+
+/**
+ * @internal
+ * @brief Builds paths of files which
+ * are about to lose their parent directories.
+ * @details Files scanned with WINX_FTW_LAZY_PATHS
+ * flag refer to their parent directories to
+ * build paths from, so files whose parents get
+ * removed from the list need their paths now.
+ * Files whose paths cannot be built lose their
+ * names to get removed as invalid streams.
+ * @return Number of files which lost
+ * their names.
+ */
+static int ftw_build_orphaned_paths(winx_file_info *filelist,
+    int (*removed)(winx_file_info *f))
+{
+    winx_file_info *f, *parent;
+    int failures = 0;
+    
+    for(f = filelist; f; f = f->next){
+        parent = f->internal.ParentDirectory;
+        if(parent && f->path == NULL && f->name && !removed(f) && removed(parent)){
+            if(winx_ftw_get_path(f) == NULL){
+                if(f->internal.Arena == NULL)
+                    winx_free(f->name);
+                f->name = NULL;
+                failures ++;
+            }
         }
-        if(*filelist == NULL) break;
-        if(next == head) break;
+        if(f->next == filelist) break;
     }
+    return failures;
 }
 
 /**
  * @internal
- * @brief Removes invalid streams from the file list.
+ * @brief Removes streams from the file list.
+ * @param[in,out] filelist pointer to the file list.
+ * @param[in] removed the routine deciding
+ * whether a stream has to be removed.
  */
-static void ftw_remove_invalid_streams(winx_file_info **filelist)
+static void ftw_remove_streams(winx_file_info **filelist,
+    int (*removed)(winx_file_info *f))
 {
     winx_file_info *f, *head, *next = NULL;
-    int invalid_entry;
+    winx_arena *arena = NULL, *block_arena = NULL;
+    
+    /* files must not lose their parents before they get paths */
+    while(ftw_build_orphaned_paths(*filelist,removed) > 0) {}
 
     for(f = *filelist; f; f = next){
         head = *filelist;
         next = f->next;
-        invalid_entry = 0;
-        if(f->path == NULL){
-            invalid_entry = 1;
-        } else if(f->path[0] == 0){
-            invalid_entry = 1;
-        }
-        if(invalid_entry){
-            winx_free(f->name);
-            winx_free(f->path);
-            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
-            winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+        if(removed(f)){
+            if(f->internal.Arena){
+                /* released along with the arena */
+                arena = f->internal.Arena;
+                if(f->internal.BlockArena)
+                    block_arena = f->internal.BlockArena;
+                winx_ftw_release_blockmap(f);
+                winx_list_detach((list_entry **)(void *)filelist,(list_entry *)f);
+            } else {
+                winx_free(f->name);
+                winx_free(f->path);
+                winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+                winx_list_remove((list_entry **)(void *)filelist,(list_entry *)f);
+            }
         }
         if(*filelist == NULL) break;
         if(next == head) break;
     }
+    
+    /* nothing refers to the arenas any more */
+    if(*filelist == NULL){
+        winx_arena_destroy(block_arena);
+        winx_arena_destroy(arena);
+    }
+}
+
+/**
+ * @internal
+ * @brief Removes resident streams from the file list.
+ */
+static void ftw_remove_resident_streams(winx_file_info **filelist)
+{
+    ftw_remove_streams(filelist,ftw_is_resident_stream);
+}
+
+/**
+ * @internal
+ * @brief Removes invalid streams from the file list.
+ */
+static void ftw_remove_invalid_streams(winx_file_info **filelist)
+{
+    ftw_remove_streams(filelist,ftw_is_invalid_stream);
 }
 
 /**
@@ -765,6 +845,9 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
  * Windows file cache makes access even faster.
  * UDF has been never tested in direct mode
  * because of its highly complicated standard.
+ * On NTFS the filter callback decides which
+ * streams get into the list instead, see
+ * ntfs_scan_disk for details.
  */
 winx_file_info *winx_scan_disk(char volume_letter, int flags,
         ftw_filter_callback fcb, ftw_progress_callback pcb, ftw_terminator t,
@@ -829,16 +912,285 @@ done:
     return filelist;
 }
 
+/**
+ * @brief winx_scan_disk analog, but reading
+ * an NTFS volume or an image of it directly,
+ * without help of the file system driver.
+ * @param[in] path the native path of the image
+ * file or of the device to be read.
+ * @param[in] volume_letter the volume letter
+ * to be used in paths of the files found.
+ * @note
+ * - The rest of parameters and the returned
+ *   list are the same as for winx_scan_disk.
+ * - The volume should not be mounted, otherwise
+ *   the records may change while they are read.
+ */
+winx_file_info *winx_scan_image(wchar_t *path, char volume_letter,
+        int flags, ftw_filter_callback fcb, ftw_progress_callback pcb,
+        ftw_terminator t, void *user_defined_data)
+{
+    winx_file_info *filelist = NULL;
+    ULONGLONG time;
+    
+    DbgCheck1(path,NULL);
+    
+    volume_letter = winx_toupper(volume_letter);
+    
+    time = winx_xtime();
+    winx_dbg_print_header(0,0,I"winx_scan_image started");
+    
+    if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS){
+        if(!(flags & WINX_FTW_DUMP_FILES)){
+            etrace("WINX_FTW_DUMP_FILES flag must be set"
+                " to accept WINX_FTW_SKIP_RESIDENT_STREAMS");
+            flags &= ~WINX_FTW_SKIP_RESIDENT_STREAMS;
+        }
+    }
+    
+    filelist = ntfs_scan_image(path,volume_letter,flags,fcb,pcb,t,user_defined_data);
+    
+    if(flags & WINX_FTW_SKIP_RESIDENT_STREAMS)
+        ftw_remove_resident_streams(&filelist);
+    /* get rid of invalid entries */
+    ftw_remove_invalid_streams(&filelist);
+    
+    winx_dbg_print_header(0,0,I"winx_scan_image completed in %I64u ms",
+        winx_xtime() - time);
+    return filelist;
+}
+
+/**
+ * @internal
+ * @brief Joins the path of the parent
+ * directory of a file and its name.
+ * @param[in] arena the arena to allocate
+ * the path from, NULL for the heap.
+ * @note The parent directory must
+ * have its path built already.
+ */
+static wchar_t *ftw_join_path(winx_file_info *f,winx_arena *arena)
+{
+    wchar_t root[] = L"\\??\\A:\\";
+    wchar_t *parent_path, *path;
+    int parent_length, name_length;
+    
+    if(f->internal.ParentDirectory){
+        parent_path = f->internal.ParentDirectory->path;
+    } else {
+        root[4] = (wchar_t)f->internal.VolumeLetter;
+        parent_path = root;
+    }
+    parent_length = (int)wcslen(parent_path);
+    name_length = (int)wcslen(f->name);
+    
+    if(arena)
+        path = winx_arena_alloc(arena,(parent_length + name_length + 2) * sizeof(wchar_t),0);
+    else
+        path = winx_tmalloc((parent_length + name_length + 2) * sizeof(wchar_t));
+    if(path == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            (parent_length + name_length + 2) * sizeof(wchar_t));
+        return NULL;
+    }
+    
+    /* the root path ends with a separator already */
+    memcpy(path,parent_path,parent_length * sizeof(wchar_t));
+    if(parent_path != root)
+        path[parent_length++] = '\\';
+    memcpy(path + parent_length,f->name,(name_length + 1) * sizeof(wchar_t));
+    return path;
+}
+
+/**
+ * @internal
+ * @brief Builds the full path of a file,
+ * building and keeping the paths of its
+ * parent directories first, if needed.
+ * @param[in] arena the arena to allocate
+ * the path from, NULL for the heap.
+ */
+static wchar_t *ftw_build_path(winx_file_info *f,winx_arena *arena)
+{
+    winx_file_info **dirs, *parent;
+    int depth = 0, i;
+    
+    if(f->name == NULL)
+        return NULL;
+    
+    /* count parent directories having no path yet */
+    for(parent = f->internal.ParentDirectory; parent && !parent->path;
+      parent = parent->internal.ParentDirectory){
+        /* each level takes two characters of a path at least */
+        if(++depth > MAX_LONG_PATH / 2){
+            etrace("%ws: parent directories form a loop",f->name);
+            return NULL;
+        }
+    }
+    
+    if(depth){
+        dirs = winx_tmalloc(depth * sizeof(winx_file_info *));
+        if(dirs == NULL){
+            etrace("cannot allocate %u bytes of memory",
+                depth * sizeof(winx_file_info *));
+            return NULL;
+        }
+        i = depth;
+        for(parent = f->internal.ParentDirectory; i > 0;
+          parent = parent->internal.ParentDirectory)
+            dirs[--i] = parent;
+        
+        /* build the paths from the topmost directory down */
+        for(i = 0; i < depth; i++){
+            if(dirs[i]->name == NULL)
+                break;
+            dirs[i]->path = ftw_join_path(dirs[i],dirs[i]->internal.Arena);
+            if(dirs[i]->path == NULL)
+                break;
+        }
+        winx_free(dirs);
+        if(i < depth)
+            return NULL;
+    }
+    
+    return ftw_join_path(f,arena);
+}
+
+/**
+ * @brief Builds the full path of a file.
+ * @details Files scanned with WINX_FTW_LAZY_PATHS
+ * flag have no paths, but refer to their parent
+ * directories instead. Paths of the parent
+ * directories are built by this routine as well,
+ * if missing, and kept, so that each directory
+ * path is built once.
+ * @param[in] f pointer to the file.
+ * @return The path, to be released by winx_free,
+ * NULL if it cannot be built.
+ */
+wchar_t *winx_ftw_build_path(winx_file_info *f)
+{
+    DbgCheck1(f,NULL);
+    
+    if(f->path)
+        return winx_wcsdup(f->path);
+    return ftw_build_path(f,NULL);
+}
+
+/**
+ * @brief Returns the full path of a file,
+ * building it first if needed.
+ * @details Unlike winx_ftw_build_path
+ * this routine keeps the path built,
+ * until the file list gets released.
+ * @param[in] f pointer to the file.
+ * @return The path, NULL if it
+ * cannot be built.
+ */
+wchar_t *winx_ftw_get_path(winx_file_info *f)
+{
+    DbgCheck1(f,NULL);
+    
+    if(f->path == NULL)
+        f->path = ftw_build_path(f,f->internal.Arena);
+    return f->path;
+}
+
+/**
+ * @brief Adds a block to the map of file blocks.
+ * @details Blocks of files scanned to an arena
+ * are allocated from the arena of their blocks,
+ * until winx_ftw_release_blockmaps releases it.
+ * @param[in] f pointer to the file.
+ * @param[in] prev the block preceding the new
+ * one, NULL to insert the new one in front.
+ * @return Pointer to the new block. In case of
+ * allocation failure this routine calls the killer
+ * registered by winx_set_killer and returns NULL then.
+ */
+winx_blockmap *winx_ftw_add_block(winx_file_info *f,winx_blockmap *prev)
+{
+    winx_blockmap *block;
+    
+    if(f->internal.BlockArena == NULL){
+        return (winx_blockmap *)winx_list_insert((list_entry **)(void *)&f->disp.blockmap,
+            (list_entry *)prev,sizeof(winx_blockmap));
+    }
+    
+    block = winx_arena_alloc(f->internal.BlockArena,sizeof(winx_blockmap),MALLOC_ABORT_ON_FAILURE);
+    if(block)
+        winx_list_attach((list_entry **)(void *)&f->disp.blockmap,(list_entry *)prev,(list_entry *)block);
+    return block;
+}
+
+/**
+ * @brief Releases the map of file blocks.
+ * @details Blocks allocated from an arena
+ * remain there until the arena gets destroyed.
+ */
+void winx_ftw_release_blockmap(winx_file_info *f)
+{
+    if(f->internal.BlockArena)
+        f->disp.blockmap = NULL;
+    else
+        winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+}
+
+/**
+ * @brief Releases the maps of blocks
+ * of all the files of the list at once.
+ * @details Intended for callers keeping
+ * the extents elsewhere once the files
+ * are scanned. Files scanned to an arena
+ * lose the arena of their blocks, blocks
+ * added later on come from the heap.
+ * @param[in] filelist pointer
+ * to list of files.
+ */
+void winx_ftw_release_blockmaps(winx_file_info *filelist)
+{
+    winx_file_info *f;
+    winx_arena *arena = NULL;
+    
+    for(f = filelist; f != NULL; f = f->next){
+        if(f->internal.BlockArena){
+            arena = f->internal.BlockArena;
+            f->internal.BlockArena = NULL;
+            f->disp.blockmap = NULL;
+        } else {
+            winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+        }
+        if(f->next == filelist) break;
+    }
+    winx_arena_destroy(arena);
+}
+
 /**
  * @brief Releases resources
  * allocated by winx_ftw
  * or winx_scan_disk.
+ * @details Files scanned to an arena
+ * are released along with the arena,
+ * all at once.
  * @param[in] filelist pointer
  * to list of files.
  */
 void winx_ftw_release(winx_file_info *filelist)
 {
     winx_file_info *f;
+    
+    if(filelist && filelist->internal.Arena){
+        /* blocks added after the arena of blocks was released */
+        if(filelist->internal.BlockArena == NULL){
+            for(f = filelist; f != NULL; f = f->next){
+                winx_list_destroy((list_entry **)(void *)&f->disp.blockmap);
+                if(f->next == filelist) break;
+            }
+        }
+        winx_arena_destroy(filelist->internal.BlockArena);
+        winx_arena_destroy(filelist->internal.Arena);
+        return;
+    }
 
     /* walk through list of files and free allocated memory */
     for(f = filelist; f != NULL; f = f->next){
@@ -54,11 +54,6 @@ typedef struct _mft_layout {
     ULONG sector_size;                      /* sector size, in bytes */
 } mft_layout;
 
-enum {
-    MFT_SCAN_RTL,
-    MFT_SCAN_LTR,
-};
-
 typedef struct {
     ULONGLONG BaseMftId;             /* base mft index */
     ULONGLONG ParentDirectoryMftId;  /* mft index of parent directory */
@@ -70,8 +65,13 @@ typedef struct {
     ULONGLONG LastAccessTime;        /* The time when the file was last accessed in the standard time format. */
 } my_file_information;
 
+/* slot of the stream index, in use if it refers to the file being analyzed */
+typedef struct _stream_slot {
+    ULONGLONG file;             /* number of the file the stream belongs to */
+    winx_file_info *f;          /* the stream */
+} stream_slot;
+
 typedef struct _mft_scan_parameters {
-    int mft_scan_direction;     /* scan direction, right to left in current algorithm */
     mft_layout ml;              /* mft layout structure */
     char volume_letter;         /* volume letter */
     WINX_FILE *f_volume;        /* volume handle */
@@ -84,13 +84,52 @@ typedef struct _mft_scan_parameters {
     unsigned long processed_attr_list_entries; /* just for debugging purposes */
     unsigned long errors;       /* number of critical errors preventing gathering complete information */
     winx_file_info **filelist;  /* list of files */
+    int raw;                    /* nonzero if mft records are read directly, without NTFS driver */
+    wchar_t *path;              /* native path of the volume or of the image */
+    winx_blockmap *mft_runs;    /* map of $Mft blocks, needed for direct reads */
+    unsigned char *mft_bitmap;  /* $Mft bitmap, one bit per record, set if in use */
+    ULONGLONG mft_bitmap_size;  /* size of the bitmap, in bytes */
+    ULONGLONG first_mft_id;     /* the first record to be scanned */
+    ULONGLONG end_mft_id;       /* the record following the last one to be scanned */
+    int queue_depth;            /* number of $Mft chunks in flight */
+    stream_slot *stream_index;  /* hash index of streams by mft index and name */
+    unsigned long stream_index_size; /* number of slots, a power of two */
+    ULONGLONG n_files;          /* number of files analyzed, the last one included */
+    unsigned long n_streams;    /* number of streams of the file being analyzed */
+    winx_arena *arena;          /* arena the files and their names are allocated from */
+    winx_arena *list_arena;     /* arena owning the file list, the same unless scanning a shard */
+    winx_arena *block_arena;    /* arena the blocks are allocated from, released apart from the files */
+    winx_arena *list_block_arena; /* arena owning the blocks of the file list */
 } mft_scan_parameters;
 
-/* structure used in binary search */
-typedef struct {
-    ULONGLONG mft_id;
-    winx_file_info *f;
-} file_entry;
+/* a range of mft records scanned by a thread of its own */
+typedef struct _mft_scan_shard {
+    mft_scan_parameters sp;     /* scan parameters of the shard */
+    winx_file_info *filelist;   /* files found in the shard */
+    HANDLE hDone;               /* event signaled when the shard is scanned */
+    int result;                 /* zero for success, negative value otherwise */
+    int reported;               /* nonzero when the progress callback got the files */
+} mft_scan_shard;
+
+/* enough to hold the boot sector for any sector size */
+#define BOOT_SECTOR_READ_SIZE 4096
+
+/* direct $Mft reads: chunk size and number of chunks in flight */
+#define MFT_READ_CHUNK_SIZE  (1024 * 1024)
+#define MFT_READ_QUEUE_DEPTH 8
+
+/* free parts of $Mft smaller than that are read through rather than skipped */
+#define MFT_READ_SKIP_SIZE   (64 * 1024)
+
+/* initial number of slots of the stream index */
+#define STREAM_INDEX_MIN_SIZE 64
+
+/* size of chunks of the arenas holding the files found */
+#define FILE_ARENA_CHUNK_SIZE (256 * 1024)
+
+/* mft scan threads: records per thread at least and threads at most */
+#define MFT_SHARD_MIN_RECORDS (128 * 1024)
+#define MFT_MAX_SHARDS        16
 
 typedef struct {
     ATTRIBUTE_TYPE AttributeType; /* The type of the attribute. */
@@ -103,6 +142,10 @@ typedef void (*attribute_handler)(PATTRIBUTE pattr,mft_scan_parameters *sp);
 static void analyze_resident_stream(PRESIDENT_ATTRIBUTE pr_attr,mft_scan_parameters *sp);
 static void analyze_non_resident_stream(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan_parameters *sp);
 static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_parameters *sp);
+static int check_run(ULONGLONG lcn,ULONGLONG length,mft_scan_parameters *sp);
+static ULONG RunLength(PUCHAR run);
+static LONGLONG RunLCN(PUCHAR run);
+static ULONGLONG RunCount(PUCHAR run);
 
 void validate_blockmap(winx_file_info *f);
 
@@ -169,17 +212,18 @@ static int ftw_ntfs_check_for_termination(mft_scan_parameters *sp)
 
 /**
  * @note
- * - lsn, buffer, length must be valid before this call
- * - length must be an integral of the sector size
+ * - offset, buffer, length must be valid before this call
+ * - offset and length must be integrals of the sector size
+ *   when a device is read
  */
-static NTSTATUS read_sectors(ULONGLONG lsn,PVOID buffer,ULONG length,mft_scan_parameters *sp)
+static NTSTATUS read_volume(ULONGLONG offset,PVOID buffer,ULONG length,mft_scan_parameters *sp)
 {
     IO_STATUS_BLOCK iosb;
-    LARGE_INTEGER offset;
+    LARGE_INTEGER li;
     NTSTATUS status;
 
-    offset.QuadPart = lsn * sp->ml.sector_size;
-    status = NtReadFile(winx_fileno(sp->f_volume),NULL,NULL,NULL,&iosb,buffer,length,&offset,NULL);
+    li.QuadPart = offset;
+    status = NtReadFile(winx_fileno(sp->f_volume),NULL,NULL,NULL,&iosb,buffer,length,&li,NULL);
     if(NT_SUCCESS(status)){
         status = NtWaitForSingleObject(winx_fileno(sp->f_volume),FALSE,NULL);
         if(NT_SUCCESS(status)) status = iosb.Status;
@@ -193,6 +237,144 @@ static NTSTATUS read_sectors(ULONGLONG lsn,PVOID buffer,ULONG length,mft_scan_pa
     return status;
 }
 
+/**
+ * @note
+ * - lsn, buffer, length must be valid before this call
+ * - length must be an integral of the sector size
+ */
+static NTSTATUS read_sectors(ULONGLONG lsn,PVOID buffer,ULONG length,mft_scan_parameters *sp)
+{
+    return read_volume(lsn * sp->ml.sector_size,buffer,length,sp);
+}
+
+/*
+**************************************************
+*          Direct MFT access
+**************************************************
+*/
+
+/**
+ * @brief Applies the update sequence array
+ * of a multisector record read from disk.
+ * @return Zero for success, negative value
+ * if the record is torn or corrupt.
+ */
+static int apply_fixups(NTFS_RECORD_HEADER *h,ULONG size)
+{
+    USHORT *usa, *block_end;
+    ULONG i, count;
+    
+    count = size / NTFS_USA_BLOCK_SIZE;
+    if(count == 0 || h->UsaCount != count + 1)
+        return (-1);
+    if(h->UsaOffset & 0x1 || \
+      h->UsaOffset + (count + 1) * sizeof(USHORT) > NTFS_USA_BLOCK_SIZE - sizeof(USHORT))
+        return (-1);
+    
+    usa = (USHORT *)((char *)h + h->UsaOffset);
+    for(i = 1; i <= count; i++){
+        block_end = (USHORT *)((char *)h + i * NTFS_USA_BLOCK_SIZE - sizeof(USHORT));
+        if(*block_end != usa[0])
+            return (-1);
+        *block_end = usa[i];
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads a part of $Mft data directly.
+ * @note sp->mft_runs must contain the map of $Mft blocks.
+ */
+static NTSTATUS read_mft(ULONGLONG offset,char *buffer,ULONG length,mft_scan_parameters *sp)
+{
+    winx_blockmap *block, *found;
+    ULONGLONG vcn, n;
+    NTSTATUS status;
+    
+    while(length){
+        vcn = offset / sp->ml.cluster_size;
+        found = NULL;
+        for(block = sp->mft_runs; block != NULL; block = block->next){
+            if(vcn >= block->vcn && vcn < block->vcn + block->length){
+                found = block;
+                break;
+            }
+            if(block->next == sp->mft_runs) break;
+        }
+        if(found == NULL){
+            /* the record is behind the end of $Mft */
+            return STATUS_INVALID_PARAMETER;
+        }
+        
+        /* read up to the end of the block */
+        n = (found->vcn + found->length) * sp->ml.cluster_size - offset;
+        if(n > length) n = length;
+        status = read_volume((found->lcn + vcn - found->vcn) * sp->ml.cluster_size + \
+            offset % sp->ml.cluster_size,buffer,(ULONG)n,sp);
+        if(!NT_SUCCESS(status))
+            return status;
+        offset += n;
+        buffer += n;
+        length -= (ULONG)n;
+    }
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief Prepares a file record read directly
+ * from $Mft into nfrob->FileRecordBuffer the way
+ * FSCTL_GET_NTFS_FILE_RECORD would return it.
+ */
+static NTSTATUS complete_raw_file_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
+        mft_scan_parameters *sp)
+{
+    FILE_RECORD_HEADER *frh;
+    
+    nfrob->FileReferenceNumber.QuadPart = mft_id;
+    nfrob->FileRecordLength = sp->ml.file_record_size;
+    
+    frh = (FILE_RECORD_HEADER *)nfrob->FileRecordBuffer;
+    if(is_file_record(frh)){
+        if(apply_fixups(&frh->Ntfs,sp->ml.file_record_size) < 0){
+            etrace("%I64u file record is corrupt",mft_id);
+            return STATUS_FILE_CORRUPT_ERROR;
+        }
+        nfrob->FileReferenceNumber.QuadPart |= (ULONGLONG)frh->SequenceNumber << 48;
+    }
+#ifdef TEST_NTFS_SCANNER
+    randomize_file_record_data((char *)(void *)nfrob,sp->ml.file_record_buffer_size);
+#endif
+    return STATUS_SUCCESS;
+}
+
+/**
+ * @brief get_file_record analog,
+ * reading the record directly from $Mft.
+ * @details Unlike FSCTL_GET_NTFS_FILE_RECORD,
+ * returns the requested record even if it is free.
+ * Records which are not of 'FILE' type are returned
+ * as they are, so the callers must validate them anyway.
+ */
+static NTSTATUS get_raw_file_record(ULONGLONG mft_id,
+        NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
+        mft_scan_parameters *sp)
+{
+    NTSTATUS status;
+    
+    if(sp->ml.number_of_file_records && mft_id >= sp->ml.number_of_file_records)
+        return STATUS_INVALID_PARAMETER;
+    
+    RtlZeroMemory(nfrob,sp->ml.file_record_buffer_size);
+    
+    status = read_mft(mft_id * sp->ml.file_record_size,
+        (char *)nfrob->FileRecordBuffer,sp->ml.file_record_size,sp);
+    if(!NT_SUCCESS(status))
+        return status;
+    
+    return complete_raw_file_record(mft_id,nfrob,sp);
+}
+
 /**
  * @brief Retrieves a single file record from MFT.
  * @note sp->f_volume must contain a volume handle.
@@ -206,6 +388,9 @@ static NTSTATUS get_file_record(ULONGLONG mft_id,
     IO_STATUS_BLOCK iosb;
     NTSTATUS status;
 
+    if(sp->raw)
+        return get_raw_file_record(mft_id,nfrob,sp);
+    
     nfrib.FileReferenceNumber.QuadPart = mft_id;
 
     /* required by x64 system, otherwise it trashes stack */
@@ -359,7 +544,7 @@ static wchar_t * get_attribute_name(ATTRIBUTE *attr,mft_scan_parameters *sp)
     if(wcscmp(attr_name,L"$DATA") == 0) attr_name[0] = 0;
     if(wcscmp(attr_name,L":$DATA") == 0) attr_name[0] = 0;
     
-    /* do not append index allocation attribute names - required by get_directory_information */
+    /* do not append index allocation attribute names - required by find_directory_by_mft_id */
     if(wcscmp(attr_name,L"$I30") == 0) attr_name[0] = 0;
     if(wcscmp(attr_name,L":$I30") == 0) attr_name[0] = 0;
     if(wcscmp(attr_name,L"$INDEX_ALLOCATION") == 0) attr_name[0] = 0;
@@ -374,18 +559,240 @@ static wchar_t * get_attribute_name(ATTRIBUTE *attr,mft_scan_parameters *sp)
 **************************************************
 */
 
+/**
+ * @brief Adds runs of $Mft data attribute to sp->mft_runs.
+ * @details The first part of the attribute replaces the
+ * map guessed from the boot sector to read the $Mft record.
+ */
+static void add_mft_runs(PNONRESIDENT_ATTRIBUTE pnr_attr,mft_scan_parameters *sp)
+{
+    ULONGLONG lcn, vcn, length;
+    winx_blockmap *block, *prev_block;
+    PUCHAR run;
+    
+    if(pnr_attr->LowVcn == 0)
+        winx_list_destroy((list_entry **)(void *)&sp->mft_runs);
+    
+    lcn = 0; vcn = pnr_attr->LowVcn;
+    run = (PUCHAR)((char *)pnr_attr + pnr_attr->RunArrayOffset);
+    while(*run){
+        lcn += RunLCN(run);
+        length = RunCount(run);
+        if(RunLCN(run)){
+            if(!check_run(lcn,length,sp)){
+                etrace("invalid $Mft run found, run Check Disk program!");
+                sp->errors ++;
+                break;
+            }
+            prev_block = sp->mft_runs ? sp->mft_runs->prev : NULL;
+            block = (winx_blockmap *)winx_list_insert((list_entry **)(void *)&sp->mft_runs,
+                (list_entry *)prev_block,sizeof(winx_blockmap));
+            block->vcn = vcn;
+            block->lcn = lcn;
+            block->length = length;
+        }
+        run += RunLength(run);
+        vcn += length;
+    }
+}
+
 static void get_number_of_file_records_callback(PATTRIBUTE pattr,mft_scan_parameters *sp)
 {
     PNONRESIDENT_ATTRIBUTE pnr_attr;
 
     if(pattr->Nonresident && pattr->AttributeType == AttributeData){
         pnr_attr = (PNONRESIDENT_ATTRIBUTE)pattr;
+        add_mft_runs(pnr_attr,sp);
+        /* only the first part of the attribute knows its size */
+        if(pnr_attr->LowVcn)
+            return;
         if(sp->ml.file_record_size)
             sp->ml.number_of_file_records = pnr_attr->DataSize / sp->ml.file_record_size;
         itrace("mft contains %I64u records",sp->ml.number_of_file_records);
     }
 }
 
+/**
+ * @brief Adds runs of $Mft data stored
+ * in a child record to sp->mft_runs.
+ */
+static void add_mft_child_runs(ULONGLONG mft_id,mft_scan_parameters *sp)
+{
+    NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob;
+    FILE_RECORD_HEADER *frh;
+    NTSTATUS status;
+    
+    nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
+    if(nfrob == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sp->ml.file_record_buffer_size);
+        sp->errors ++;
+        return;
+    }
+    
+    status = get_file_record(mft_id,nfrob,sp);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot read %I64u file record",mft_id);
+        sp->errors ++;
+        winx_free(nfrob);
+        return;
+    }
+    
+    frh = (FILE_RECORD_HEADER *)nfrob->FileRecordBuffer;
+    if(!is_file_record(frh) || GetMftIdFromFRN(frh->BaseFileRecord) != FILE_MFT){
+        etrace("%I64u is not a child record of $Mft",mft_id);
+        sp->errors ++;
+        winx_free(nfrob);
+        return;
+    }
+    
+    enumerate_attributes(frh,get_number_of_file_records_callback,sp);
+    winx_free(nfrob);
+}
+
+/**
+ * @brief Completes the map of $Mft blocks
+ * when $Mft data is spread over child records.
+ */
+static void get_mft_child_runs_callback(PATTRIBUTE pattr,mft_scan_parameters *sp)
+{
+    PRESIDENT_ATTRIBUTE pr_attr;
+    ATTRIBUTE_LIST *entry;
+    ULONGLONG mft_id, last_mft_id = FILE_MFT;
+    USHORT length;
+    
+    if(pattr->AttributeType != AttributeAttributeList)
+        return;
+    if(pattr->Nonresident){
+        etrace("nonresident attribute list of $Mft is not supported");
+        return;
+    }
+    
+    pr_attr = (PRESIDENT_ATTRIBUTE)pattr;
+    entry = (ATTRIBUTE_LIST *)((char *)pr_attr + pr_attr->ValueOffset);
+    while(!ftw_ntfs_check_for_termination(sp)){
+        if( ((char *)entry + sizeof(ATTRIBUTE_LIST) - sizeof(entry->AlignmentOrReserved)) > 
+            ((char *)pr_attr + pr_attr->ValueOffset + pr_attr->ValueLength) ) break;
+        if(entry->AttributeType == 0xffffffff) break;
+        if(entry->AttributeType == 0x0) break;
+        if(entry->Length == 0) break;
+        /* a child record may hold a few parts, the entries are sorted */
+        mft_id = GetMftIdFromFRN(entry->FileReferenceNumber);
+        if(entry->AttributeType == AttributeData && mft_id != last_mft_id){
+            add_mft_child_runs(mft_id,sp);
+            last_mft_id = mft_id;
+        }
+        length = entry->Length;
+        entry = (PATTRIBUTE_LIST)((char *)entry + length);
+    }
+}
+
+/**
+ * @brief Loads the $Mft bitmap into sp->mft_bitmap.
+ * @details Failures are not fatal, all records
+ * are just considered to be in use then.
+ */
+static void get_mft_bitmap_callback(PATTRIBUTE pattr,mft_scan_parameters *sp)
+{
+    PRESIDENT_ATTRIBUTE pr_attr;
+    PNONRESIDENT_ATTRIBUTE pnr_attr;
+    ULONGLONG lcn, vcn, length, size;
+    PUCHAR run;
+    NTSTATUS status;
+    
+    if(pattr->AttributeType != AttributeBitmap || sp->mft_bitmap)
+        return;
+    
+    if(!pattr->Nonresident){
+        pr_attr = (PRESIDENT_ATTRIBUTE)pattr;
+        if(pr_attr->ValueLength == 0)
+            return;
+        sp->mft_bitmap = winx_tmalloc(pr_attr->ValueLength);
+        if(sp->mft_bitmap == NULL){
+            mtrace();
+            return;
+        }
+        memcpy(sp->mft_bitmap,(char *)pr_attr + pr_attr->ValueOffset,pr_attr->ValueLength);
+        sp->mft_bitmap_size = pr_attr->ValueLength;
+        return;
+    }
+    
+    pnr_attr = (PNONRESIDENT_ATTRIBUTE)pattr;
+    if(pnr_attr->LowVcn){
+        etrace("$Mft bitmap spread over child records is not supported");
+        return;
+    }
+    size = pnr_attr->AllocatedSize;
+    if(size == 0 || size % sp->ml.cluster_size || pnr_attr->DataSize > size || \
+      size > (ULONGLONG)sp->ml.total_clusters * sp->ml.cluster_size){
+        etrace("invalid $Mft bitmap size %I64u",size);
+        return;
+    }
+    sp->mft_bitmap = winx_tmalloc((size_t)size);
+    if(sp->mft_bitmap == NULL){
+        mtrace();
+        return;
+    }
+    RtlZeroMemory(sp->mft_bitmap,(size_t)size);
+    
+    lcn = 0; vcn = 0;
+    run = (PUCHAR)((char *)pnr_attr + pnr_attr->RunArrayOffset);
+    while(*run){
+        lcn += RunLCN(run);
+        length = RunCount(run);
+        if((vcn + length) * sp->ml.cluster_size > size || \
+          (RunLCN(run) && !check_run(lcn,length,sp))){
+            etrace("invalid $Mft bitmap run found");
+            break;
+        }
+        if(RunLCN(run)){
+            status = read_volume(lcn * sp->ml.cluster_size,
+                sp->mft_bitmap + vcn * sp->ml.cluster_size,
+                (ULONG)(length * sp->ml.cluster_size),sp);
+            if(!NT_SUCCESS(status)){
+                strace(status,"cannot read $Mft bitmap");
+                break;
+            }
+        }
+        run += RunLength(run);
+        vcn += length;
+    }
+    if(*run){
+        winx_free(sp->mft_bitmap);
+        sp->mft_bitmap = NULL;
+        return;
+    }
+    sp->mft_bitmap_size = pnr_attr->DataSize;
+}
+
+/**
+ * @brief Checks whether a file record is in use
+ * according to the $Mft bitmap.
+ * @note Without the bitmap all records are in use.
+ */
+static int mft_record_in_use(ULONGLONG mft_id,mft_scan_parameters *sp)
+{
+    if(sp->mft_bitmap == NULL || mft_id / 8 >= sp->mft_bitmap_size)
+        return 1;
+    return (sp->mft_bitmap[mft_id / 8] >> (mft_id % 8)) & 0x1;
+}
+
+/**
+ * @brief Checks whether any record of a $Mft
+ * cluster is in use according to the $Mft bitmap.
+ */
+static int mft_cluster_in_use(ULONGLONG vcn,mft_scan_parameters *sp)
+{
+    ULONGLONG mft_id, n;
+    
+    n = sp->ml.cluster_size / sp->ml.file_record_size;
+    for(mft_id = vcn * n; mft_id < (vcn + 1) * n; mft_id++){
+        if(mft_record_in_use(mft_id,sp))
+            return 1;
+    }
+    return 0;
+}
+
 /**
  * @brief Retrieves a number of file records containing in MFT.
  * @return Zero for success, negative value otherwise.
@@ -441,6 +848,14 @@ static int get_number_of_file_records(mft_scan_parameters *sp)
     /* get actual number of mft entries */
     enumerate_attributes(frh,get_number_of_file_records_callback,sp);
     
+    /* direct reads need the complete map of $Mft */
+    enumerate_attributes(frh,get_mft_child_runs_callback,sp);
+    
+    /* free records need not be read at all */
+    enumerate_attributes(frh,get_mft_bitmap_callback,sp);
+    if(sp->mft_bitmap)
+        itrace("mft bitmap has %I64u bytes",sp->mft_bitmap_size);
+    
     /* free memory */
     winx_free(nfrob);
     
@@ -453,6 +868,103 @@ static int get_number_of_file_records(mft_scan_parameters *sp)
     return 0;
 }
 
+/**
+ * @brief get_mft_layout analog,
+ * retrieving the layout from the boot sector.
+ * @return Zero for success, negative value otherwise.
+ * @note sp->f_volume must contain a handle
+ * of the volume or of an image of it.
+ */
+static int get_raw_mft_layout(mft_scan_parameters *sp)
+{
+    NTFS_BOOT_SECTOR *bs;
+    winx_blockmap *block;
+    ULONGLONG mft_lcn;
+    NTSTATUS status;
+    int shift;
+    
+    /* read as much as needed for any sector size */
+    bs = winx_tmalloc(BOOT_SECTOR_READ_SIZE);
+    if(bs == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            BOOT_SECTOR_READ_SIZE);
+        return (-1);
+    }
+    status = read_volume(0,bs,BOOT_SECTOR_READ_SIZE,sp);
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot read the boot sector");
+        winx_free(bs);
+        return (-1);
+    }
+    if(memcmp(bs->OemId,"NTFS    ",sizeof(bs->OemId)) != 0){
+        etrace("NTFS boot sector not found");
+        winx_free(bs);
+        return (-1);
+    }
+    
+    sp->ml.sector_size = bs->BytesPerSector;
+    if(bs->SectorsPerCluster > 0x80){
+        shift = 256 - bs->SectorsPerCluster;
+        sp->ml.sectors_per_cluster = (shift < 16) ? (1 << shift) : 0;
+    } else {
+        sp->ml.sectors_per_cluster = bs->SectorsPerCluster;
+    }
+    sp->ml.cluster_size = (ULONGLONG)sp->ml.sector_size * sp->ml.sectors_per_cluster;
+    if(bs->ClustersPerFileRecord < 0){
+        shift = -bs->ClustersPerFileRecord;
+        sp->ml.file_record_size = (shift < 16) ? (1 << shift) : 0;
+    } else {
+        sp->ml.file_record_size = (unsigned long)(sp->ml.cluster_size * bs->ClustersPerFileRecord);
+    }
+    sp->ml.file_record_buffer_size = sizeof(NTFS_FILE_RECORD_OUTPUT_BUFFER) + \
+        sp->ml.file_record_size - 1;
+    if(sp->ml.sectors_per_cluster)
+        sp->ml.total_clusters = bs->TotalSectors / sp->ml.sectors_per_cluster;
+    mft_lcn = bs->MftStartLcn;
+    winx_free(bs);
+    
+    itrace("mft record size = %u",sp->ml.file_record_size);
+    itrace("volume has %I64u clusters",sp->ml.total_clusters);
+    itrace("cluster size = %I64u",sp->ml.cluster_size);
+    itrace("sector size = %u",sp->ml.sector_size);
+    itrace("each cluster consists of %u sectors",sp->ml.sectors_per_cluster);
+    itrace("mft starts at cluster %I64u",mft_lcn);
+    
+    if(sp->ml.sector_size == 0 || sp->ml.sector_size % NTFS_USA_BLOCK_SIZE){
+        etrace("invalid sector size");
+        return (-1);
+    }
+    
+    if(sp->ml.sectors_per_cluster == 0){
+        etrace("sp->ml.sectors_per_cluster equal to zero is invalid");
+        return (-1);
+    }
+    
+    if(sp->ml.file_record_size == 0 || sp->ml.file_record_size % NTFS_USA_BLOCK_SIZE){
+        etrace("invalid mft record size");
+        return (-1);
+    }
+    
+    if(!check_run(mft_lcn,1,sp)){
+        etrace("mft is outside of the volume");
+        return (-1);
+    }
+    
+    /* assume contiguous system records until $Mft record is read */
+    block = (winx_blockmap *)winx_list_insert((list_entry **)(void *)&sp->mft_runs,
+        NULL,sizeof(winx_blockmap));
+    block->vcn = 0;
+    block->lcn = mft_lcn;
+    block->length = (FILE_first_user * sp->ml.file_record_size + \
+        sp->ml.cluster_size - 1) / sp->ml.cluster_size;
+    
+    /* get number of mft entries and the rest of $Mft map */
+    if(get_number_of_file_records(sp) < 0 || sp->errors)
+        return (-1);
+    
+    return 0;
+}
+
 /**
  * @brief Retrieves MFT layout.
  * @return Zero for success, negative value otherwise.
@@ -468,6 +980,9 @@ static int get_mft_layout(mft_scan_parameters *sp)
     
     /* reset sp->ml structure */
     memset(&sp->ml,0,sizeof(mft_layout));
+    
+    if(sp->raw)
+        return get_raw_mft_layout(sp);
 
     /* allocate memory */
     ntfs_data = winx_malloc(sizeof(NTFS_DATA));
@@ -931,13 +1446,13 @@ static void analyze_non_resident_attribute_list(winx_file_info *f,ULONGLONG list
 {
     ULONGLONG cluster_size;
     ULONGLONG clusters_to_read;
+    ULONGLONG n;
     char *cluster;
     char *current_cluster;
     winx_blockmap *block;
     ULONGLONG lsn;
     NTSTATUS status;
     PATTRIBUTE_LIST attr_list_entry;
-    int i;
     USHORT length;
 
 #ifdef SHOW_ATTR_LISTS_INFO
@@ -960,29 +1475,27 @@ static void analyze_non_resident_attribute_list(winx_file_info *f,ULONGLONG list
         return;
     }
     
-    /* loop through all blocks of file */
+    /* loop through all blocks of file, reading each one at once */
     current_cluster = cluster;
     for(block = f->disp.blockmap; block != NULL; block = block->next){
-        /* loop through clusters of the current block */
-        for(i = 0; i < block->length; i++){
-            /* read current cluster */
-            lsn = (block->lcn + i) * sp->ml.sectors_per_cluster;
-            status = read_sectors(lsn,current_cluster,(ULONG)cluster_size,sp);
-            if(!NT_SUCCESS(status)){
-                strace(status,"cannot read %I64u sector",lsn);
-                /* attribute list seems to be invalid itself, so we'll just skip it */
-                /*sp->errors ++;*/
-                goto scan_done;
-            }
-            clusters_to_read --;
-            if(clusters_to_read == 0){
-                /* is it the last cluster of the file? */
-                if(i < (block->length - 1) || block->next != f->disp.blockmap)
-                    etrace("attribute list has more clusters than expected");
-                goto analyze_list;
-            }
-            current_cluster += cluster_size;
+        n = min(block->length,clusters_to_read);
+        lsn = block->lcn * sp->ml.sectors_per_cluster;
+        status = read_sectors(lsn,current_cluster,(ULONG)(n * cluster_size),sp);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot read %I64u sectors at %I64u",
+                n * sp->ml.sectors_per_cluster,lsn);
+            /* attribute list seems to be invalid itself, so we'll just skip it */
+            /*sp->errors ++;*/
+            goto scan_done;
         }
+        clusters_to_read -= n;
+        if(clusters_to_read == 0){
+            /* is it the last cluster of the file? */
+            if(n < block->length || block->next != f->disp.blockmap)
+                etrace("attribute list has more clusters than expected");
+            goto analyze_list;
+        }
+        current_cluster += n * cluster_size;
         if(block->next == f->disp.blockmap) break;
     }
 
@@ -1026,38 +1539,119 @@ scan_done:
 **************************************************
 */
 
+static ULONG stream_hash(ULONGLONG mft_id,wchar_t *name)
+{
+    ULONG hash = 2166136261; /* FNV-1a */
+    
+    hash = (hash ^ (ULONG)mft_id) * 16777619;
+    hash = (hash ^ (ULONG)(mft_id >> 32)) * 16777619;
+    for(; *name; name++)
+        hash = (hash ^ *name) * 16777619;
+    return hash;
+}
+
+/**
+ * @brief Searches the stream index for a
+ * stream of the file being analyzed.
+ * @return The slot of the stream if it is
+ * in the index, the free slot it belongs
+ * to otherwise.
+ * @note Slots of other files count as free,
+ * so the index needs no cleanup between files.
+ * Streams are hashed by mft index and name.
+ */
+static stream_slot *find_stream_slot(wchar_t *attr_name,mft_scan_parameters *sp)
+{
+    stream_slot *slot;
+    ULONG i, mask;
+    
+    mask = sp->stream_index_size - 1;
+    for(i = stream_hash(sp->mfi.BaseMftId,attr_name) & mask;; i = (i + 1) & mask){
+        slot = &sp->stream_index[i];
+        if(slot->f == NULL || slot->file != sp->n_files)
+            return slot;
+        if(!wcscmp(slot->f->name,attr_name))
+            return slot;
+    }
+}
+
+/**
+ * @brief Doubles the stream index,
+ * keeping streams of the file being analyzed.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+static int grow_stream_index(mft_scan_parameters *sp)
+{
+    stream_slot *old_index, *slot;
+    unsigned long old_size, i;
+    
+    old_index = sp->stream_index;
+    old_size = sp->stream_index_size;
+    sp->stream_index_size = old_size ? old_size * 2 : STREAM_INDEX_MIN_SIZE;
+    sp->stream_index = winx_tmalloc(sp->stream_index_size * sizeof(stream_slot));
+    if(sp->stream_index == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            sp->stream_index_size * sizeof(stream_slot));
+        sp->stream_index = old_index;
+        sp->stream_index_size = old_size;
+        sp->errors ++;
+        return (-1);
+    }
+    RtlZeroMemory(sp->stream_index,sp->stream_index_size * sizeof(stream_slot));
+    
+    for(i = 0; i < old_size; i++){
+        if(old_index[i].f && old_index[i].file == sp->n_files){
+            slot = find_stream_slot(old_index[i].f->name,sp);
+            *slot = old_index[i];
+        }
+    }
+    winx_free(old_index);
+    return 0;
+}
+
+/**
+ * @brief Searches for a stream of the file
+ * being analyzed, adds it to the file list
+ * if it is not there yet.
+ * @details Streams are looked up through
+ * the stream index, so the order in which
+ * mft records are scanned doesn't matter.
+ * New streams are inserted in front of the
+ * file list.
+ */
 static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_parameters *sp)
 {
     winx_file_info *f;
+    stream_slot *slot;
     
-    /* few streams may have the same mft id */
-    for(f = *sp->filelist; f != NULL; f = f->next){
-        /*
-        * we scan mft from the end to the beginning (RTL)
-        * and we add new records to the left side of the file list...
-        */
-        if(sp->mft_scan_direction == MFT_SCAN_RTL){
-            if(f->internal.BaseMftId > sp->mfi.BaseMftId) break; /* we have no chance to find record in list */
-        } else {
-            if(f->internal.BaseMftId < sp->mfi.BaseMftId) break;
-        }
-        if(!wcscmp(f->name,attr_name) && f->internal.BaseMftId == sp->mfi.BaseMftId)
-            return f; /* slow? */
-        //if(f->internal.BaseMftId == sp->mfi.BaseMftId) return f; /* safe? */
-        if(f->next == *sp->filelist) break;
+    /* keep at least half of the slots free */
+    if((sp->n_streams + 1) * 2 > sp->stream_index_size){
+        if(grow_stream_index(sp) < 0)
+            return NULL;
     }
     
-    f = (winx_file_info *)winx_list_insert((list_entry **)(void *)sp->filelist,NULL,sizeof(winx_file_info));
+    /* few streams may have the same mft id */
+    slot = find_stream_slot(attr_name,sp);
+    if(slot->f && slot->file == sp->n_files)
+        return slot->f;
+    
+    f = winx_arena_alloc(sp->arena,sizeof(winx_file_info),MALLOC_ABORT_ON_FAILURE);
+    if(f == NULL){
+        sp->errors ++;
+        return NULL;
+    }
 
     /* initialize structure */
-    f->name = winx_wcsdup(attr_name);
+    f->name = winx_arena_alloc(sp->arena,(wcslen(attr_name) + 1) * sizeof(wchar_t),0);
     if(f->name == NULL){
         etrace("cannot allocate %u bytes of memory",
             (wcslen(attr_name) + 1) * sizeof(wchar_t));
-        winx_list_remove((list_entry **)(void *)sp->filelist,(list_entry *)f);
         sp->errors ++;
         return NULL;
     }
+    wcscpy(f->name,attr_name);
+    winx_list_attach((list_entry **)(void *)sp->filelist,NULL,(list_entry *)f);
     
     f->path = NULL;
     f->flags = 0;
@@ -1065,9 +1659,17 @@ static winx_file_info * find_filelist_entry(wchar_t *attr_name,mft_scan_paramete
     memset(&f->disp,0,sizeof(winx_file_disposition));
     f->internal.BaseMftId = sp->mfi.BaseMftId;
     f->internal.ParentDirectoryMftId = FILE_root;
+    f->internal.ParentDirectory = NULL;
+    f->internal.Arena = sp->list_arena;
+    f->internal.BlockArena = sp->list_block_arena;
+    f->internal.VolumeLetter = sp->volume_letter;
     f->creation_time = 0;
     f->last_modification_time = 0;
     f->last_access_time = 0;
+    
+    slot->file = sp->n_files;
+    slot->f = f;
+    sp->n_streams ++;
     return f;
 }
 
@@ -1077,8 +1679,13 @@ static void process_run(winx_file_info *f,ULONGLONG vcn,ULONGLONG lcn,ULONGLONG
     
     /* add information to f->disp */
     if(f->disp.blockmap) prev_block = f->disp.blockmap->prev;
-    block = (winx_blockmap *)winx_list_insert((list_entry **)&f->disp.blockmap,
-        (list_entry *)prev_block,sizeof(winx_blockmap));
+    block = winx_arena_alloc(sp->block_arena,sizeof(winx_blockmap),MALLOC_ABORT_ON_FAILURE);
+    if(block == NULL){
+        sp->errors ++;
+        return;
+    }
+    winx_list_attach((list_entry **)&f->disp.blockmap,
+        (list_entry *)prev_block,(list_entry *)block);
     
     block->vcn = vcn;
     block->lcn = lcn;
@@ -1243,7 +1850,9 @@ static int update_stream_name(winx_file_info *f,mft_scan_parameters *sp)
     int length;
     
     length = (int)wcslen(f->name) + (int)wcslen(sp->mfi.Name) + 1;
-    new_name = winx_malloc((length + 1) * sizeof(wchar_t));
+    new_name = winx_arena_alloc(sp->arena,(length + 1) * sizeof(wchar_t),MALLOC_ABORT_ON_FAILURE);
+    if(new_name == NULL)
+        return (-1);
     
     if(f->name[0]) /* stream name is not empty */
         _snwprintf(new_name,length + 1,L"%ws:%ws",sp->mfi.Name,f->name);
@@ -1251,7 +1860,7 @@ static int update_stream_name(winx_file_info *f,mft_scan_parameters *sp)
         wcsncpy(new_name,sp->mfi.Name,length);
     new_name[length] = 0;
     
-    winx_free(f->name);
+    /* the former name remains in the arena */
     f->name = new_name;
     return 0;
 }
@@ -1286,6 +1895,9 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
 {
     FILE_RECORD_HEADER *frh;
     winx_file_info *f, *next, *head;
+    winx_arena_state mark, block_mark;
+    unsigned long n, kept;
+    int drop;
     
     /* validate header */
     frh = (FILE_RECORD_HEADER *)nfrob->FileRecordBuffer;
@@ -1327,6 +1939,12 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
     sp->mfi.CreationTime = 0;
     sp->mfi.LastWriteTime = 0;
     sp->mfi.LastAccessTime = 0;
+    sp->n_files ++;
+    sp->n_streams = 0;
+    
+    /* the file is allocated from here on */
+    winx_arena_mark(sp->arena,&mark);
+    winx_arena_mark(sp->block_arena,&block_mark);
     
     /* skip attribute lists */
     enumerate_attributes(frh,analyze_attribute_callback,sp);
@@ -1346,15 +1964,17 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
     * We are appending here the name
     * of the file to name of streams
     * and updating also flags saved
-    * in filelist entries.
+    * in filelist entries. The streams
+    * are in front of the file list.
+    * Streams rejected by the filter
+    * callback get removed right away.
     */
     head = *sp->filelist;
+    n = sp->n_streams;
+    kept = 0;
     for(f = head; f != NULL;){
-        if(sp->mft_scan_direction == MFT_SCAN_RTL){
-            if(f->internal.BaseMftId > sp->mfi.BaseMftId) break; /* we have no chance to find record in list */
-        } else {
-            if(f->internal.BaseMftId < sp->mfi.BaseMftId) break;
-        }
+        if(n == 0) break;
+        n --;
         next = f->next;
         if(f->internal.BaseMftId == sp->mfi.BaseMftId){
             /* update flags, because sp->mfi contains more actual data  */
@@ -1366,8 +1986,16 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
             /* set parent directory id for the stream */
             f->internal.ParentDirectoryMftId = sp->mfi.ParentDirectoryMftId;
             /* add filename to the name of the stream */
-            if(update_stream_name(f,sp) < 0){
-                winx_list_remove((list_entry **)(void *)sp->filelist,(list_entry *)f);
+            drop = (update_stream_name(f,sp) < 0);
+            if(!drop){
+                validate_blockmap(f);
+                if(sp->fcb && sp->fcb(f,sp->user_defined_data)){
+                    /* entries of directories are needed to build paths */
+                    drop = !is_directory(f) || wcsstr(f->name,L":$") != NULL;
+                }
+            }
+            if(drop){
+                winx_list_detach((list_entry **)(void *)sp->filelist,(list_entry *)f);
                 if(*sp->filelist == NULL) break;
                 if(*sp->filelist != head){
                     head = *sp->filelist;
@@ -1375,6 +2003,7 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
                     continue;
                 }
             } else {
+                kept ++;
                 /* call progress callback */
                 if(sp->pcb)
                     sp->pcb(f,sp->user_defined_data);
@@ -1383,6 +2012,12 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
         f = next;
         if(f == head) break;
     }
+    
+    /* nothing refers to the memory of a file dropped entirely */
+    if(kept == 0){
+        winx_arena_rewind(sp->arena,&mark);
+        winx_arena_rewind(sp->block_arena,&block_mark);
+    }
 }
 
 /*
@@ -1391,217 +2026,569 @@ static void analyze_file_record(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,
 **************************************************
 */
 
+/**
+ * @brief Searches for the entry of a directory.
+ * @param[in] mft_id mft index of the directory.
+ * @param[in] dirs table of directories
+ * indexed by mft index, NULL if there is none.
+ * @return The first entry of the file list
+ * with the given mft index which is not
+ * a system stream, NULL if there is none.
+ */
 static winx_file_info * find_directory_by_mft_id(ULONGLONG mft_id,
-    file_entry *f_array,unsigned long n_entries,mft_scan_parameters *sp)
+    winx_file_info **dirs,mft_scan_parameters *sp)
 {
     winx_file_info *f;
-    ULONG lim, i, k;
-    signed long m;
-    BOOLEAN ascending_order;
 
-    if(f_array == NULL){ /* use slow linear search */
+    if(dirs){
+        if(mft_id >= sp->ml.number_of_file_records)
+            return NULL;
+        return dirs[mft_id];
+    }
+    
+    /* use slow linear search */
+    for(f = *sp->filelist; f != NULL; f = f->next){
+        if(f->internal.BaseMftId == mft_id){
+            if(wcsstr(f->name,L":$") == NULL)
+                return f;
+        }
+        if(f->next == *sp->filelist) break;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Links all files found to entries
+ * of their parent directories and builds
+ * their paths, unless WINX_FTW_LAZY_PATHS
+ * flag is set.
+ * @details Directories are looked up in a
+ * table indexed by mft index. Paths are built
+ * by winx_ftw_get_path, each directory path
+ * once, so the time needed is proportional
+ * to the total length of the paths.
+ */
+static int build_full_paths(mft_scan_parameters *sp)
+{
+    winx_file_info **dirs;
+    winx_file_info *f;
+    ULONGLONG mft_id;
+    ULONGLONG time;
+    size_t length;
+    
+    itrace("build_full_paths started...");
+    time = winx_xtime();
+    
+    /* fill the table of directories */
+    dirs = winx_tmalloc((SIZE_T)(sp->ml.number_of_file_records * sizeof(winx_file_info *)));
+    if(dirs == NULL){
+        etrace("cannot allocate %I64u bytes of memory",
+            sp->ml.number_of_file_records * sizeof(winx_file_info *));
+        itrace("slow linear search will be used");
+    } else {
+        RtlZeroMemory(dirs,(SIZE_T)(sp->ml.number_of_file_records * sizeof(winx_file_info *)));
         for(f = *sp->filelist; f != NULL; f = f->next){
-            if(f->internal.BaseMftId == mft_id){
-                if(wcsstr(f->name,L":$") == NULL)
-                    return f;
+            if(f->internal.BaseMftId < sp->ml.number_of_file_records){
+                if(dirs[f->internal.BaseMftId] == NULL && wcsstr(f->name,L":$") == NULL)
+                    dirs[f->internal.BaseMftId] = f;
             }
             if(f->next == *sp->filelist) break;
         }
-        return NULL;
-    } else { /* use fast binary search */
-        /* Based on bsearch() algorithm copyrighted by DJ Delorie (1994). */
-        ascending_order = (sp->mft_scan_direction == MFT_SCAN_RTL) ? TRUE : FALSE;
-        i = 0;
-        for(lim = n_entries; lim != 0; lim >>= 1){
-            k = i + (lim >> 1);
-            if(f_array[k].mft_id == mft_id){
-                /* search for proper entry in neighbourhood of found entry */
-                for(m = k; m >= 0; m --){
-                    if(f_array[m].mft_id != mft_id) break;
-                }
-                for(m = m + 1; (unsigned long)(m) < n_entries; m ++){
-                    if(f_array[m].mft_id != mft_id) break;
-                    if(wcsstr(f_array[m].f->name,L":$") == NULL)
-                        return f_array[m].f;
+    }
+    
+    /* link files to their parent directories */
+    for(f = *sp->filelist; f != NULL; f = f->next){
+        if(ftw_ntfs_check_for_termination(sp)) break;
+        mft_id = f->internal.ParentDirectoryMftId;
+        if(mft_id != FILE_root){
+            f->internal.ParentDirectory = find_directory_by_mft_id(mft_id,dirs,sp);
+            if(f->internal.ParentDirectory == NULL){
+                etrace("%I64u directory not found",mft_id);
+                sp->errors ++;
+                /* the path cannot be built on demand then */
+                length = wcslen(f->name) + 9;
+                f->path = winx_arena_alloc(sp->arena,length * sizeof(wchar_t),0);
+                if(f->path){
+                    (void)_snwprintf(f->path,length,L"\\??\\%c:\\\\%ws",sp->volume_letter,f->name);
+                    f->path[length - 1] = 0;
                 }
-                etrace("Exit 1");
-                return NULL;
-            }
-            if(ascending_order){
-                if(mft_id > f_array[k].mft_id){
-                    i = k + 1; lim --; /* move right */
-                } /* else move left */
-            } else {
-                if(mft_id < f_array[k].mft_id){
-                    i = k + 1; lim --; /* move right */
-                } /* else move left */
             }
         }
-        etrace("Exit 2");
-        return NULL;
+        if(f->next == *sp->filelist) break;
     }
+    winx_free(dirs);
+    
+    /* build the paths */
+    if(!(sp->flags & WINX_FTW_LAZY_PATHS)){
+        for(f = *sp->filelist; f != NULL; f = f->next){
+            if(ftw_ntfs_check_for_termination(sp)) break;
+            if(winx_ftw_get_path(f) == NULL)
+                sp->errors ++;
+            if(f->next == *sp->filelist) break;
+        }
+    }
+    
+    itrace("build_full_paths completed in %I64u ms",winx_xtime() - time);
+    return 0;
 }
 
+/*
+**************************************************
+*       NTFS scan entry point and helpers
+**************************************************
+*/
+
 /**
- * @param[in] mft_id mft index of directory.
- * @param[out] path pointer to variable receiving directory path.
- * @param[out] parent_mft_id mft index of parent directory.
- * @return Nonzero value indicates that returned path contains full
- * native path, otherwise it contains directory name only.
+ * @brief Analyzes all file records of
+ * sp->first_mft_id to sp->end_mft_id range,
+ * retrieving them one by one.
+ * @return Zero for success,
+ * negative value otherwise.
  */
-static int get_directory_information(ULONGLONG mft_id,wchar_t **path,ULONGLONG *parent_mft_id,
-    file_entry *f_array,unsigned long n_entries,mft_scan_parameters *sp)
+static int scan_mft_records(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp)
 {
-    winx_file_info *f;
-    
-    *path = NULL;
-    *parent_mft_id = FILE_root;
+    ULONGLONG mft_id, ret_mft_id;
+    NTSTATUS status;
     
-    f = find_directory_by_mft_id(mft_id,f_array,n_entries,sp);
-    if(f == NULL){
-        etrace("%I64u directory not found",mft_id);
-        sp->errors ++;
+    if(sp->end_mft_id <= sp->first_mft_id)
         return 0;
+    mft_id = sp->end_mft_id - 1;
+    while(!ftw_ntfs_check_for_termination(sp)){
+        while(mft_id > sp->first_mft_id && !mft_record_in_use(mft_id,sp))
+            mft_id --;
+        status = get_file_record(mft_id,nfrob,sp);
+        if(!NT_SUCCESS(status)){
+            if(mft_id == 0){
+                strace(status,"get_file_record for $Mft failed");
+                return (-1);
+            }
+            if(mft_id == sp->first_mft_id)
+                break;
+            /* it returns 0xc000000d (invalid parameter) for non existing records */
+            mft_id --; /* try to retrieve a previous record */
+            continue;
+        }
+
+        /* the driver returns the nearest record in use below */
+        ret_mft_id = GetMftIdFromFRN(nfrob->FileReferenceNumber.QuadPart);
+        //trace(D"NTFS record found, id = %I64u",ret_mft_id);
+        if(ret_mft_id < sp->first_mft_id)
+            break; /* it belongs to the previous range */
+
+        /* analyze file record */
+        if(ret_mft_id < sp->end_mft_id)
+            analyze_file_record(nfrob,sp);
+
+        /* go to the next record */
+        if(ret_mft_id == sp->first_mft_id || mft_id == sp->first_mft_id)
+            break;
+        if(ret_mft_id > mft_id){
+            /* avoid infinite loops */
+            etrace("returned file record index is above expected");
+            mft_id --;
+        } else {
+            mft_id = ret_mft_id - 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Queues $Mft for direct reads in large
+ * chunks, from the last one to the first one,
+ * down to the one holding sp->first_mft_id.
+ * @details Each chunk lies within a single
+ * $Mft run and is keyed by its first vcn.
+ * Clusters holding free records only are
+ * skipped, unless the free range is small
+ * enough to be read through.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+static int queue_mft_chunks(WINX_READQ *q,mft_scan_parameters *sp)
+{
+    winx_blockmap *block, *found;
+    ULONGLONG vcn, first_vcn, start, low, n;
+    ULONGLONG chunk_clusters, skip_clusters;
+    
+    chunk_clusters = MFT_READ_CHUNK_SIZE / sp->ml.cluster_size;
+    if(chunk_clusters == 0) chunk_clusters = 1;
+    skip_clusters = MFT_READ_SKIP_SIZE / sp->ml.cluster_size;
+    if(skip_clusters == 0) skip_clusters = 1;
+    
+    first_vcn = sp->first_mft_id * sp->ml.file_record_size / sp->ml.cluster_size;
+    vcn = (sp->end_mft_id * sp->ml.file_record_size + \
+        sp->ml.cluster_size - 1) / sp->ml.cluster_size;
+    while(vcn > first_vcn){
+        found = NULL;
+        for(block = sp->mft_runs; block != NULL; block = block->next){
+            if(vcn - 1 >= block->vcn && vcn - 1 < block->vcn + block->length){
+                found = block;
+                break;
+            }
+            if(block->next == sp->mft_runs) break;
+        }
+        if(found == NULL){
+            /* records behind the known runs cannot be read */
+            vcn --;
+            continue;
+        }
+        
+        if(!mft_cluster_in_use(vcn - 1,sp)){
+            vcn --;
+            continue;
+        }
+        
+        /* extend the chunk down to the last cluster in use */
+        start = low = vcn - 1;
+        while(start > found->vcn && start > first_vcn && vcn - start < chunk_clusters){
+            if(mft_cluster_in_use(start - 1,sp))
+                low = start - 1;
+            else if(low - (start - 1) >= skip_clusters)
+                break;
+            start --;
+        }
+        start = low;
+        n = vcn - start;
+        if(winx_readq_add(q,(found->lcn + start - found->vcn) * sp->ml.cluster_size,
+          (ULONG)(n * sp->ml.cluster_size),start) < 0)
+            return (-1);
+        vcn = start;
     }
+    return 0;
+}
+
+/**
+ * @brief Analyzes all file records of
+ * sp->first_mft_id to sp->end_mft_id range,
+ * reading $Mft directly in large chunks,
+ * several of them in flight.
+ * @details This replaces one small synchronous
+ * read (or FSCTL_GET_NTFS_FILE_RECORD request)
+ * per file record by a few large reads, so that
+ * images and volumes are read about as fast as
+ * the disk allows. Records are analyzed in the
+ * same order as scan_mft_records does.
+ * @note On mounted volumes records may change
+ * while being read. Records which turn out to
+ * be torn are asked from the NTFS driver then.
+ * @return Zero for success, negative value on
+ * failure, positive value if the chunked reads
+ * are not available, so scan_mft_records needs
+ * to be used instead.
+ */
+static int scan_mft_chunks(NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob,mft_scan_parameters *sp)
+{
+    WINX_READQ *q;
+    char *buffer;
+    ULONGLONG key, mft_id;
+    ULONG length, n;
+    NTSTATUS status;
+    int flags = 0;
+    int result = 0;
     
-    *parent_mft_id = f->internal.ParentDirectoryMftId;
+    /* chunks must consist of whole records */
+    if(sp->ml.cluster_size < sp->ml.file_record_size)
+        return 1;
+    
+    /* unbuffered reads must be aligned to the physical sector size */
+    if(sp->ml.cluster_size % 4096 == 0)
+        flags |= WINX_READQ_UNBUFFERED;
+    
+    /* let the driver write out changes of $Mft it still holds */
+    if(!sp->raw && winx_vflush(sp->volume_letter) < 0)
+        etrace("cannot flush %c: volume",sp->volume_letter);
     
-    if(f->path){
-        *path = f->path;
+    q = winx_readq_open(sp->path,sp->queue_depth,
+        (ULONG)max(MFT_READ_CHUNK_SIZE,sp->ml.cluster_size),flags);
+    if(q == NULL)
         return 1;
+    
+    if(queue_mft_chunks(q,sp) < 0){
+        winx_readq_close(q);
+        return (-1);
     }
     
-    if(f->name){
-        *path = f->name;
+    while(!ftw_ntfs_check_for_termination(sp)){
+        result = winx_readq_next(q,&buffer,NULL,&length,&key);
+        if(result <= 0)
+            break;
+        
+        /* analyze records of the chunk from the last one */
+        mft_id = key * sp->ml.cluster_size / sp->ml.file_record_size;
+        for(n = length / sp->ml.file_record_size; n > 0; n--){
+            if(mft_id + n - 1 < sp->first_mft_id || mft_id + n - 1 >= sp->end_mft_id || \
+              !mft_record_in_use(mft_id + n - 1,sp))
+                continue;
+            memcpy(nfrob->FileRecordBuffer,buffer + (n - 1) * sp->ml.file_record_size,
+                sp->ml.file_record_size);
+            status = complete_raw_file_record(mft_id + n - 1,nfrob,sp);
+            if(!NT_SUCCESS(status) && !sp->raw){
+                /* torn by a concurrent write, so ask the driver */
+                status = get_file_record(mft_id + n - 1,nfrob,sp);
+                if(NT_SUCCESS(status) && GetMftIdFromFRN( \
+                  nfrob->FileReferenceNumber.QuadPart) != mft_id + n - 1)
+                    continue; /* the record is free */
+            }
+            if(!NT_SUCCESS(status)){
+                if(mft_id + n - 1 == 0){
+                    strace(status,"$Mft record is corrupt");
+                    result = -1;
+                    break;
+                }
+                continue;
+            }
+            analyze_file_record(nfrob,sp);
+            if(ftw_ntfs_check_for_termination(sp))
+                break;
+        }
+        if(result < 0)
+            break;
     }
-    return 0;
+    
+    winx_readq_close(q);
+    return (result < 0) ? (-1) : 0;
 }
 
-/* ancillary structure used by build_file_path routine */
-typedef struct _path_parts {
-    wchar_t child[MAX_PATH];   /* already gathered part of the path */
-    wchar_t buffer[MAX_PATH];  /* ancillary buffer */
-} path_parts;
-
-static void build_file_path(winx_file_info *f,file_entry *f_array,
-    unsigned long n_entries,path_parts *p,mft_scan_parameters *sp)
-{
-    ULONGLONG mft_id,parent_mft_id;
-    int full_path_retrieved = 0;
-    wchar_t *parent_path,*src;
-    
-    /* initialize p->child by filename */
-    wcsncpy(p->child,f->name,MAX_PATH - 1);
-    p->child[MAX_PATH - 1] = 0;
-    
-    /* loop through parent directories */
-    parent_mft_id = f->internal.ParentDirectoryMftId;
-    while(parent_mft_id != FILE_root && !full_path_retrieved){
-        if(ftw_ntfs_check_for_termination(sp)) return;
-        mft_id = parent_mft_id;
-        full_path_retrieved = get_directory_information(mft_id,
-            &parent_path,&parent_mft_id,f_array,n_entries,sp);
-        if(parent_path)
-            _snwprintf(p->buffer,MAX_PATH,L"%ws\\%ws",parent_path,p->child);
-        else
-            _snwprintf(p->buffer,MAX_PATH,L"\\%ws",p->child);
-        p->buffer[MAX_PATH - 1] = 0;
-        wcscpy(p->child,p->buffer);
-    }
-    
-    /* append root directory path, if not appended yet */
-    if(p->child[1] == '?'){
-        src = p->child;
-    } else {
-        _snwprintf(p->buffer,MAX_PATH,L"\\??\\%c:\\%ws",sp->volume_letter,p->child);
-        p->buffer[MAX_PATH - 1] = 0;
-        src = p->buffer;
-    }
+/**
+ * @brief Analyzes all file records of
+ * sp->first_mft_id to sp->end_mft_id range.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+static int scan_mft_range(mft_scan_parameters *sp)
+{
+    NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob;
+    int result;
     
-    /* update f->path */
-    f->path = winx_wcsdup(src);
-    if(f->path == NULL){
+    /* allocate memory */
+    nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
+    if(nfrob == NULL){
         etrace("cannot allocate %u bytes of memory",
-            (wcslen(src) + 1) * sizeof(wchar_t));
-        sp->errors ++;
-        return;
+            sp->ml.file_record_buffer_size);
+        return (-1);
     }
+    RtlZeroMemory(nfrob,sp->ml.file_record_buffer_size);
+    
+    /* scan all file records sequentially */
+    result = scan_mft_chunks(nfrob,sp);
+    if(result > 0)
+        result = scan_mft_records(nfrob,sp);
 
-    //trace(D"%ws",f->path);
+    winx_free(nfrob);
+    return result;
+}
+
+static DWORD WINAPI scan_mft_shard_thread(LPVOID p)
+{
+    mft_scan_shard *shard = (mft_scan_shard *)p;
+    
+    shard->result = scan_mft_range(&shard->sp);
+    (void)NtSetEvent(shard->hDone,NULL);
+    winx_exit_thread(0);
+    return 0;
 }
 
 /**
- * @todo This procedure eats lots of CPU tacts,
- * optimize it for speed or run with thread priority
- * below normal.
+ * @brief Inserts a list of files
+ * in front of another list.
  */
-static int build_full_paths(mft_scan_parameters *sp)
+static void insert_file_list(winx_file_info **filelist,winx_file_info *files)
 {
-    path_parts *p;
-    file_entry *f_array = NULL;
-    unsigned long n_entries = 0;
-    winx_file_info *f;
-    ULONG i;
-    ULONGLONG time;
-    
-    itrace("build_full_paths started...");
-    time = winx_xtime();
+    winx_file_info *last;
     
-    /* allocate memory */
-    p = winx_malloc(sizeof(path_parts));
+    if(files == NULL)
+        return;
+    if(*filelist){
+        last = files->prev;
+        files->prev = (*filelist)->prev;
+        (*filelist)->prev->next = files;
+        last->next = *filelist;
+        (*filelist)->prev = last;
+    }
+    *filelist = files;
+}
 
-    /* prepare data for fast binary search */
-    for(f = *sp->filelist; f != NULL; f = f->next){
-        n_entries++;
-        if(f->next == *sp->filelist) break;
+/**
+ * @internal
+ * @brief Calls the progress callback
+ * for all files of a shard scanned.
+ */
+static void report_shard(mft_scan_parameters *sp,mft_scan_shard *shard)
+{
+    winx_file_info *f;
+    
+    for(f = shard->filelist; sp->pcb && f != NULL; f = f->next){
+        sp->pcb(f,sp->user_defined_data);
+        if(f->next == shard->filelist) break;
     }
+    shard->reported = 1;
+}
 
-    if(n_entries){
-        f_array = winx_tmalloc(n_entries * sizeof(file_entry));
-        if(f_array == NULL){
-            etrace("cannot allocate %u bytes of memory",
-                n_entries * sizeof(file_entry));
+/**
+ * @internal
+ * @brief Calls the progress callback for the
+ * files of each shard as soon as it is scanned,
+ * so that the caller gets to work on them while
+ * other shards are still being scanned.
+ * @details Shards left over on failure get
+ * reported while merging.
+ */
+static void report_shards(mft_scan_parameters *sp,mft_scan_shard *shards,int n)
+{
+    HANDLE events[MFT_MAX_SHARDS];
+    int index[MFT_MAX_SHARDS];
+    NTSTATUS status;
+    int i, pending = 0;
+    
+    for(i = 0; i < n; i++){
+        if(shards[i].hDone){
+            events[pending] = shards[i].hDone;
+            index[pending] = i;
+            pending ++;
+        } else {
+            /* scanned by the calling thread already */
+            report_shard(sp,&shards[i]);
+        }
+    }
+    while(pending > 0){
+        status = NtWaitForMultipleObjects(pending,events,WaitAny,FALSE,NULL);
+        if(status < STATUS_WAIT_0 || status >= STATUS_WAIT_0 + pending){
+            strace(status,"cannot wait for shards");
+            return;
         }
+        i = status - STATUS_WAIT_0;
+        report_shard(sp,&shards[index[i]]);
+        pending --;
+        events[i] = events[pending];
+        index[i] = index[pending];
     }
+}
 
-    if(f_array){
-        /* fill array */
-        i = 0;
-        for(f = *sp->filelist; f != NULL; f = f->next){
-            f_array[i].mft_id = f->internal.BaseMftId;
-            f_array[i].f = f;
-            if(i == (n_entries - 1)){ 
-                if(f->next != *sp->filelist)
-                    etrace("???");
-                break;
-            }
-            i++;
-            if(f->next == *sp->filelist) break;
+/**
+ * @brief Analyzes all file records, splitting
+ * them in ranges (shards) analyzed by threads
+ * of their own, one per processor.
+ * @details Each shard has its own copy of
+ * the scan parameters and its own list of
+ * files. The lists are merged in mft index
+ * order then, the last shard first, so that
+ * the file list ends up the same as if all
+ * the records were scanned by a single thread.
+ * Small volumes are scanned by the calling
+ * thread only.
+ * @return Zero for success,
+ * negative value otherwise.
+ */
+static int scan_mft_shards(mft_scan_parameters *sp)
+{
+    mft_scan_shard *shards;
+    ULONGLONG shard_size, align;
+    NTSTATUS status;
+    int n, i, result = 0;
+    
+    sp->first_mft_id = 0;
+    sp->end_mft_id = sp->ml.number_of_file_records;
+    sp->queue_depth = MFT_READ_QUEUE_DEPTH;
+    
+    n = (int)NtCurrentTeb()->Peb->NumberOfProcessors;
+    if(n > MFT_MAX_SHARDS) n = MFT_MAX_SHARDS;
+    if(sp->ml.number_of_file_records / MFT_SHARD_MIN_RECORDS < (ULONGLONG)n)
+        n = (int)(sp->ml.number_of_file_records / MFT_SHARD_MIN_RECORDS);
+    if(n < 2)
+        return scan_mft_range(sp);
+    
+    shards = winx_tmalloc(n * sizeof(mft_scan_shard));
+    if(shards == NULL){
+        etrace("cannot allocate %u bytes of memory",
+            n * sizeof(mft_scan_shard));
+        return scan_mft_range(sp);
+    }
+    RtlZeroMemory(shards,n * sizeof(mft_scan_shard));
+    
+    /* shards consist of whole chunks of $Mft */
+    align = MFT_READ_CHUNK_SIZE / sp->ml.file_record_size;
+    shard_size = sp->ml.number_of_file_records / n;
+    shard_size = (shard_size + align - 1) / align * align;
+    itrace("mft will be scanned in %u shards of %I64u records",n,shard_size);
+    
+    for(i = 0; i < n; i++){
+        shards[i].sp = *sp;
+        shards[i].sp.filelist = &shards[i].filelist;
+        shards[i].sp.pcb = NULL; /* called as shards get done */
+        shards[i].sp.processed_attr_list_entries = 0;
+        shards[i].sp.errors = 0;
+        shards[i].sp.stream_index = NULL;
+        shards[i].sp.stream_index_size = 0;
+        shards[i].sp.first_mft_id = min(i * shard_size,sp->ml.number_of_file_records);
+        shards[i].sp.end_mft_id = min((i + 1) * shard_size,sp->ml.number_of_file_records);
+        if(i == n - 1) shards[i].sp.end_mft_id = sp->ml.number_of_file_records;
+        shards[i].sp.queue_depth = max(MFT_READ_QUEUE_DEPTH / n,2);
+        
+        /* arenas are not thread safe */
+        shards[i].sp.arena = winx_arena_create(FILE_ARENA_CHUNK_SIZE);
+        shards[i].sp.block_arena = winx_arena_create(FILE_ARENA_CHUNK_SIZE);
+        if(shards[i].sp.arena == NULL || shards[i].sp.block_arena == NULL){
+            etrace("cannot create arena for shard %u",i);
+            winx_arena_destroy(shards[i].sp.arena);
+            winx_arena_destroy(shards[i].sp.block_arena);
+            shards[i].sp.arena = sp->arena;
+            shards[i].sp.block_arena = sp->block_arena;
+        }
+        
+        /* don't wait for other shards reading through the same handle,
+           shards left with the shared one are scanned here */
+        shards[i].sp.f_volume = winx_fopen(sp->path,"r");
+        if(shards[i].sp.f_volume == NULL){
+            etrace("cannot open volume for shard %u",i);
+            shards[i].sp.f_volume = sp->f_volume;
+        }
+        
+        status = NtCreateEvent(&shards[i].hDone,
+            STANDARD_RIGHTS_ALL | 0x1ff,NULL,NotificationEvent,FALSE);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot create event");
+            shards[i].hDone = NULL;
+        }
+        if(shards[i].hDone == NULL || shards[i].sp.arena == sp->arena || \
+          shards[i].sp.f_volume == sp->f_volume || \
+          winx_create_thread(scan_mft_shard_thread,(LPVOID)&shards[i]) < 0){
+            /* scan the shard here then */
+            shards[i].result = scan_mft_range(&shards[i].sp);
+            NtCloseSafe(shards[i].hDone);
         }
-        itrace("fast binary search will be used");
-    } else {
-        itrace("slow linear search will be used");
     }
     
-    for(f = *sp->filelist; f != NULL; f = f->next){
-        if(ftw_ntfs_check_for_termination(sp)) break;
-        build_file_path(f,f_array,n_entries,p,sp);
-        if(f->next == *sp->filelist) break;
+    if(sp->pcb)
+        report_shards(sp,shards,n);
+    
+    /* merge the lists, the last shard first */
+    for(i = n - 1; i >= 0; i--){
+        if(shards[i].hDone){
+            (void)NtWaitForSingleObject(shards[i].hDone,FALSE,NULL);
+            NtCloseSafe(shards[i].hDone);
+        }
+        if(shards[i].sp.f_volume != sp->f_volume)
+            winx_fclose(shards[i].sp.f_volume);
+        winx_free(shards[i].sp.stream_index);
+        if(shards[i].sp.arena != sp->arena){
+            winx_arena_merge(sp->arena,shards[i].sp.arena);
+            winx_arena_merge(sp->block_arena,shards[i].sp.block_arena);
+        }
+        if(shards[i].result < 0)
+            result = -1;
+        sp->errors += shards[i].sp.errors;
+        sp->processed_attr_list_entries += shards[i].sp.processed_attr_list_entries;
+        
+        if(!shards[i].reported)
+            report_shard(sp,&shards[i]);
+        insert_file_list(sp->filelist,shards[i].filelist);
     }
     
-    /* free allocated resources */
-    winx_free(f_array);
-    winx_free(p);
-    itrace("build_full_paths completed in %I64u ms",winx_xtime() - time);
-    return 0;
+    winx_free(shards);
+    return result;
 }
 
-/*
-**************************************************
-*       NTFS scan entry point and helpers
-**************************************************
-*/
-
 /**
  * @brief Scans entire MFT and adds
  * all files found to the file list.
@@ -1611,10 +2598,7 @@ static int build_full_paths(mft_scan_parameters *sp)
  */
 static int scan_mft(mft_scan_parameters *sp)
 {
-    NTFS_FILE_RECORD_OUTPUT_BUFFER *nfrob;
     ULONGLONG start_time;
-    ULONGLONG mft_id, ret_mft_id;
-    NTSTATUS status;
     int result;
     
     itrace("mft scan started");
@@ -1632,46 +2616,9 @@ fail:
         return (-1);
     }
 
-    /* allocate memory */
-    nfrob = winx_tmalloc(sp->ml.file_record_buffer_size);
-    if(nfrob == NULL){
-        etrace("cannot allocate %u bytes of memory",
-            sp->ml.file_record_buffer_size);
-        return (-1);
-    }
-    
-    /* scan all file records sequentially */
-    mft_id = sp->ml.number_of_file_records - 1;
-    sp->mft_scan_direction = MFT_SCAN_RTL;
-    while(!ftw_ntfs_check_for_termination(sp)){
-        status = get_file_record(mft_id,nfrob,sp);
-        if(!NT_SUCCESS(status)){
-            if(mft_id == 0){
-                strace(status,"get_file_record for $Mft failed");
-                winx_free(nfrob);
-                goto fail;
-            }
-            /* it returns 0xc000000d (invalid parameter) for non existing records */
-            mft_id --; /* try to retrieve a previous record */
-            continue;
-        }
-
-        /* analyze file record */
-        ret_mft_id = GetMftIdFromFRN(nfrob->FileReferenceNumber.QuadPart);
-        //trace(D"NTFS record found, id = %I64u",ret_mft_id);
-        analyze_file_record(nfrob,sp);
-
-        /* go to the next record */
-        if(ret_mft_id == 0 || mft_id == 0)
-            break;
-        if(ret_mft_id > mft_id){
-            /* avoid infinite loops */
-            etrace("returned file record index is above expected");
-            mft_id --;
-        } else {
-            mft_id = ret_mft_id - 1;
-        }
-    }
+    /* scan all file records */
+    if(scan_mft_shards(sp) < 0)
+        goto fail;
 
     itrace("%u attribute list entries have been processed totally",
         sp->processed_attr_list_entries);
@@ -1681,8 +2628,6 @@ fail:
     /* build full paths */
     result = build_full_paths(sp);
 
-    winx_free(nfrob);
-
 #ifdef TEST_NTFS_SCANNER
     dtrace("NTFS SCANNER TEST PASSED");
 #endif
@@ -1695,22 +2640,37 @@ fail:
 /**
  * @brief Scans entire disk and adds
  * all files found to the file list.
+ * @param[in] path the native path of the
+ * volume, or of an image of it if raw is set.
+ * @param[in] raw nonzero value forces mft
+ * to be read directly, without NTFS driver.
  * @return Zero for success, -1 indicates
  * failure, -2 indicates termination requested
  * by caller.
  */
-static int ntfs_scan_disk_helper(char volume_letter,
+static int ntfs_scan_disk_helper(wchar_t *path,
+    char volume_letter, int raw,
     int flags, ftw_filter_callback fcb,
     ftw_progress_callback pcb, ftw_terminator t,
     void *user_defined_data, winx_file_info **filelist)
 {
-    wchar_t path[] = L"\\??\\A:";
     int result;
     mft_scan_parameters sp;
-    winx_file_info *f;
     
     sp.filelist = filelist;
     sp.volume_letter = volume_letter;
+    sp.raw = raw;
+    sp.path = path;
+    sp.mft_runs = NULL;
+    sp.mft_bitmap = NULL;
+    sp.mft_bitmap_size = 0;
+    sp.first_mft_id = 0;
+    sp.end_mft_id = 0;
+    sp.queue_depth = MFT_READ_QUEUE_DEPTH;
+    sp.stream_index = NULL;
+    sp.stream_index_size = 0;
+    sp.n_files = 0;
+    sp.n_streams = 0;
     sp.processed_attr_list_entries = 0;
     sp.errors = 0;
     sp.flags = flags;
@@ -1719,28 +2679,48 @@ static int ntfs_scan_disk_helper(char volume_letter,
     sp.t = t;
     sp.user_defined_data = user_defined_data;
     
+    /* files are released along with the arenas */
+    sp.arena = winx_arena_create(FILE_ARENA_CHUNK_SIZE);
+    sp.block_arena = winx_arena_create(FILE_ARENA_CHUNK_SIZE);
+    if(sp.arena == NULL || sp.block_arena == NULL){
+        etrace("cannot create arena");
+        winx_arena_destroy(sp.arena);
+        winx_arena_destroy(sp.block_arena);
+        return (-1);
+    }
+    sp.list_arena = sp.arena;
+    sp.list_block_arena = sp.block_arena;
+    
     /* open the volume for read access */
-    path[4] = winx_toupper(volume_letter);
     sp.f_volume = winx_fopen(path,"r");
-    if(sp.f_volume == NULL)
+    if(sp.f_volume == NULL){
+        winx_arena_destroy(sp.arena);
+        winx_arena_destroy(sp.block_arena);
         return (-1);
+    }
     
     /* scan mft directly -> add all files to the list */
     result = scan_mft(&sp);
     if(result < 0){
+        winx_list_destroy((list_entry **)(void *)&sp.mft_runs);
+        winx_free(sp.mft_bitmap);
+        winx_free(sp.stream_index);
         winx_fclose(sp.f_volume);
+        if(*filelist == NULL){
+            winx_arena_destroy(sp.arena);
+            winx_arena_destroy(sp.block_arena);
+        }
         return result;
     }
     
-    /* call filter callback for each file found */
-    for(f = *filelist; f != NULL; f = f->next){
-        if(ftw_ntfs_check_for_termination(&sp)) break;
-        validate_blockmap(f);
-        if(fcb) (void)fcb(f,sp.user_defined_data);
-        if(f->next == *filelist) break;
-    }
-    
+    winx_list_destroy((list_entry **)(void *)&sp.mft_runs);
+    winx_free(sp.mft_bitmap);
+    winx_free(sp.stream_index);
     winx_fclose(sp.f_volume);
+    if(*filelist == NULL){
+        winx_arena_destroy(sp.arena);
+        winx_arena_destroy(sp.block_arena);
+    }
     
     if(!(sp.flags & WINX_FTW_ALLOW_PARTIAL_SCAN) && sp.errors)
         return (-1);
@@ -1751,17 +2731,47 @@ static int ntfs_scan_disk_helper(char volume_letter,
 /**
  * @brief winx_scan_disk analog, but
  * optimized for fastest NTFS scan.
- * @note When stop request is sent by the caller,
- * file paths cannot be built, because of missing
- * information about directories not scanned yet.
+ * @note
+ * - When stop request is sent by the caller,
+ *   file paths cannot be built, because of missing
+ *   information about directories not scanned yet.
+ * - The filter callback is called for each stream
+ *   as soon as its file record is analyzed, before
+ *   the paths get built, possibly by several threads
+ *   at once. Streams it returns nonzero for are left
+ *   out of the list, along with their blocks, except
+ *   of entries of directories needed to build paths.
  */
 winx_file_info *ntfs_scan_disk(char volume_letter,
     int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
     ftw_terminator t, void *user_defined_data)
+{
+    wchar_t path[] = L"\\??\\A:";
+    winx_file_info *filelist = NULL;
+    
+    path[4] = winx_toupper(volume_letter);
+    if(ntfs_scan_disk_helper(path,volume_letter,0,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+      !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
+        /* destroy list */
+        winx_ftw_release(filelist);
+        return NULL;
+    }
+        
+    return filelist;
+}
+
+/**
+ * @brief ntfs_scan_disk analog, but reading
+ * mft records directly from the volume or from
+ * an image of it, instead of asking NTFS driver.
+ */
+winx_file_info *ntfs_scan_image(wchar_t *path,char volume_letter,
+    int flags, ftw_filter_callback fcb, ftw_progress_callback pcb, 
+    ftw_terminator t, void *user_defined_data)
 {
     winx_file_info *filelist = NULL;
     
-    if(ntfs_scan_disk_helper(volume_letter,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
+    if(ntfs_scan_disk_helper(path,volume_letter,1,flags,fcb,pcb,t,user_defined_data,&filelist) == (-1) && \
       !(flags & WINX_FTW_ALLOW_PARTIAL_SCAN)){
         /* destroy list */
         winx_ftw_release(filelist);
@@ -50,41 +50,48 @@ list_entry *winx_list_insert(list_entry **phead,list_entry *prev,long size)
         return NULL;
 
     new_item = (list_entry *)winx_malloc(size);
+    winx_list_attach(phead,prev,new_item);
+    return new_item;
+}
 
+/**
+ * @brief Inserts an item allocated
+ * by the caller to a double linked list.
+ * @param[in,out] phead pointer to a variable pointing to the list head.
+ * @param[in] prev pointer to an item preceeding to the new item.
+ * If this parameter is NULL, the new head will be inserted.
+ * @param[in] item pointer to the item to be inserted.
+ */
+void winx_list_attach(list_entry **phead,list_entry *prev,list_entry *item)
+{
     /* is list empty? */
     if(*phead == NULL){
-        *phead = new_item;
-        new_item->prev = new_item->next = new_item;
-        return new_item;
+        *phead = item;
+        item->prev = item->next = item;
+        return;
     }
 
     /* insert as the new head? */
     if(prev == NULL){
         prev = (*phead)->prev;
-        *phead = new_item;
+        *phead = item;
     }
 
     /* insert after the item specified by prev argument */
-    new_item->prev = prev;
-    new_item->next = prev->next;
-    new_item->prev->next = new_item;
-    new_item->next->prev = new_item;
-    return new_item;
+    item->prev = prev;
+    item->next = prev->next;
+    item->prev->next = item;
+    item->next->prev = item;
 }
 
 /**
- * @brief Removes an item from a double linked list.
- * @details Frees memory allocated for the item to be removed.
+ * @brief Removes an item from a double
+ * linked list, without freeing it.
  * @param[in,out] phead pointer to a variable pointing to the list head.
  * @param[in] item pointer to the item which must be removed.
  */
-void winx_list_remove(list_entry **phead,list_entry *item)
+void winx_list_detach(list_entry **phead,list_entry *item)
 {
-    /*
-    * Avoid winx_dbg_xxx calls here
-    * to avoid recursion.
-    */
-
     /* validate the item */
     if(item == NULL) return;
     
@@ -93,7 +100,6 @@ void winx_list_remove(list_entry **phead,list_entry *item)
 
     /* remove alone first item? */
     if(item == *phead && item->next == *phead){
-        winx_free(item);
         *phead = NULL;
         return;
     }
@@ -104,6 +110,28 @@ void winx_list_remove(list_entry **phead,list_entry *item)
     }
     item->prev->next = item->next;
     item->next->prev = item->prev;
+}
+
+/**
+ * @brief Removes an item from a double linked list.
+ * @details Frees memory allocated for the item to be removed.
+ * @param[in,out] phead pointer to a variable pointing to the list head.
+ * @param[in] item pointer to the item which must be removed.
+ */
+void winx_list_remove(list_entry **phead,list_entry *item)
+{
+    /*
+    * Avoid winx_dbg_xxx calls here
+    * to avoid recursion.
+    */
+
+    /* validate the item */
+    if(item == NULL) return;
+    
+    /* is list empty? */
+    if(*phead == NULL) return;
+
+    winx_list_detach(phead,item);
     winx_free(item);
 }
 
@@ -125,6 +125,195 @@ void winx_heap_free(void *addr)
 #endif
 }
 
+/**
+ * @internal
+ * @brief A chunk of memory of an arena.
+ */
+typedef struct _winx_arena_chunk {
+    struct _winx_arena_chunk *next; /* the chunk allocated before */
+    size_t size;                    /* size of the chunk, in bytes, header included */
+    size_t used;                    /* number of bytes in use, header included */
+} winx_arena_chunk;
+
+struct _winx_arena {
+    winx_arena_chunk *chunks;       /* the chunk in use first */
+    size_t chunk_size;              /* size of regular chunks, in bytes */
+};
+
+/* blocks allocated from arenas are aligned like the heap ones */
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(n) (((n) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1))
+#define ARENA_HEADER_SIZE ARENA_ALIGN(sizeof(winx_arena_chunk))
+
+/**
+ * @brief Creates an arena, i.e. a memory pool
+ * which hands out blocks from big chunks of
+ * memory, all released at once.
+ * @details Arenas are much cheaper than the heap
+ * for lots of small blocks living equally long,
+ * like those describing files of a volume.
+ * They are not thread safe.
+ * @param[in] chunk_size the size of the chunks
+ * allocated from the heap, in bytes.
+ * @return Pointer to the arena, NULL
+ * indicates failure.
+ */
+winx_arena *winx_arena_create(size_t chunk_size)
+{
+    winx_arena *arena;
+    
+    arena = winx_tmalloc(sizeof(winx_arena));
+    if(arena == NULL)
+        return NULL;
+    arena->chunks = NULL;
+    arena->chunk_size = ARENA_ALIGN(chunk_size);
+    return arena;
+}
+
+/**
+ * @brief Allocates a block of memory from an arena.
+ * @details Blocks cannot be released one by one,
+ * they get released along with the arena.
+ * @param[in] arena pointer to the arena.
+ * @param[in] size the size of the block, in bytes.
+ * @param[in] flags combination of MALLOC_XXX flags
+ * defined in zenwinx.h file.
+ * @return A pointer to the allocated block.
+ * NULL indicates failure.
+ */
+void *winx_arena_alloc(winx_arena *arena,size_t size,int flags)
+{
+    winx_arena_chunk *chunk;
+    size_t chunk_size;
+    void *p;
+    
+    if(arena == NULL)
+        return NULL;
+    
+    size = ARENA_ALIGN(size);
+    chunk = arena->chunks;
+    if(chunk && chunk->size - chunk->used >= size){
+        p = (char *)chunk + chunk->used;
+        chunk->used += size;
+        return p;
+    }
+    
+    /* big blocks get chunks of their own */
+    chunk_size = arena->chunk_size;
+    if(size > chunk_size / 4)
+        chunk_size = ARENA_HEADER_SIZE + size;
+    chunk = winx_heap_alloc(chunk_size,flags);
+    if(chunk == NULL)
+        return NULL;
+    chunk->size = chunk_size;
+    chunk->used = ARENA_HEADER_SIZE + size;
+    
+    /* keep filling the chunk in use if there is room left */
+    if(arena->chunks && chunk_size != arena->chunk_size){
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+    } else {
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+    }
+    return (char *)chunk + ARENA_HEADER_SIZE;
+}
+
+/**
+ * @brief Saves the state of an arena,
+ * to be restored by winx_arena_rewind.
+ * @param[in] arena pointer to the arena.
+ * @param[out] mark pointer to the structure
+ * receiving the state.
+ */
+void winx_arena_mark(winx_arena *arena,winx_arena_state *mark)
+{
+    mark->chunk = arena ? arena->chunks : NULL;
+    mark->next = mark->chunk ? mark->chunk->next : NULL;
+    mark->used = mark->chunk ? mark->chunk->used : 0;
+}
+
+/**
+ * @brief Releases all the blocks allocated
+ * from an arena since winx_arena_mark was
+ * called for it.
+ * @details The chunks allocated since are
+ * in front of the marked one, or between it
+ * and the one following it, if they hold
+ * big blocks.
+ * @param[in] arena pointer to the arena.
+ * @param[in] mark pointer to the state
+ * saved by winx_arena_mark.
+ * @note The arena must not be merged
+ * with another one in between.
+ */
+void winx_arena_rewind(winx_arena *arena,winx_arena_state *mark)
+{
+    winx_arena_chunk *chunk, *next;
+
+    if(arena == NULL)
+        return;
+
+    for(chunk = arena->chunks; chunk != mark->chunk; chunk = next){
+        next = chunk->next;
+        winx_free(chunk);
+    }
+    if(chunk){
+        for(chunk = chunk->next; chunk != mark->next; chunk = next){
+            next = chunk->next;
+            winx_free(chunk);
+        }
+        mark->chunk->next = mark->next;
+        mark->chunk->used = mark->used;
+    }
+    arena->chunks = mark->chunk;
+}
+
+/**
+ * @brief Moves all the blocks of an arena
+ * to another one, then destroys the former.
+ * @param[in] arena pointer to the arena
+ * receiving the blocks.
+ * @param[in] other pointer to the arena
+ * to be merged into the first one.
+ */
+void winx_arena_merge(winx_arena *arena,winx_arena *other)
+{
+    winx_arena_chunk *last;
+    
+    if(arena == NULL || other == NULL || arena == other)
+        return;
+    
+    /* the chunk in use stays the first one */
+    if(arena->chunks == NULL){
+        arena->chunks = other->chunks;
+    } else if(other->chunks){
+        for(last = other->chunks; last->next; last = last->next) {}
+        last->next = arena->chunks->next;
+        arena->chunks->next = other->chunks;
+    }
+    winx_free(other);
+}
+
+/**
+ * @brief Destroys an arena, releasing
+ * all the blocks allocated from it.
+ * @param[in] arena pointer to the arena.
+ */
+void winx_arena_destroy(winx_arena *arena)
+{
+    winx_arena_chunk *chunk, *next;
+    
+    if(arena == NULL)
+        return;
+    
+    for(chunk = arena->chunks; chunk; chunk = next){
+        next = chunk->next;
+        winx_free(chunk);
+    }
+    winx_free(arena);
+}
+
 /**
  * @internal
  * @brief Creates global memory heap.
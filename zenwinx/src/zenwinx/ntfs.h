@@ -271,8 +271,36 @@ typedef struct {
     USHORT AttributeNumber;        /* A numeric identifier for the instance of the attribute. */
     USHORT AlignmentOrReserved[3]; /* optional? */
 } ATTRIBUTE_LIST, *PATTRIBUTE_LIST;
+
+/*
+* Boot sector, used to locate the MFT when the volume
+* or an image of it is read directly, without NTFS.
+*/
+typedef struct {
+    UCHAR Jump[3];
+    UCHAR OemId[8];                  /* "NTFS    " */
+    USHORT BytesPerSector;           /* The size of a sector, in bytes. */
+    UCHAR SectorsPerCluster;         /* Values above 0x80 mean 2^(256 - value) sectors. */
+    UCHAR Unused1[7];
+    UCHAR MediaDescriptor;
+    UCHAR Unused2[18];
+    ULONGLONG TotalSectors;          /* The number of sectors in the volume. */
+    ULONGLONG MftStartLcn;           /* The cluster containing the first MFT record. */
+    ULONGLONG Mft2StartLcn;          /* The cluster containing the first $MFTMirr record. */
+    CHAR ClustersPerFileRecord;      /* Negative values mean 2^(-value) bytes. */
+    UCHAR Unused3[3];
+    CHAR ClustersPerIndexBlock;      /* Negative values mean 2^(-value) bytes. */
+    UCHAR Unused4[3];
+    ULONGLONG VolumeSerialNumber;
+    ULONG Checksum;
+    UCHAR BootCode[426];
+    USHORT EndMarker;                /* 0xaa55 */
+} NTFS_BOOT_SECTOR, *PNTFS_BOOT_SECTOR;
 #pragma pack(pop)
 
+/* update sequence arrays protect each 512 bytes of a multisector record */
+#define NTFS_USA_BLOCK_SIZE 512
+
 #ifndef FSCTL_GET_NTFS_VOLUME_DATA
 #define FSCTL_GET_NTFS_VOLUME_DATA      CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 25, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #endif
@@ -192,6 +192,12 @@ typedef LPOSVERSIONINFOW PRTL_OSVERSIONINFOW;
 #ifndef STATUS_VARIABLE_NOT_FOUND
 #define STATUS_VARIABLE_NOT_FOUND     ((NTSTATUS)0xC0000100)
 #endif
+#ifndef STATUS_FILE_CORRUPT_ERROR
+#define STATUS_FILE_CORRUPT_ERROR     ((NTSTATUS)0xC0000102)
+#endif
+#ifndef STATUS_NOT_SUPPORTED
+#define STATUS_NOT_SUPPORTED          ((NTSTATUS)0xC00000BB)
+#endif
 #ifndef STATUS_WAIT_0
 #define STATUS_WAIT_0                 ((NTSTATUS)0x00000000)
 #endif
@@ -241,6 +247,7 @@ typedef LPOSVERSIONINFOW PRTL_OSVERSIONINFOW;
 
 #define FILE_SYNCHRONOUS_IO_NONALERT    0x00000020
 #define FILE_OPEN_FOR_BACKUP_INTENT     0x00004000
+#define FILE_OPEN_BY_FILE_ID            0x00002000
 #define FILE_NON_DIRECTORY_FILE         0x00000040
 /* Windows 7 and later */
 #define FILE_DISALLOW_EXCLUSIVE         0x00020000
@@ -274,6 +281,11 @@ typedef enum _EVENT_TYPE {
   SynchronizationEvent
 } EVENT_TYPE, *PEVENT_TYPE;
 
+typedef enum _WAIT_TYPE {
+    WaitAll,
+    WaitAny
+} WAIT_TYPE;
+
 typedef enum _SECTION_INHERIT {
     ViewShare = 1,
     ViewUnmap = 2
@@ -726,6 +738,8 @@ typedef struct _RTL_HEAP_DEFINITION {
 #define FSCTL_GET_RETRIEVAL_POINTERS    CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 28, METHOD_NEITHER,  FILE_ANY_ACCESS) // STARTING_VCN_INPUT_BUFFER, RETRIEVAL_POINTERS_BUFFER
 #define FSCTL_MOVE_FILE                 CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 29, METHOD_BUFFERED, FILE_SPECIAL_ACCESS) // MOVE_FILE_DATA,
 #define FSCTL_IS_VOLUME_DIRTY           CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 30, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_READ_USN_JOURNAL          CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 46, METHOD_NEITHER,  FILE_ANY_ACCESS) // READ_USN_JOURNAL_DATA, USN
+#define FSCTL_QUERY_USN_JOURNAL         CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 61, METHOD_BUFFERED, FILE_ANY_ACCESS) // USN_JOURNAL_DATA
 
 #if 0
 #define VOLUME_IS_DIRTY  1
@@ -1312,6 +1326,7 @@ NTSTATUS    NTAPI    NtSetValueKey(HANDLE,PUNICODE_STRING,SIZE_T,SIZE_T,PVOID,SI
 NTSTATUS    NTAPI    NtShutdownSystem(SHUTDOWN_ACTION);
 NTSTATUS    NTAPI    NtTerminateProcess(HANDLE,SIZE_T);
 NTSTATUS    NTAPI    NtWaitForSingleObject(HANDLE,SIZE_T,const LARGE_INTEGER*);
+NTSTATUS    NTAPI    NtWaitForMultipleObjects(ULONG,const HANDLE*,WAIT_TYPE,BOOLEAN,const LARGE_INTEGER*);
 NTSTATUS    NTAPI    NtWriteFile(HANDLE,HANDLE,PIO_APC_ROUTINE,PVOID,PIO_STATUS_BLOCK,PVOID,SIZE_T,PLARGE_INTEGER,PULONG);
 NTSTATUS    NTAPI    NtUnloadDriver(PUNICODE_STRING);
 NTSTATUS    NTAPI    NtUnmapViewOfSection(HANDLE,PVOID);
@@ -0,0 +1,323 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+/* Written by Nils Maier in 2014. */
+
+/**
+ * @file readq.c
+ * @brief Read queues.
+ * @details A read queue reads a list of file
+ * (or volume) regions in large chunks, keeping
+ * several overlapped requests in flight, so that
+ * large sequential reads are bound by the disk
+ * bandwidth rather than by the latency of each
+ * single request. Chunks are delivered in the
+ * order they have been queued.
+ * @addtogroup ReadQueues
+ * @{
+ */
+
+#include "ntndk.h"
+#include "zenwinx.h"
+
+typedef struct _readq_range {
+    struct _readq_range *next;
+    struct _readq_range *prev;
+    ULONGLONG offset;
+    ULONG length;
+    ULONGLONG key;
+} readq_range;
+
+typedef struct _readq_request {
+    char *buffer;         /* chunk_size bytes, page aligned */
+    HANDLE hEvent;        /* signaled on completion */
+    IO_STATUS_BLOCK iosb;
+    LARGE_INTEGER offset;
+    ULONG length;
+    ULONGLONG key;
+    int pending;          /* nonzero while issued and not delivered yet */
+} readq_request;
+
+struct _WINX_READQ {
+    HANDLE hFile;
+    int flags;
+    int depth;                /* number of requests */
+    ULONG chunk_size;
+    readq_range *ranges;      /* ranges not issued yet */
+    readq_request *requests;  /* ring of requests */
+    int head;                 /* the oldest request */
+    int delivered;            /* the request delivered last, or -1 */
+};
+
+static void free_buffer(char *buffer)
+{
+    SIZE_T size = 0;
+
+    if(buffer)
+        (void)NtFreeVirtualMemory(NtCurrentProcess(),(PVOID *)&buffer,&size,MEM_RELEASE);
+}
+
+/**
+ * @brief Opens a read queue.
+ * @param[in] path the native path of the file
+ * or the volume to be read.
+ * @param[in] depth the maximum number of
+ * requests in flight.
+ * @param[in] chunk_size the maximum length of
+ * a single request, in bytes.
+ * @param[in] flags combination of WINX_READQ_xxx flags.
+ * @return Pointer to the queue, NULL indicates failure.
+ * @note
+ * - With WINX_READQ_UNBUFFERED, offsets and lengths
+ *   must be integrals of the sector size.
+ * - If the file cannot be opened for overlapped i/o,
+ *   the queue falls back to synchronous reads, one
+ *   at a time.
+ */
+WINX_READQ *winx_readq_open(const wchar_t *path,int depth,ULONG chunk_size,int flags)
+{
+    UNICODE_STRING us;
+    OBJECT_ATTRIBUTES oa;
+    IO_STATUS_BLOCK iosb;
+    NTSTATUS status;
+    WINX_READQ *q;
+    SIZE_T size;
+    ULONG options;
+    int i;
+
+    DbgCheck2(path,chunk_size,NULL);
+
+    if(depth < 1 || (flags & WINX_READQ_SYNC)) depth = 1;
+
+    q = winx_tmalloc(sizeof(WINX_READQ));
+    if(q == NULL){
+        mtrace();
+        return NULL;
+    }
+    RtlZeroMemory(q,sizeof(WINX_READQ));
+    q->flags = flags;
+    q->chunk_size = chunk_size;
+    q->delivered = -1;
+
+    RtlInitUnicodeString(&us,path);
+    InitializeObjectAttributes(&oa,&us,OBJ_CASE_INSENSITIVE,NULL,NULL);
+    /* volumes cannot be opened as non directory files */
+    options = 0;
+    if(flags & WINX_READQ_UNBUFFERED)
+        options |= FILE_NO_INTERMEDIATE_BUFFERING;
+    status = STATUS_UNSUCCESSFUL;
+    if(!(flags & WINX_READQ_SYNC)){
+        status = NtCreateFile(&q->hFile,FILE_GENERIC_READ,&oa,&iosb,NULL,
+            FILE_ATTRIBUTE_NORMAL,FILE_SHARE_READ | FILE_SHARE_WRITE,
+            FILE_OPEN,options,NULL,0);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot open %ws for overlapped i/o",path);
+            q->flags |= WINX_READQ_SYNC;
+            depth = 1;
+        }
+    }
+    if(!NT_SUCCESS(status)){
+        status = NtCreateFile(&q->hFile,FILE_GENERIC_READ,&oa,&iosb,NULL,
+            FILE_ATTRIBUTE_NORMAL,FILE_SHARE_READ | FILE_SHARE_WRITE,
+            FILE_OPEN,options | FILE_SYNCHRONOUS_IO_NONALERT,NULL,0);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot open %ws",path);
+            winx_free(q);
+            return NULL;
+        }
+    }
+
+    q->requests = winx_tmalloc(depth * sizeof(readq_request));
+    if(q->requests == NULL){
+        mtrace();
+        winx_readq_close(q);
+        return NULL;
+    }
+    RtlZeroMemory(q->requests,depth * sizeof(readq_request));
+    q->depth = depth;
+    for(i = 0; i < depth; i++){
+        /* page aligned, as required for unbuffered i/o */
+        size = chunk_size;
+        status = NtAllocateVirtualMemory(NtCurrentProcess(),
+            (PVOID *)&q->requests[i].buffer,0,&size,
+            MEM_COMMIT | MEM_RESERVE,PAGE_READWRITE);
+        if(!NT_SUCCESS(status)){
+            strace(status,"cannot allocate %u bytes of memory",chunk_size);
+            q->requests[i].buffer = NULL;
+            winx_readq_close(q);
+            return NULL;
+        }
+        if(!(q->flags & WINX_READQ_SYNC)){
+            status = NtCreateEvent(&q->requests[i].hEvent,
+                STANDARD_RIGHTS_ALL | 0x1ff,NULL,NotificationEvent,FALSE);
+            if(!NT_SUCCESS(status)){
+                strace(status,"cannot create event");
+                q->requests[i].hEvent = NULL;
+                winx_readq_close(q);
+                return NULL;
+            }
+        }
+    }
+    return q;
+}
+
+/**
+ * @brief Adds a region to the end of a read queue.
+ * @param[in] q the queue.
+ * @param[in] offset the offset of the region, in bytes.
+ * @param[in] length the length of the region, in bytes,
+ * up to the chunk size of the queue.
+ * @param[in] key a value passed back along with the data.
+ * @return Zero for success, negative value otherwise.
+ */
+int winx_readq_add(WINX_READQ *q,ULONGLONG offset,ULONG length,ULONGLONG key)
+{
+    readq_range *r;
+
+    DbgCheck1(q,-1);
+
+    if(length == 0 || length > q->chunk_size){
+        etrace("invalid length %u",length);
+        return (-1);
+    }
+    r = (readq_range *)winx_list_insert((list_entry **)(void *)&q->ranges,
+        q->ranges ? (list_entry *)q->ranges->prev : NULL,sizeof(readq_range));
+    r->offset = offset;
+    r->length = length;
+    r->key = key;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Issues the next queued range
+ * on a free request.
+ * @return Zero for success or if nothing is
+ * left to be issued, negative value otherwise.
+ */
+static int issue(WINX_READQ *q,readq_request *rq)
+{
+    readq_range *r = q->ranges;
+    NTSTATUS status;
+
+    if(r == NULL)
+        return 0;
+    rq->offset.QuadPart = r->offset;
+    rq->length = r->length;
+    rq->key = r->key;
+    rq->iosb.Status = STATUS_PENDING;
+    rq->iosb.Information = 0;
+    winx_list_remove((list_entry **)(void *)&q->ranges,(list_entry *)r);
+
+    status = NtReadFile(q->hFile,rq->hEvent,NULL,NULL,&rq->iosb,
+        rq->buffer,rq->length,&rq->offset,NULL);
+    if(q->flags & WINX_READQ_SYNC){
+        if(NT_SUCCESS(status)){
+            status = NtWaitForSingleObject(q->hFile,FALSE,NULL);
+            if(NT_SUCCESS(status)) status = rq->iosb.Status;
+        }
+        rq->iosb.Status = status;
+    } else if(!NT_SUCCESS(status)){
+        rq->iosb.Status = status;
+    }
+    rq->pending = 1;
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot read %u bytes at %I64u",
+            rq->length,rq->offset.QuadPart);
+        return (-1);
+    }
+    return 0;
+}
+
+/**
+ * @brief Retrieves the next chunk of a read queue.
+ * @param[in] q the queue.
+ * @param[out] buffer pointer to the data, valid
+ * until the next call.
+ * @param[out] offset the offset of the data.
+ * @param[out] length the length of the data.
+ * @param[out] key the key passed to winx_readq_add.
+ * @return Positive value if a chunk has been retrieved,
+ * zero if the queue is empty, negative value on failure.
+ */
+int winx_readq_next(WINX_READQ *q,char **buffer,ULONGLONG *offset,ULONG *length,ULONGLONG *key)
+{
+    readq_request *rq;
+    NTSTATUS status;
+    int i;
+
+    DbgCheck2(q,buffer,-1);
+
+    /* reuse the buffer delivered last */
+    if(q->delivered >= 0){
+        q->requests[q->delivered].pending = 0;
+        q->delivered = -1;
+    }
+
+    /* keep the queue full */
+    for(i = 0; i < q->depth; i++){
+        rq = &q->requests[(q->head + i) % q->depth];
+        if(!rq->pending && issue(q,rq) < 0)
+            return (-1);
+    }
+
+    rq = &q->requests[q->head];
+    if(!rq->pending)
+        return 0;
+
+    status = rq->iosb.Status;
+    if(status == STATUS_PENDING){
+        status = NtWaitForSingleObject(rq->hEvent,FALSE,NULL);
+        if(NT_SUCCESS(status)) status = rq->iosb.Status;
+    }
+    if(!NT_SUCCESS(status)){
+        strace(status,"cannot read %u bytes at %I64u",
+            rq->length,rq->offset.QuadPart);
+        return (-1);
+    }
+    if(rq->iosb.Information && rq->iosb.Information < rq->length){
+        etrace("less bytes read than needed?");
+        return (-1);
+    }
+
+    *buffer = rq->buffer;
+    if(offset) *offset = rq->offset.QuadPart;
+    if(length) *length = rq->length;
+    if(key) *key = rq->key;
+    q->delivered = q->head;
+    q->head = (q->head + 1) % q->depth;
+    return 1;
+}
+
+/**
+ * @brief Closes a read queue, cancelling
+ * all requests still in flight.
+ */
+void winx_readq_close(WINX_READQ *q)
+{
+    IO_STATUS_BLOCK iosb;
+    int i;
+
+    if(q == NULL)
+        return;
+
+    if(q->requests){
+        if(q->hFile && !(q->flags & WINX_READQ_SYNC))
+            (void)NtCancelIoFile(q->hFile,&iosb);
+        for(i = 0; i < q->depth; i++){
+            if(q->requests[i].hEvent){
+                /* the buffer must not be released while in use */
+                if(q->requests[i].pending && q->requests[i].iosb.Status == STATUS_PENDING)
+                    (void)NtWaitForSingleObject(q->requests[i].hEvent,FALSE,NULL);
+                NtClose(q->requests[i].hEvent);
+            }
+            free_buffer(q->requests[i].buffer);
+        }
+        winx_free(q->requests);
+    }
+    winx_list_destroy((list_entry **)(void *)&q->ranges);
+    if(q->hFile)
+        NtClose(q->hFile);
+    winx_free(q);
+}
+
+/** @} */
@@ -462,44 +462,345 @@ int winx_vflush(char volume_letter)
 }
 
 /**
- * @brief Retrieves the list of free regions on the volume.
+ * @internal
+ * @brief USN_JOURNAL_DATA (version 0),
+ * as returned by FSCTL_QUERY_USN_JOURNAL.
+ */
+typedef struct _usn_journal_data {
+    ULONGLONG UsnJournalID;
+    LONGLONG FirstUsn;
+    LONGLONG NextUsn;
+    LONGLONG LowestValidUsn;
+    LONGLONG MaxUsn;
+    ULONGLONG MaximumSize;
+    ULONGLONG AllocationDelta;
+} usn_journal_data;
+
+/**
+ * @brief Retrieves the state of the
+ * change journal of a volume.
  * @param[in] volume_letter the volume letter.
- * @param[in] flags the combination of WINX_GVR_xxx flags.
+ * @param[out] j pointer to the structure
+ * receiving the journal state.
+ * @return Zero for success, negative value
+ * otherwise, e.g. if the volume has no
+ * active change journal.
+ * @note As long as neither the journal id nor
+ * the next usn changed, no file of the volume
+ * has been changed. Files moved by the defrag
+ * api are not recorded, though.
+ */
+int winx_get_usn_journal(char volume_letter,winx_usn_journal *j)
+{
+    usn_journal_data ujd;
+    WINX_FILE *f;
+    int result;
+
+    DbgCheck1(j,-1);
+
+    f = winx_vopen(volume_letter);
+    if(f == NULL)
+        return (-1);
+    result = winx_ioctl(f,FSCTL_QUERY_USN_JOURNAL,
+        "winx_get_usn_journal: usn journal query",NULL,0,
+        &ujd,sizeof(usn_journal_data),NULL);
+    winx_fclose(f);
+    if(result < 0)
+        return result;
+    j->journal_id = ujd.UsnJournalID;
+    j->first_usn = (ULONGLONG)ujd.FirstUsn;
+    j->next_usn = (ULONGLONG)ujd.NextUsn;
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief READ_USN_JOURNAL_DATA (version 0),
+ * as passed to FSCTL_READ_USN_JOURNAL.
+ */
+typedef struct _read_usn_journal_data {
+    LONGLONG StartUsn;
+    ULONG ReasonMask;
+    ULONG ReturnOnlyOnClose;
+    ULONGLONG Timeout;
+    ULONGLONG BytesToWaitFor;
+    ULONGLONG UsnJournalID;
+} read_usn_journal_data;
+
+/**
+ * @brief Reads records of the change
+ * journal of a volume.
+ * @param[in] f the volume handle,
+ * as returned by winx_vopen.
+ * @param[in] journal_id the journal
+ * instance to be read.
+ * @param[in,out] usn pointer to the usn
+ * of the first record to be read, receives
+ * the usn to continue with.
+ * @param[out] buffer the buffer receiving
+ * the records, USN_RECORD structures
+ * following each other.
+ * @param[in] size the size of the buffer,
+ * in bytes. It should hold a few records
+ * with long names at least.
+ * @return The number of bytes of records
+ * stored in the buffer, zero if no more
+ * records are available. Negative value
+ * indicates failure, e.g. if the records
+ * were purged from the journal already or
+ * the journal got deleted in between.
+ * @note Records of all reasons are returned,
+ * not just those of closed files.
+ */
+int winx_read_usn_journal(WINX_FILE *f,ULONGLONG journal_id,
+    ULONGLONG *usn,void *buffer,int size)
+{
+    read_usn_journal_data rujd;
+    int length = 0;
+    int result;
+
+    DbgCheck3(f,usn,buffer,-1);
+    if(size <= (int)sizeof(ULONGLONG))
+        return (-1);
+
+    memset(&rujd,0,sizeof(read_usn_journal_data));
+    rujd.StartUsn = (LONGLONG)*usn;
+    rujd.ReasonMask = 0xffffffff;
+    rujd.UsnJournalID = journal_id;
+    result = winx_ioctl(f,FSCTL_READ_USN_JOURNAL,
+        "winx_read_usn_journal: usn journal read",
+        &rujd,sizeof(read_usn_journal_data),
+        buffer,size,&length);
+    if(result < 0)
+        return result;
+    if(length < (int)sizeof(ULONGLONG))
+        return (-1);
+
+    /* the records follow the usn to continue with */
+    *usn = *(ULONGLONG *)buffer;
+    length -= sizeof(ULONGLONG);
+    memmove(buffer,(char *)buffer + sizeof(ULONGLONG),length);
+    return length;
+}
+
+/**
+ * @internal
+ * @brief LCN indicating that no free region
+ * is being collected at the moment.
+ */
+#define LLINVALID ((ULONGLONG) -1)
+
+/**
+ * @internal
+ * @brief State of the bitmap to regions conversion.
+ * @details Allows the bitmap to be processed in portions,
+ * as they are returned by FSCTL_GET_VOLUME_BITMAP.
+ */
+typedef struct _bitmap_scan {
+    winx_volume_region *rlist;   /* list of free regions found so far */
+    winx_volume_region *rgn;     /* the last region added to the list */
+    ULONGLONG free_rgn_start;    /* the first cluster of the current free region */
+    volume_region_callback cb;   /* callback to be called for each region */
+    void *user_defined_data;     /* pointer passed to the callback */
+} bitmap_scan;
+
+/**
+ * @internal
+ * @brief Appends the current free region to the list.
+ * @param[in] end the first cluster behind the region.
+ * @return Nonzero value indicates that the
+ * callback requested the scan termination.
+ */
+static int bitmap_scan_add_region(bitmap_scan *bs,ULONGLONG end)
+{
+    bs->rgn = (winx_volume_region *)winx_list_insert((list_entry **)(void *)&bs->rlist,
+        (list_entry *)bs->rgn,sizeof(winx_volume_region));
+    bs->rgn->lcn = bs->free_rgn_start;
+    bs->rgn->length = end - bs->free_rgn_start;
+    bs->free_rgn_start = LLINVALID;
+    if(bs->cb != NULL)
+        return bs->cb(bs->rgn,bs->user_defined_data);
+    return 0;
+}
+
+/**
+ * @internal
+ * @brief Returns the index of the
+ * lowest set bit of a nonzero word.
+ */
+static int lowest_bit(ULONGLONG word)
+{
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#elif defined(_WIN64)
+    unsigned long i;
+    _BitScanForward64(&i,word);
+    return (int)i;
+#else
+    unsigned long i;
+    if(_BitScanForward(&i,(unsigned long)word))
+        return (int)i;
+    _BitScanForward(&i,(unsigned long)(word >> 32));
+    return (int)i + 32;
+#endif
+}
+
+/**
+ * @internal
+ * @brief Searches a bitmap for the first
+ * bit of the given value.
+ * @param[in] map the bitmap.
+ * @param[in] i the index of the bit to start at.
+ * @param[in] n the number of bits in the map.
+ * @param[in] set nonzero to search for a set bit,
+ * zero to search for a clear one.
+ * @return The index of the bit found,
+ * n if there is none.
+ * @note Runs of bits of the other value are
+ * skipped a 64-bit word at a time.
+ */
+static ULONGLONG bitmap_find(const unsigned char *map,
+        ULONGLONG i,ULONGLONG n,int set)
+{
+    ULONGLONG flip = set ? 0 : (ULONGLONG)-1;
+    ULONGLONG base, word;
+
+    for(base = i & ~(ULONGLONG)63; base + 64 <= n; base += 64){
+        /* the map is not necessarily aligned */
+        memcpy(&word,map + base / 8,sizeof(ULONGLONG));
+        word ^= flip;
+        if(base < i)
+            word &= (ULONGLONG)-1 << (i - base);
+        if(word)
+            return base + lowest_bit(word);
+    }
+
+    /* bits behind the last whole word */
+    set = set ? 1 : 0;
+    for(i = max(i,base); i < n; i++){
+        if(((map[i / 8] >> (i % 8)) & 1) == set)
+            return i;
+    }
+    return n;
+}
+
+/**
+ * @internal
+ * @brief Converts a portion of the volume bitmap to free regions.
+ * @param[in] map the bitmap, one bit per cluster, set bits are in use.
+ * @param[in] start the logical cluster number of the first bit.
+ * @param[in] clusters the number of clusters described by the map.
+ * @return Nonzero value indicates that the
+ * callback requested the scan termination.
+ * @note Free regions crossing the end of the portion
+ * are kept open, so that the next portion continues them.
+ */
+static int bitmap_scan_portion(bitmap_scan *bs,const unsigned char *map,
+        ULONGLONG start,ULONGLONG clusters)
+{
+    ULONGLONG i = 0;
+
+    while(i < clusters){
+        if(bs->free_rgn_start == LLINVALID){
+            /* skip clusters in use */
+            i = bitmap_find(map,i,clusters,0);
+            if(i == clusters)
+                break;
+            bs->free_rgn_start = start + i;
+        }
+        /* skip free clusters */
+        i = bitmap_find(map,i,clusters,1);
+        if(i == clusters)
+            break;
+        if(bitmap_scan_add_region(bs,start + i))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Converts a volume bitmap to the list of free regions.
+ * @param[in] map the bitmap, one bit per cluster, set bits
+ * indicate clusters in use (FSCTL_GET_VOLUME_BITMAP layout).
+ * @param[in] start_lcn the logical cluster number of the first bit.
+ * @param[in] clusters the number of clusters described by the map.
  * @param[in] cb the address of the procedure to be called
- * each time when the free region is found on the volume.
+ * each time when the free region is found.
  * If the callback procedure returns nonzero value,
- * the scan terminates immediately.
+ * the conversion terminates immediately.
  * @param[in] user_defined_data pointer to the data
  * passed to the registered callback.
+ * @return List of the free regions, NULL indicates
+ * that there are no free clusters in the map.
+ * @note This is the same routine winx_get_free_volume_regions
+ * relies on, so it may be used to build free regions out of
+ * bitmaps not belonging to a mounted volume.
+ */
+winx_volume_region *winx_bitmap_to_regions(const unsigned char *map,
+        ULONGLONG start_lcn,ULONGLONG clusters,
+        volume_region_callback cb,void *user_defined_data)
+{
+    bitmap_scan bs;
+
+    bs.rlist = bs.rgn = NULL;
+    bs.free_rgn_start = LLINVALID;
+    bs.cb = cb;
+    bs.user_defined_data = user_defined_data;
+
+    if(map == NULL)
+        return NULL;
+
+    if(bitmap_scan_portion(&bs,map,start_lcn,clusters))
+        return bs.rlist;
+    if(bs.free_rgn_start != LLINVALID)
+        (void)bitmap_scan_add_region(&bs,start_lcn + clusters);
+    return bs.rlist;
+}
+
+/* size of the bitmap portions requested from the file system */
+#define BITMAPBYTES (1024 * 1024)
+
+/**
+ * @internal
+ * @brief Retrieves the list of free regions
+ * within a range of clusters of the volume.
+ * @param[in] volume_letter the volume letter.
+ * @param[in] flags the combination of WINX_GVR_xxx flags.
+ * @param[in] start the first cluster of the range.
+ * @param[in] end the cluster behind the range,
+ * LLINVALID stands for the end of the volume.
+ * @param[in] cb the address of the callback.
+ * @param[in] user_defined_data pointer to the data
+ * passed to the callback.
  * @return List of the free regions, NULL indicates that
- * either disk is full (unlikely) or some error occured.
- * @note
- * - It is possible to scan disk partially by
- * requesting the scan termination through the callback
- * procedure.
- * - The callback procedure should complete as quickly
- * as possible to avoid slowdown of the scan.
+ * either there are no free clusters or some error occured.
+ * @note The file system returns the bitmap starting at
+ * a multiple of 8 clusters, and portions are scanned as
+ * a whole, so the list may extend a little beyond the range.
  */
-winx_volume_region *winx_get_free_volume_regions(char volume_letter,
-        int flags, volume_region_callback cb, void *user_defined_data)
+static winx_volume_region *get_free_volume_regions(char volume_letter,
+        int flags,ULONGLONG start,ULONGLONG end,
+        volume_region_callback cb,void *user_defined_data)
 {
-    winx_volume_region *rlist = NULL, *rgn = NULL;
     BITMAP_DESCRIPTOR *bitmap;
-    #define LLINVALID   ((ULONGLONG) -1)
-    #define BITMAPBYTES 4096
-    #define BITMAPSIZE  (BITMAPBYTES + 2 * sizeof(ULONGLONG))
-    /* bit shifting array for efficient processing of the bitmap */
-    unsigned char bitshift[] = { 1, 2, 4, 8, 16, 32, 64, 128 };
     WINX_FILE *f;
-    ULONGLONG i, start, next, free_rgn_start;
+    ULONGLONG clusters, next;
     IO_STATUS_BLOCK iosb;
     NTSTATUS status;
+    bitmap_scan bs;
+    size_t bytes, size;
     
     /* ensure that it will work on w2k */
     volume_letter = winx_toupper(volume_letter);
     
+    /* small ranges need small buffers only */
+    bytes = BITMAPBYTES;
+    if(end != LLINVALID && (end - start) / 8 + 2 < BITMAPBYTES)
+        bytes = (size_t)((end - start) / 8 + 2);
+    size = bytes + 2 * sizeof(ULONGLONG);
+    
     /* allocate memory */
-    bitmap = winx_malloc(BITMAPSIZE);
+    bitmap = winx_malloc(size);
     
     /* open volume */
     f = winx_vopen(volume_letter);
@@ -509,13 +810,17 @@ winx_volume_region *winx_get_free_volume_regions(char volume_letter,
     }
     
     /* get volume bitmap */
-    next = 0, free_rgn_start = LLINVALID;
+    bs.rlist = bs.rgn = NULL;
+    bs.free_rgn_start = LLINVALID;
+    bs.cb = cb;
+    bs.user_defined_data = user_defined_data;
+    next = start, clusters = 0;
     do {
         /* get next portion of the bitmap */
-        memset(bitmap,0,BITMAPSIZE);
+        memset(bitmap,0,size);
         status = NtFsControlFile(winx_fileno(f),NULL,NULL,0,&iosb,
             FSCTL_GET_VOLUME_BITMAP,&next,sizeof(ULONGLONG),
-            bitmap,BITMAPSIZE);
+            bitmap,(ULONG)size);
         if(NT_SUCCESS(status)){
             NtWaitForSingleObject(winx_fileno(f),FALSE,NULL);
             status = iosb.Status;
@@ -525,59 +830,83 @@ winx_volume_region *winx_get_free_volume_regions(char volume_letter,
             winx_fclose(f);
             winx_free(bitmap);
             if(flags & WINX_GVR_ALLOW_PARTIAL_SCAN){
-                return rlist;
+                return bs.rlist;
             } else {
-                winx_list_destroy((list_entry **)(void *)&rlist);
+                winx_list_destroy((list_entry **)(void *)&bs.rlist);
                 return NULL;
             }
         }
         
         /* scan through the returned bitmap info */
-        start = bitmap->StartLcn;
-        for(i = 0; i < min(bitmap->ClustersToEndOfVol, 8 * BITMAPBYTES); i++){
-            if(!(bitmap->Map[ i/8 ] & bitshift[ i % 8 ])){
-                /* cluster is free */
-                if(free_rgn_start == LLINVALID)
-                    free_rgn_start = start + i;
-            } else {
-                /* cluster isn't free */
-                if(free_rgn_start != LLINVALID){
-                    /* add free region to the list */
-                    rgn = (winx_volume_region *)winx_list_insert((list_entry **)(void *)&rlist,
-                        (list_entry *)rgn,sizeof(winx_volume_region));
-                    rgn->lcn = free_rgn_start;
-                    rgn->length = start + i - free_rgn_start;
-                    if(cb != NULL){
-                        if(cb(rgn,user_defined_data))
-                            goto done;
-                    }
-                    free_rgn_start = LLINVALID;
-                }
-            }
-        }
+        clusters = min(bitmap->ClustersToEndOfVol, 8 * (ULONGLONG)bytes);
+        if(bitmap_scan_portion(&bs,bitmap->Map,bitmap->StartLcn,clusters))
+            goto done;
         
         /* go to the next portion of data */
-        next = bitmap->StartLcn + i;
-    } while(status != STATUS_SUCCESS);
+        next = bitmap->StartLcn + clusters;
+    } while(status != STATUS_SUCCESS && next < end);
 
-    if(free_rgn_start != LLINVALID){
+    if(bs.free_rgn_start != LLINVALID){
         /* add free region to the list */
-        rgn = (winx_volume_region *)winx_list_insert((list_entry **)(void *)&rlist,
-            (list_entry *)rgn,sizeof(winx_volume_region));
-        rgn->lcn = free_rgn_start;
-        rgn->length = start + i - free_rgn_start;
-        if(cb != NULL){
-            if(cb(rgn,user_defined_data))
-                goto done;
-        }
-        free_rgn_start = LLINVALID;
+        (void)bitmap_scan_add_region(&bs,next);
     }
 
 done:    
     /* cleanup */
     winx_fclose(f);
     winx_free(bitmap);
-    return rlist;
+    return bs.rlist;
+}
+
+/**
+ * @brief Retrieves the list of free regions on the volume.
+ * @param[in] volume_letter the volume letter.
+ * @param[in] flags the combination of WINX_GVR_xxx flags.
+ * @param[in] cb the address of the procedure to be called
+ * each time when the free region is found on the volume.
+ * If the callback procedure returns nonzero value,
+ * the scan terminates immediately.
+ * @param[in] user_defined_data pointer to the data
+ * passed to the registered callback.
+ * @return List of the free regions, NULL indicates that
+ * either disk is full (unlikely) or some error occured.
+ * @note
+ * - It is possible to scan disk partially by
+ * requesting the scan termination through the callback
+ * procedure.
+ * - The callback procedure should complete as quickly
+ * as possible to avoid slowdown of the scan.
+ */
+winx_volume_region *winx_get_free_volume_regions(char volume_letter,
+        int flags, volume_region_callback cb, void *user_defined_data)
+{
+    return get_free_volume_regions(volume_letter,flags,
+        0,LLINVALID,cb,user_defined_data);
+}
+
+/**
+ * @brief Retrieves the list of free regions
+ * within a range of clusters of the volume.
+ * @param[in] volume_letter the volume letter.
+ * @param[in] lcn the first cluster of the range.
+ * @param[in] length the number of clusters in the range.
+ * @return List of the free regions, NULL indicates that
+ * either there are no free clusters in the range
+ * or some error occured.
+ * @note
+ * - Only the bitmap of the range gets read, which is
+ * much cheaper than winx_get_free_volume_regions
+ * for small ranges.
+ * - Regions are not clipped, so the first and
+ * the last one may extend beyond the range.
+ */
+winx_volume_region *winx_get_free_volume_regions_in_range(char volume_letter,
+        ULONGLONG lcn,ULONGLONG length)
+{
+    if(length == 0)
+        return NULL;
+    return get_free_volume_regions(volume_letter,0,
+        lcn,lcn + length,NULL,NULL);
 }
 
 /**
@@ -158,6 +158,7 @@ void winx_release_file_contents(void *contents);
 #define WINX_FTW_DUMP_FILES             0x2 /* forces to fill winx_file_disposition structure */
 #define WINX_FTW_ALLOW_PARTIAL_SCAN     0x4 /* allows information to be gathered partially */
 #define WINX_FTW_SKIP_RESIDENT_STREAMS  0x8 /* forces to skip files of zero length and files located inside MFT */
+#define WINX_FTW_LAZY_PATHS            0x10 /* leaves paths to be built on demand by winx_ftw_get_path (NTFS only) */
 
 #define is_readonly(f)            ((f)->flags & FILE_ATTRIBUTE_READONLY)
 #define is_hidden(f)              ((f)->flags & FILE_ATTRIBUTE_HIDDEN)
@@ -195,6 +196,10 @@ typedef struct _winx_file_disposition {
 typedef struct _winx_file_internal_info {
     ULONGLONG BaseMftId;
     ULONGLONG ParentDirectoryMftId;
+    struct _winx_file_info *ParentDirectory; /* entry of the parent directory, NULL for the root one */
+    struct _winx_arena *Arena;               /* arena holding the entry, its name and path, NULL if they are on the heap */
+    struct _winx_arena *BlockArena;          /* arena holding the blocks, NULL if they are on the heap */
+    char VolumeLetter;                       /* needed to build paths of files in the root directory */
 } winx_file_internal_info;
 
 /*
@@ -225,10 +230,18 @@ winx_file_info *winx_ftw(wchar_t *path, int flags,
 winx_file_info *winx_scan_disk(char volume_letter, int flags,
         ftw_filter_callback fcb,ftw_progress_callback pcb, ftw_terminator t,void *user_defined_data);
 
+winx_file_info *winx_scan_image(wchar_t *path, char volume_letter, int flags,
+        ftw_filter_callback fcb,ftw_progress_callback pcb, ftw_terminator t,void *user_defined_data);
+
 void winx_ftw_release(winx_file_info *filelist);
 #define winx_scan_disk_release(f) winx_ftw_release(f)
 
 int winx_ftw_dump_file(winx_file_info *f,ftw_terminator t,void *user_defined_data);
+winx_blockmap *winx_ftw_add_block(winx_file_info *f,winx_blockmap *prev);
+void winx_ftw_release_blockmap(winx_file_info *f);
+void winx_ftw_release_blockmaps(winx_file_info *filelist);
+wchar_t *winx_ftw_build_path(winx_file_info *f);
+wchar_t *winx_ftw_get_path(winx_file_info *f);
 
 #define WINX_OPEN_FOR_DUMP       0x1 /* open for FSCTL_GET_RETRIEVAL_POINTERS */
 #define WINX_OPEN_FOR_BASIC_INFO 0x2 /* open for NtQueryInformationFile(FILE_BASIC_INFORMATION) */
@@ -237,6 +250,7 @@ int winx_ftw_dump_file(winx_file_info *f,ftw_terminator t,void *user_defined_dat
 #ifdef _NTNDK_H_
 NTSTATUS winx_defrag_fopen(winx_file_info *f,int action,HANDLE *phandle);
 void winx_defrag_fclose(HANDLE h);
+wchar_t *winx_get_path_by_id(WINX_FILE *f,char volume_letter,ULONGLONG id);
 #endif
 
 /* ftw_ntfs.c */
@@ -258,6 +272,8 @@ typedef struct _list_entry {
 } list_entry;
 
 list_entry *winx_list_insert(list_entry **phead,list_entry *prev,long size);
+void winx_list_attach(list_entry **phead,list_entry *prev,list_entry *item);
+void winx_list_detach(list_entry **phead,list_entry *item);
 void winx_list_remove(list_entry **phead,list_entry *item);
 void winx_list_destroy(list_entry **phead);
 
@@ -302,6 +318,21 @@ void winx_heap_free(void *addr);
 typedef int (*winx_killer)(size_t n);
 void winx_set_killer(winx_killer k);
 
+typedef struct _winx_arena winx_arena;
+
+typedef struct _winx_arena_state {
+    struct _winx_arena_chunk *chunk; /* the chunk in use */
+    struct _winx_arena_chunk *next;  /* the chunk following it */
+    size_t used;                     /* number of bytes in use of the chunk */
+} winx_arena_state;
+
+winx_arena *winx_arena_create(size_t chunk_size);
+void *winx_arena_alloc(winx_arena *arena,size_t size,int flags);
+void winx_arena_mark(winx_arena *arena,winx_arena_state *mark);
+void winx_arena_rewind(winx_arena *arena,winx_arena_state *mark);
+void winx_arena_merge(winx_arena *arena,winx_arena *other);
+void winx_arena_destroy(winx_arena *arena);
+
 /* misc.c */
 void winx_sleep(int msec);
 
@@ -362,6 +393,17 @@ int winx_create_path(wchar_t *path);
 
 int winx_enable_privilege(unsigned long luid);
 
+/* readq.c */
+typedef struct _WINX_READQ WINX_READQ;
+
+#define WINX_READQ_UNBUFFERED 0x1 /* bypass the cache, needs sector aligned reads */
+#define WINX_READQ_SYNC       0x2 /* one request at a time */
+
+WINX_READQ *winx_readq_open(const wchar_t *path,int depth,ULONG chunk_size,int flags);
+int winx_readq_add(WINX_READQ *q,ULONGLONG offset,ULONG length,ULONGLONG key);
+int winx_readq_next(WINX_READQ *q,char **buffer,ULONGLONG *offset,ULONG *length,ULONGLONG *key);
+void winx_readq_close(WINX_READQ *q);
+
 /* reg.c */
 int winx_bootex_check(const wchar_t *command);
 int winx_bootex_register(const wchar_t *command);
@@ -525,6 +567,16 @@ int winx_get_volume_information(char volume_letter,winx_volume_information *v);
 WINX_FILE *winx_vopen(char volume_letter);
 int winx_vflush(char volume_letter);
 
+typedef struct _winx_usn_journal {
+    ULONGLONG journal_id;                  /* identifies the journal instance */
+    ULONGLONG first_usn;                   /* the oldest record still available */
+    ULONGLONG next_usn;                    /* the number of the next record */
+} winx_usn_journal;
+
+int winx_get_usn_journal(char volume_letter,winx_usn_journal *j);
+int winx_read_usn_journal(WINX_FILE *f,ULONGLONG journal_id,
+    ULONGLONG *usn,void *buffer,int size);
+
 /* winx_get_free_volume_regions flags */
 #define WINX_GVR_ALLOW_PARTIAL_SCAN  0x1
 
@@ -539,6 +591,11 @@ typedef int (*volume_region_callback)(winx_volume_region *reg,void *user_defined
 
 winx_volume_region *winx_get_free_volume_regions(char volume_letter,
         int flags,volume_region_callback cb,void *user_defined_data);
+winx_volume_region *winx_get_free_volume_regions_in_range(char volume_letter,
+        ULONGLONG lcn,ULONGLONG length);
+winx_volume_region *winx_bitmap_to_regions(const unsigned char *map,
+        ULONGLONG start_lcn,ULONGLONG clusters,
+        volume_region_callback cb,void *user_defined_data);
 winx_volume_region *winx_add_volume_region(winx_volume_region *rlist,
         ULONGLONG lcn,ULONGLONG length);
 winx_volume_region *winx_sub_volume_region(winx_volume_region *rlist,